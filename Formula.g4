@@ -9,10 +9,17 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | NAME '(' arg (',' arg)* ')'  # Function
     | CELL  # Cell
     | NUMBER  # Literal
     ;
 
+// a range is only allowed as an argument of a function
+arg
+    : CELL ':' CELL  # Range
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +34,5 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+NAME: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
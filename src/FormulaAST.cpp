@@ -1,14 +1,25 @@
 #include "FormulaAST.h"
 
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
 #include "../antlr4_formula/FormulaLexer.h"
 #include "../antlr4_formula/FormulaParser.h"
 #include "../antlr4_formula/FormulaBaseListener.h"
+#endif
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstddef>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+
+using namespace std::literals;
 
 namespace ASTImpl {
 
@@ -67,17 +78,26 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+class Expr;
+
+using ExprPtr = FormulaAST::ExprPtr;
+
 class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const CellValueGetter& get_cell_value) const = 0;
+    // shift is added to every cell reference
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position shift) const = 0;
+    // Appends postfix code computing the node's value and returns where the
+    // value is. Constant subtrees and leaves emit nothing: a number or a cell
+    // is returned to be embedded into the instruction that uses it. Ranges
+    // read by aggregate functions are appended to ranges.
+    virtual Operand Compile(std::pmr::vector<Instruction>& program, std::pmr::vector<Range>& ranges) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position shift,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +106,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, shift);
 
         if (parens_needed) {
             out << ')';
@@ -106,7 +126,7 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, ExprPtr lhs, ExprPtr rhs)
         : type_(type)
         , lhs_(std::move(lhs))
         , rhs_(std::move(rhs)) {
@@ -120,10 +140,10 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position shift) const override {
+        lhs_->PrintFormula(out, precedence, shift);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, shift, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -143,33 +163,104 @@ public:
         }
     }
 
-    double Evaluate(const CellValueGetter& get_cell_value) const override {
-        double lhs_value = lhs_->Evaluate(get_cell_value);
-        double rhs_value = rhs_->Evaluate(get_cell_value);
+    Operand Compile(std::pmr::vector<Instruction>& program, std::pmr::vector<Range>& ranges) const override {
+        Operand lhs = lhs_->Compile(program, ranges);
+        const size_t rhs_start = program.size();
+        Operand rhs = rhs_->Compile(program, ranges);
+
+        if (lhs.kind == OperandKind::Number && rhs.kind == OperandKind::Number) {
+            const double value = Apply(lhs.value.number, rhs.value.number);
+            // a division which fails is left to fail at run time
+            if (type_ != Divide || std::isfinite(value)) {
+                return Operand(value);
+            }
+        }
+        if (auto operand = Simplify(lhs, rhs)) {
+            return *operand;
+        }
+
+        // a stack rhs implies a stack lhs, so that the operands are still
+        // evaluated left to right
+        if (rhs.kind == OperandKind::Stack && lhs.kind != OperandKind::Stack) {
+            program.emplace(program.begin() + rhs_start, OpCode::Push, lhs);
+            lhs = Operand{};
+        }
+
         switch (type_) {
         case Add:
-            return lhs_value + rhs_value;
+            program.emplace_back(OpCode::Add, lhs, rhs);
+            break;
         case Subtract:
-            return lhs_value - rhs_value;
+            program.emplace_back(OpCode::Subtract, lhs, rhs);
+            break;
         case Multiply:
-            return lhs_value * rhs_value;
-        case Divide: {
-            if (!std::isfinite(lhs_value / rhs_value)) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs_value / rhs_value;
-        }
+            program.emplace_back(OpCode::Multiply, lhs, rhs);
+            break;
+        case Divide:
+            program.emplace_back(OpCode::Divide, lhs, rhs);
+            break;
         default:
             // have to do this because VC++ has a buggy warning
             assert(false);
-            return 0.0;
         }
+        return Operand{};
+    }
+
+private:
+    double Apply(double lhs, double rhs) const {
+        switch (type_) {
+        case Add:
+            return lhs + rhs;
+        case Subtract:
+            return lhs - rhs;
+        case Multiply:
+            return lhs * rhs;
+        default:
+            return lhs / rhs;
+        }
+    }
+
+    // Drops operations which return their other operand exactly, whatever
+    // it is: x*1, 1*x, x-0, x+(-0), (-0)+x. x+0 is not one of them, since
+    // -0+0 is +0. x/1 is kept because it reports Div0 for infinite x.
+    std::optional<Operand> Simplify(Operand lhs, Operand rhs) const {
+        auto is = [](Operand operand, double value) {
+            return operand.kind == OperandKind::Number && operand.value.number == value
+                && std::signbit(operand.value.number) == std::signbit(value);
+        };
+
+        switch (type_) {
+        case Add:
+            if (is(lhs, -0.0)) {
+                return rhs;
+            }
+            if (is(rhs, -0.0)) {
+                return lhs;
+            }
+            break;
+        case Subtract:
+            if (is(rhs, 0.0)) {
+                return lhs;
+            }
+            break;
+        case Multiply:
+            if (is(lhs, 1.0)) {
+                return rhs;
+            }
+            if (is(rhs, 1.0)) {
+                return lhs;
+            }
+            break;
+        default:
+            break;
+        }
+        return std::nullopt;
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    ExprPtr lhs_;
+    ExprPtr rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -180,7 +271,7 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, ExprPtr operand)
         : type_(type)
         , operand_(std::move(operand)) {
     }
@@ -191,22 +282,37 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position shift) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, shift);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const CellValueGetter& get_cell_value) const override {
-        return (type_ == Type::UnaryMinus) ? -operand_->Evaluate(get_cell_value) : operand_->Evaluate(get_cell_value);
+    Operand Compile(std::pmr::vector<Instruction>& program, std::pmr::vector<Range>& ranges) const override {
+        Operand operand = operand_->Compile(program, ranges);
+        // unary plus does not change the value
+        if (type_ == Type::UnaryPlus) {
+            return operand;
+        }
+        if (operand.kind == OperandKind::Number) {
+            return Operand(-operand.value.number);
+        }
+        // --x is x
+        if (operand.kind == OperandKind::Stack && program.back().op == OpCode::Negate) {
+            const Instruction negate = program.back();
+            program.pop_back();
+            return Operand(negate.lhs_kind, negate.lhs);
+        }
+        program.emplace_back(OpCode::Negate, operand);
+        return Operand{};
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    ExprPtr operand_;
 };
 
 class CellExpr final : public Expr {
@@ -224,16 +330,25 @@ public:
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position shift) const override {
+        if (!cell_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        }
+        else {
+            out << Position{ cell_->row + shift.row, cell_->col + shift.col }.ToString();
+        }
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const CellValueGetter& get_cell_value) const override {
-        return get_cell_value(*cell_);
+    Operand Compile(std::pmr::vector<Instruction>& /* program */, std::pmr::vector<Range>& /* ranges */) const override {
+        return Operand(*cell_);
+    }
+
+    const Position& GetCell() const {
+        return *cell_;
     }
 
 private:
@@ -250,7 +365,7 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* shift */) const override {
         out << value_;
     }
 
@@ -258,97 +373,610 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const CellValueGetter&) const override {
-        return value_;
+    Operand Compile(std::pmr::vector<Instruction>& /* program */, std::pmr::vector<Range>& /* ranges */) const override {
+        return Operand(value_);
     }
 
 private:
     double value_;
 };
 
-class ParseASTListener final : public FormulaBaseListener {
+// A range is only an argument of a function, which reads it itself.
+class RangeExpr final : public Expr {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    explicit RangeExpr(Range range)
+        : range_(range) {
+    }
 
-        return root;
+    const Range& GetRange() const {
+        return range_;
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    void Print(std::ostream& out) const override {
+        DoPrintFormula(out, EP_ATOM, Position{ 0, 0 });
     }
 
-public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position shift) const override {
+        if (!range_.IsValid()) {
+            out << FormulaError::Category::Ref;
+        }
+        else {
+            out << Range{ { range_.first.row + shift.row, range_.first.col + shift.col },
+                          { range_.last.row + shift.row, range_.last.col + shift.col } }.ToString();
+        }
+    }
 
-        auto operand = std::move(args_.back());
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
 
-        UnaryOpExpr::Type type;
-        if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+    Operand Compile(std::pmr::vector<Instruction>& /* program */, std::pmr::vector<Range>& /* ranges */) const override {
+        // compiled by FunctionExpr
+        assert(false);
+        return Operand{};
+    }
+
+private:
+    Range range_;
+};
+
+constexpr std::pair<std::string_view, Function> FUNCTION_NAMES[] = {
+    { "SUM"sv, Function::Sum },
+    { "AVERAGE"sv, Function::Average },
+    { "MIN"sv, Function::Min },
+    { "MAX"sv, Function::Max },
+    { "COUNT"sv, Function::Count },
+};
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (const auto& [function_name, function] : FUNCTION_NAMES) {
+        if (function_name == name) {
+            return function;
         }
-        else {
-            assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+    }
+    return std::nullopt;
+}
+
+std::string_view GetFunctionName(Function function) {
+    for (const auto& [function_name, named_function] : FUNCTION_NAMES) {
+        if (named_function == function) {
+            return function_name;
         }
+    }
+    assert(false);
+    return {};
+}
+
+// The cell of an aggregate function argument which is a single valid cell.
+// Such an argument is read as a one-cell range, so an empty cell or text
+// which is not a number is skipped just as in a range.
+const Position* GetCellArgument(const Expr& arg) {
+    const auto* cell = dynamic_cast<const CellExpr*>(&arg);
+    return cell && cell->GetCell().IsValid() ? &cell->GetCell() : nullptr;
+}
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+// An aggregate function. Arguments which are neither ranges nor single
+// cells are evaluated as usual expressions.
+class FunctionExpr final : public Expr {
+public:
+    FunctionExpr(Function function, std::pmr::vector<ExprPtr> args)
+        : function_(function)
+        , args_(std::move(args)) {
     }
 
-    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
+    void Print(std::ostream& out) const override {
+        out << '(' << GetFunctionName(function_);
+        for (const ExprPtr& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position shift) const override {
+        out << GetFunctionName(function_) << '(';
+        bool first = true;
+        for (const ExprPtr& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM, shift);
         }
+        out << ')';
+    }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
     }
 
-    void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaError(FormulaError::Category::Ref);
+    // Values of the arguments which are not read as ranges are pushed left to
+    // right, then the ranges of the function are appended to ranges after
+    // those of nested functions, so that they are contiguous. Arguments which
+    // are all constants are folded.
+    Operand Compile(std::pmr::vector<Instruction>& program, std::pmr::vector<Range>& ranges) const override {
+        const size_t start = program.size();
+        Call call{ function_, 0, 0, 0 };
+        AggregateTotals constants;
+        bool is_constant = true;
+        for (const ExprPtr& arg : args_) {
+            if (dynamic_cast<const RangeExpr*>(arg.get()) || GetCellArgument(*arg)) {
+                is_constant = false;
+                continue;
+            }
+            const Operand operand = arg->Compile(program, ranges);
+            if (operand.kind == OperandKind::Number) {
+                constants.Add(operand.value.number);
+            }
+            else {
+                is_constant = false;
+            }
+            if (operand.kind != OperandKind::Stack) {
+                program.emplace_back(OpCode::Push, operand);
+            }
+            ++call.stack_count;
+        }
+
+        if (is_constant && !GetErrorCategory(constants.GetResult(function_))) {
+            program.erase(program.begin() + start, program.end());
+            return Operand(constants.GetResult(function_));
         }
 
+        call.first_range = static_cast<uint16_t>(ranges.size());
+        for (const ExprPtr& arg : args_) {
+            if (const auto* range = dynamic_cast<const RangeExpr*>(arg.get())) {
+                ranges.push_back(range->GetRange());
+                ++call.range_count;
+            }
+            else if (const Position* cell = GetCellArgument(*arg)) {
+                ranges.push_back(Range{ *cell, *cell });
+                ++call.range_count;
+            }
+        }
+
+        OperandValue value;
+        value.call = call;
+        program.emplace_back(OpCode::Aggregate, Operand(OperandKind::Stack, value));
+        return Operand{};
+    }
+
+private:
+    Function function_;
+    std::pmr::vector<ExprPtr> args_;
+};
+
+// Builds the tree bottom-up: operands are added before the operation that
+// consumes them. Both parsers drive the same builder, so they produce
+// identical trees and cell lists.
+class ASTBuilder {
+public:
+    explicit ASTBuilder(std::pmr::memory_resource* resource)
+        : resource_(resource)
+        , scratch_(scratch_buffer_.data(), scratch_buffer_.size())
+        , args_(&scratch_)
+        , cells_(resource) {
+        args_.reserve(16);
+    }
+
+    void AddNumber(std::string_view text) {
+        double value = 0.0;
+        const char* end = text.data() + text.size();
+        const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+        if (ec == std::errc::result_out_of_range && text.find_first_of("eE") != text.npos
+            && text.find('-') != text.npos) {
+            // too small to be represented, std::istream reads it as zero
+            value = 0.0;
+        }
+        else if (ec != std::errc() || ptr != end) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+
+        args_.push_back(MakeArenaPtr<NumberExpr>(resource_, value));
+    }
+
+    // The error for an invalid position is reported by Build(), so that a
+    // syntax error later in the formula takes precedence over it.
+    void AddCell(std::string_view text) {
+        const Position value = Position::FromString(text);
+        has_invalid_cell_ |= !value.IsValid();
+
         cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        args_.push_back(MakeArenaPtr<CellExpr>(resource_, &cells_.front()));
     }
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+    // Corners may be given in any order, the range is stored from its top
+    // left to its bottom right cell.
+    void AddRange(std::string_view first_text, std::string_view last_text) {
+        const Position first = Position::FromString(first_text);
+        const Position last = Position::FromString(last_text);
+        has_invalid_cell_ |= !first.IsValid() || !last.IsValid();
+
+        if (++range_count_ > UINT16_MAX) {
+            throw ParsingError("Too many ranges");
+        }
+        const Range range{ { std::min(first.row, last.row), std::min(first.col, last.col) },
+                           { std::max(first.row, last.row), std::max(first.col, last.col) } };
+        args_.push_back(MakeArenaPtr<RangeExpr>(resource_, range));
+    }
+
+    void ApplyFunction(std::string_view name, size_t arg_count) {
+        assert(arg_count >= 1 && args_.size() >= arg_count);
+
+        const std::optional<Function> function = FindFunction(name);
+        if (!function) {
+            throw ParsingError("Unknown function: " + std::string(name));
+        }
+        if (arg_count > UINT16_MAX) {
+            throw ParsingError("Too many arguments of " + std::string(name));
+        }
+
+        std::pmr::vector<ExprPtr> args(resource_);
+        args.reserve(arg_count);
+        std::move(args_.end() - arg_count, args_.end(), std::back_inserter(args));
+        // single cell arguments are read as ranges too
+        for (const ExprPtr& arg : args) {
+            if (GetCellArgument(*arg) && ++range_count_ > UINT16_MAX) {
+                throw ParsingError("Too many ranges");
+            }
+        }
+        args_.erase(args_.end() - arg_count, args_.end());
+        args_.push_back(MakeArenaPtr<FunctionExpr>(resource_, *function, std::move(args)));
+    }
+
+    void ApplyUnaryOp(UnaryOpExpr::Type type) {
+        assert(args_.size() >= 1);
+
+        auto operand = std::move(args_.back());
+        args_.back() = MakeArenaPtr<UnaryOpExpr>(resource_, type, std::move(operand));
+    }
+
+    void ApplyBinaryOp(BinaryOpExpr::Type type) {
         assert(args_.size() >= 2);
 
         auto rhs = std::move(args_.back());
         args_.pop_back();
 
         auto lhs = std::move(args_.back());
+        args_.back() = MakeArenaPtr<BinaryOpExpr>(resource_, type, std::move(lhs), std::move(rhs));
+    }
+
+    FormulaAST Build() {
+        if (has_invalid_cell_) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+
+        assert(args_.size() == 1);
+        auto root = std::move(args_.front());
+        args_.clear();
+
+        return FormulaAST(std::move(root), std::move(cells_));
+    }
+
+private:
+    std::pmr::memory_resource* resource_;
+    // operands waiting for their operation live on the stack unless the
+    // formula is deeply nested
+    alignas(ExprPtr) std::array<std::byte, 16 * sizeof(ExprPtr)> scratch_buffer_;
+    std::pmr::monotonic_buffer_resource scratch_;
+    std::pmr::vector<ExprPtr> args_;
+    FormulaAST::CellList cells_;
+    size_t range_count_ = 0;
+    bool has_invalid_cell_ = false;
+};
+
+// -----------------------------------------------------------------------------
+
+// Splits a formula into the tokens of Formula.g4. Tokens refer to the
+// input, nothing is copied.
+class ExpressionLexer {
+public:
+    struct Token {
+        enum Kind {
+            Number,
+            Cell,
+            Name,
+            Add,
+            Sub,
+            Mul,
+            Div,
+            LeftParen,
+            RightParen,
+            Colon,
+            Comma,
+            End,
+        };
+
+        Kind kind;
+        std::string_view text;
+    };
+
+public:
+    explicit ExpressionLexer(std::string_view input)
+        : input_(input) {
+        current_ = Scan();
+    }
+
+    const Token& Peek() const {
+        return current_;
+    }
+
+    // the token after Peek()
+    const Token& PeekNext() {
+        if (!next_) {
+            next_ = Scan();
+        }
+        return *next_;
+    }
+
+    Token Next() {
+        Token token = current_;
+        current_ = next_ ? *next_ : Scan();
+        next_.reset();
+        return token;
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < input_.size() && IsDigit(input_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    Token Scan() {
+        while (pos_ < input_.size()
+            && (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+            ++pos_;
+        }
+        if (pos_ == input_.size()) {
+            return { Token::End, {} };
+        }
+
+        const size_t start = pos_;
+        const char c = input_[pos_];
+        if (IsDigit(c) || c == '.') {
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            size_t end = SkipDigits(pos_);
+            if (end < input_.size() && input_[end] == '.') {
+                const size_t fraction_end = SkipDigits(end + 1);
+                if (fraction_end == end + 1) {
+                    throw ParsingError("Error when lexing: unexpected '.' at " + std::to_string(end));
+                }
+                end = fraction_end;
+            }
+            if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+                size_t exponent = end + 1;
+                if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+                    ++exponent;
+                }
+                const size_t exponent_end = SkipDigits(exponent);
+                if (exponent_end > exponent) {
+                    end = exponent_end;
+                }
+            }
+            pos_ = end;
+            return { Token::Number, input_.substr(start, end - start) };
+        }
+        if (IsUpper(c)) {
+            // CELL: [A-Z]+[0-9]+, NAME: [A-Z]+
+            size_t letters_end = pos_;
+            while (letters_end < input_.size() && IsUpper(input_[letters_end])) {
+                ++letters_end;
+            }
+            const size_t end = SkipDigits(letters_end);
+            pos_ = end;
+            return { (end == letters_end) ? Token::Name : Token::Cell, input_.substr(start, end - start) };
+        }
+
+        ++pos_;
+        switch (c) {
+        case '+':
+            return { Token::Add, input_.substr(start, 1) };
+        case '-':
+            return { Token::Sub, input_.substr(start, 1) };
+        case '*':
+            return { Token::Mul, input_.substr(start, 1) };
+        case '/':
+            return { Token::Div, input_.substr(start, 1) };
+        case '(':
+            return { Token::LeftParen, input_.substr(start, 1) };
+        case ')':
+            return { Token::RightParen, input_.substr(start, 1) };
+        case ':':
+            return { Token::Colon, input_.substr(start, 1) };
+        case ',':
+            return { Token::Comma, input_.substr(start, 1) };
+        default:
+            throw ParsingError("Error when lexing: unexpected '" + std::string(1, c) + "' at " + std::to_string(start));
+        }
+    }
+
+private:
+    std::string_view input_;
+    size_t pos_ = 0;
+    Token current_;
+    std::optional<Token> next_;
+};
+
+// Recursive descent parser for Formula.g4 with the precedences ANTLR derives
+// from the order of its alternatives: unary operators bind tighter than
+// * and /, which bind tighter than + and -; binary operators are left
+// associative.
+class ExpressionParser {
+    using Token = ExpressionLexer::Token;
+
+public:
+    ExpressionParser(std::string_view expression, ASTBuilder& builder)
+        : lexer_(expression)
+        , builder_(builder) {
+    }
+
+    void Parse() {
+        ParseSum();
+        if (lexer_.Peek().kind != Token::End) {
+            Fail();
+        }
+    }
+
+private:
+    void ParseSum() {
+        ParseProduct();
+        while (lexer_.Peek().kind == Token::Add || lexer_.Peek().kind == Token::Sub) {
+            const auto type = (lexer_.Next().kind == Token::Add) ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+            ParseProduct();
+            builder_.ApplyBinaryOp(type);
+        }
+    }
+
+    void ParseProduct() {
+        ParseUnary();
+        while (lexer_.Peek().kind == Token::Mul || lexer_.Peek().kind == Token::Div) {
+            const auto type = (lexer_.Next().kind == Token::Mul) ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+            ParseUnary();
+            builder_.ApplyBinaryOp(type);
+        }
+    }
+
+    void ParseUnary() {
+        if (lexer_.Peek().kind == Token::Add || lexer_.Peek().kind == Token::Sub) {
+            const auto type = (lexer_.Next().kind == Token::Add) ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+            ParseUnary();
+            builder_.ApplyUnaryOp(type);
+            return;
+        }
+        ParsePrimary();
+    }
+
+    void ParsePrimary() {
+        switch (lexer_.Peek().kind) {
+        case Token::Number:
+            builder_.AddNumber(lexer_.Next().text);
+            break;
+        case Token::Cell:
+            builder_.AddCell(lexer_.Next().text);
+            break;
+        case Token::Name:
+            ParseFunction();
+            break;
+        case Token::LeftParen:
+            lexer_.Next();
+            ParseSum();
+            if (lexer_.Peek().kind != Token::RightParen) {
+                Fail();
+            }
+            lexer_.Next();
+            break;
+        default:
+            Fail();
+        }
+    }
+
+    // NAME '(' arg (',' arg)* ')'
+    void ParseFunction() {
+        const std::string_view name = lexer_.Next().text;
+        Expect(Token::LeftParen);
+        ParseArgument();
+        size_t arg_count = 1;
+        while (lexer_.Peek().kind == Token::Comma) {
+            lexer_.Next();
+            ParseArgument();
+            ++arg_count;
+        }
+        Expect(Token::RightParen);
+        builder_.ApplyFunction(name, arg_count);
+    }
+
+    // CELL ':' CELL | expr
+    void ParseArgument() {
+        if (lexer_.Peek().kind != Token::Cell || lexer_.PeekNext().kind != Token::Colon) {
+            ParseSum();
+            return;
+        }
+        const std::string_view first = lexer_.Next().text;
+        lexer_.Next();
+        if (lexer_.Peek().kind != Token::Cell) {
+            Fail();
+        }
+        builder_.AddRange(first, lexer_.Next().text);
+    }
+
+    void Expect(Token::Kind kind) {
+        if (lexer_.Peek().kind != kind) {
+            Fail();
+        }
+        lexer_.Next();
+    }
+
+    [[noreturn]] void Fail() const {
+        const Token& token = lexer_.Peek();
+        throw ParsingError("Error when parsing: "
+            + (token.kind == Token::End ? "<EOF>"s : std::string(token.text)));
+    }
+
+private:
+    ExpressionLexer lexer_;
+    ASTBuilder& builder_;
+};
+
+// -----------------------------------------------------------------------------
+
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
+
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    explicit ParseASTListener(ASTBuilder& builder)
+        : builder_(builder) {
+    }
+
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        if (ctx->SUB()) {
+            builder_.ApplyUnaryOp(UnaryOpExpr::UnaryMinus);
+        }
+        else {
+            assert(ctx->ADD() != nullptr);
+            builder_.ApplyUnaryOp(UnaryOpExpr::UnaryPlus);
+        }
+    }
+
+    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+        builder_.AddNumber(ctx->NUMBER()->getSymbol()->getText());
+    }
 
-        BinaryOpExpr::Type type;
+    void exitCell(FormulaParser::CellContext* ctx) override {
+        builder_.AddCell(ctx->CELL()->getSymbol()->getText());
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        builder_.AddRange(ctx->CELL(0)->getSymbol()->getText(), ctx->CELL(1)->getSymbol()->getText());
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        builder_.ApplyFunction(ctx->NAME()->getSymbol()->getText(), ctx->arg().size());
+    }
+
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            builder_.ApplyBinaryOp(BinaryOpExpr::Add);
         }
         else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            builder_.ApplyBinaryOp(BinaryOpExpr::Subtract);
         }
         else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            builder_.ApplyBinaryOp(BinaryOpExpr::Multiply);
         }
         else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            builder_.ApplyBinaryOp(BinaryOpExpr::Divide);
         }
-
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -356,8 +984,7 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    ASTBuilder& builder_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -370,24 +997,70 @@ public:
     }
 };
 
+#endif
+
 } // namespace
 
 } // namespace ASTImpl
 
 // -----------------------------------------------------------------------------
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(ExprPtr root_expr, CellList cells)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , program_(cells_.get_allocator().resource())
+    , ranges_(cells_.get_allocator().resource()) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
-}
 
-FormulaAST::~FormulaAST() = default;
+    // compile into a scratch buffer first, so that the program itself takes
+    // a single allocation of the exact size
+    alignas(ASTImpl::Instruction) std::array<std::byte, 1024> buffer;
+    std::pmr::monotonic_buffer_resource scratch(buffer.data(), buffer.size());
+    std::pmr::vector<ASTImpl::Instruction> program(&scratch);
+    RangeList ranges(&scratch);
+    // a constant formula or a single cell is pushed as is
+    if (ASTImpl::Operand result = root_expr_->Compile(program, ranges); result.kind != ASTImpl::OperandKind::Stack) {
+        program.emplace_back(ASTImpl::OpCode::Push, result);
+    }
+    program_.assign(program.begin(), program.end());
+    ranges_.assign(ranges.begin(), ranges.end());
+
+    // the slot of a cell is the index of its first occurrence in cells_
+    std::pmr::vector<Position> sorted_cells(cells_.begin(), cells_.end(), &scratch);
+    auto find_slot = [&sorted_cells](const ASTImpl::OperandValue& value) {
+        const size_t slot = std::lower_bound(sorted_cells.begin(), sorted_cells.end(), value.cell) - sorted_cells.begin();
+        return static_cast<uint16_t>(std::min<size_t>(slot, ASTImpl::NO_SLOT));
+    };
+    for (ASTImpl::Instruction& instruction : program_) {
+        if (instruction.lhs_kind == ASTImpl::OperandKind::Cell) {
+            instruction.lhs_slot = find_slot(instruction.lhs);
+        }
+        if (instruction.rhs_kind == ASTImpl::OperandKind::Cell) {
+            instruction.rhs_slot = find_slot(instruction.rhs);
+        }
+    }
 
-double FormulaAST::Execute(const CellValueGetter & get_cell_value) const {
-    return root_expr_->Evaluate(get_cell_value);
+    // every instruction pops its stack operands and pushes the result
+    size_t depth = 0;
+    for (const ASTImpl::Instruction& instruction : program_) {
+        if (instruction.op == ASTImpl::OpCode::Aggregate) {
+            depth -= instruction.lhs.call.stack_count;
+            stack_size_ = std::max(stack_size_, ++depth);
+            continue;
+        }
+        depth -= (instruction.lhs_kind == ASTImpl::OperandKind::Stack);
+        if (instruction.op != ASTImpl::OpCode::Push && instruction.op != ASTImpl::OpCode::Negate) {
+            depth -= (instruction.rhs_kind == ASTImpl::OperandKind::Stack);
+        }
+        stack_size_ = std::max(stack_size_, ++depth);
+    }
+    assert(depth == 1);
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
+FormulaAST::~FormulaAST() = default;
+
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
         out << cell.ToString() << ' ';
@@ -399,15 +1072,61 @@ void FormulaAST::Print(std::ostream& out) const {
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    PrintFormula(out, Position{ 0, 0 });
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, shift);
 }
 
 // -----------------------------------------------------------------------------
 
-FormulaAST ParseFormulaAST(std::istream & in) {
+FormulaAST ParseFormulaAST(std::string_view expression, std::pmr::memory_resource* resource) {
+    ASTImpl::ASTBuilder builder(resource);
+    ASTImpl::ExpressionParser(expression, builder).Parse();
+    return builder.Build();
+}
+
+FormulaAST ParseFormulaAST(std::istream& in, std::pmr::memory_resource* resource) {
+    const std::string expression(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(std::string_view(expression), resource);
+}
+
+bool AppendRelativeFormulaKey(std::string_view expression, Position origin, std::string& key) {
+    using Token = ASTImpl::ExpressionLexer::Token;
+
+    try {
+        ASTImpl::ExpressionLexer lexer(expression);
+        for (Token token = lexer.Next(); token.kind != Token::End; token = lexer.Next()) {
+            if (token.kind != Token::Cell) {
+                key += token.text;
+                // keeps "1 2" and "12" apart
+                key += ' ';
+                continue;
+            }
+            const Position cell = Position::FromString(token.text);
+            if (!cell.IsValid()) {
+                return false;
+            }
+            key += '[';
+            key += std::to_string(cell.row - origin.row);
+            key += ',';
+            key += std::to_string(cell.col - origin.col);
+            key += ']';
+        }
+    }
+    catch (const ParsingError&) {
+        return false;
+    }
+    return true;
+}
+
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
+
+FormulaAST ParseFormulaASTWithAntlr(std::string_view expression, std::pmr::memory_resource* resource) {
     using namespace antlr4;
 
-    ANTLRInputStream input(in);
+    ANTLRInputStream input(expression.data(), expression.size());
 
     FormulaLexer lexer(&input);
     ASTImpl::BailErrorListener error_listener;
@@ -421,14 +1140,19 @@ FormulaAST ParseFormulaAST(std::istream & in) {
     parser.setErrorHandler(error_handler);
     parser.removeErrorListeners();
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    tree::ParseTree* tree = nullptr;
+    try {
+        tree = parser.main();
+    }
+    catch (const ParseCancellationException& e) {
+        // BailErrorStrategy reports syntax errors this way
+        throw ParsingError("Error when parsing: "s + e.what());
+    }
+    ASTImpl::ASTBuilder builder(resource);
+    ASTImpl::ParseASTListener listener(builder);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return builder.Build();
 }
 
-FormulaAST ParseFormulaAST(const std::string & in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
-}
+#endif
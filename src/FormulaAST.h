@@ -1,16 +1,116 @@
 #pragma once
 
-#include "../antlr4_formula/FormulaLexer.h"
+#include "arena.h"
 #include "common.h"
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <forward_list>
-#include <functional>
+#include <iosfwd>
+#include <limits>
+#include <memory_resource>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 // -----------------------------------------------------------------------------
 
 namespace ASTImpl {
 class Expr;
+
+enum class OpCode : uint8_t {
+    Push,      // push lhs
+    Add,       // push lhs + rhs
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,    // push -lhs
+    Aggregate, // push an aggregate function of its arguments, see Call
+};
+
+enum class Function : uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// Arguments of an aggregate function: stack_count values popped from the
+// stack and range_count ranges of FormulaAST::GetRanges() from first_range on.
+struct Call {
+    Function function;
+    uint16_t stack_count;
+    uint16_t first_range;
+    uint16_t range_count;
+};
+
+// Where an instruction takes an operand from. Numbers and cells are embedded
+// into the instruction that uses them, which keeps the number of dispatched
+// instructions close to the number of operations.
+enum class OperandKind : uint8_t {
+    Stack,     // popped from the evaluation stack
+    Number,
+    Cell,
+};
+
+union OperandValue {
+    OperandValue()
+        : number(0.0) {
+    }
+
+    double number;
+    Position cell;
+    Call call;
+};
+
+struct Operand {
+    Operand() = default;
+    explicit Operand(double value)
+        : kind(OperandKind::Number) {
+        this->value.number = value;
+    }
+    explicit Operand(Position pos)
+        : kind(OperandKind::Cell) {
+        value.cell = pos;
+    }
+    Operand(OperandKind kind, OperandValue value)
+        : kind(kind)
+        , value(value) {
+    }
+
+    OperandKind kind = OperandKind::Stack;
+    OperandValue value;
+};
+
+// Cells past this many in a formula have no slot.
+constexpr uint16_t NO_SLOT = UINT16_MAX;
+
+// One step of a compiled formula. Operands are stored inline, so the whole
+// program is a single contiguous array. When both operands come from the
+// stack, rhs is on the top.
+struct Instruction {
+    Instruction(OpCode op, Operand lhs, Operand rhs = {})
+        : op(op)
+        , lhs_kind(lhs.kind)
+        , rhs_kind(rhs.kind)
+        , lhs(lhs.value)
+        , rhs(rhs.value) {
+    }
+
+    OpCode op;
+    OperandKind lhs_kind;
+    OperandKind rhs_kind;
+    // index of a cell operand in FormulaAST::GetCells(), see Execute()
+    uint16_t lhs_slot = NO_SLOT;
+    uint16_t rhs_slot = NO_SLOT;
+    OperandValue lhs;
+    OperandValue rhs;
+};
 }
 
 // -----------------------------------------------------------------------------
@@ -21,42 +121,306 @@ class ParsingError : public std::runtime_error {
 
 // -----------------------------------------------------------------------------
 
-using CellValueGetter = std::function<double(Position)>;
+// Formula errors travel through evaluation as quiet NaNs carrying the error
+// category in the payload, so arithmetic propagates them without branches or
+// exceptions. NaNs produced by arithmetic itself (inf-inf) have an empty
+// payload and are not errors. When both operands are NaNs, the hardware keeps
+// one of them, which is fine: any of the errors may be reported.
+namespace ASTImpl {
+constexpr uint64_t ERROR_VALUE_TAG = 0x7FF8'E000'0000'0000;
+constexpr uint64_t SIGN_BIT = 0x8000'0000'0000'0000;
+constexpr uint64_t CATEGORY_MASK = 0xFF;
+}
+
+inline double MakeErrorValue(FormulaError::Category category) {
+    const uint64_t bits = ASTImpl::ERROR_VALUE_TAG | static_cast<uint64_t>(category);
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// nullopt for numbers, including NaNs which are not errors
+inline std::optional<FormulaError::Category> GetErrorCategory(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    // negation only flips the sign
+    bits &= ~ASTImpl::SIGN_BIT;
+    if ((bits & ~ASTImpl::CATEGORY_MASK) != ASTImpl::ERROR_VALUE_TAG) {
+        return std::nullopt;
+    }
+    return static_cast<FormulaError::Category>(bits & ASTImpl::CATEGORY_MASK);
+}
+
+// -----------------------------------------------------------------------------
+
+// Running totals of an aggregate function over the values of its arguments.
+// Empty cells and text which is not a number are skipped before they get
+// here. COUNT ignores errors, the other functions return the first one met.
+struct AggregateTotals {
+    void Add(double value) {
+        if (GetErrorCategory(value)) {
+            AddError(value);
+            return;
+        }
+        sum += value;
+        if (value < min) {
+            min = value;
+        }
+        if (value > max) {
+            max = value;
+        }
+        ++count;
+    }
+
+    void AddError(double error_value) {
+        if (!error) {
+            error = error_value;
+        }
+    }
+
+    // Totals of both argument lists.
+    void Merge(const AggregateTotals& other) {
+        sum += other.sum;
+        min = (other.min < min) ? other.min : min;
+        max = (other.max > max) ? other.max : max;
+        count += other.count;
+        if (!error) {
+            error = other.error;
+        }
+    }
+
+    double GetResult(ASTImpl::Function function) const {
+        using ASTImpl::Function;
+        if (function == Function::Count) {
+            return static_cast<double>(count);
+        }
+        if (error) {
+            return *error;
+        }
+        switch (function) {
+        case Function::Sum:
+            return sum;
+        case Function::Average:
+            return count ? sum / count : MakeErrorValue(FormulaError::Category::Div0);
+        case Function::Min:
+            return count ? min : 0.0;
+        default:
+            return count ? max : 0.0;
+        }
+    }
+
+    double sum = 0.0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    size_t count = 0;
+    std::optional<double> error;
+};
 
 // -----------------------------------------------------------------------------
 
 class FormulaAST {
 public:
+    using ExprPtr = ArenaPtr<ASTImpl::Expr>;
+    using CellList = std::pmr::forward_list<Position>;
+    using RangeList = std::pmr::vector<Range>;
+
     explicit FormulaAST(
-        std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+        ExprPtr root_expr,
+        CellList cells);
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const CellValueGetter& get_cell_value) const;
+    // Runs the postfix program compiled in the constructor. get_cell_value is
+    // any callable double(Position) returning MakeErrorValue() for cells with
+    // errors; a lambda is inlined into the loop. A callable
+    // double(Position, size_t slot) also gets the index of the cell in
+    // GetCells(), or ASTImpl::NO_SLOT, so that it can look the cell up in an
+    // array bound in advance. Returns the number or the error value of the
+    // formula and never throws.
+    // Every cell of a range is read with get_cell_value and counts as a
+    // number.
+    template <typename Getter>
+    double Execute(const Getter& get_cell_value) const;
+
+    // The same, but aggregate_range(ASTImpl::Function, const Range&,
+    // AggregateTotals&) adds the values of a range to the totals.
+    template <typename Getter, typename Aggregator>
+    double Execute(const Getter& get_cell_value, const Aggregator& aggregate_range) const;
+
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // prints the formula with every cell reference moved by shift
+    void PrintFormula(std::ostream& out, Position shift) const;
 
-    std::forward_list<Position>& GetCells() {
+    CellList& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const CellList& GetCells() const {
         return cells_;
     }
 
+    // Ranges read by aggregate functions, in the order the program reads
+    // them. Their cells are not in GetCells().
+    const RangeList& GetRanges() const {
+        return ranges_;
+    }
+
+    // number of instructions Execute runs
+    size_t GetProgramSize() const {
+        return program_.size();
+    }
+
+private:
+    using Program = std::pmr::vector<ASTImpl::Instruction>;
+
+    // stack depths up to this one are evaluated without allocation
+    static constexpr size_t INLINE_STACK_SIZE = 32;
+
+    template <typename Getter, typename Aggregator>
+    static double Run(const Program& program, const RangeList& ranges, double* stack,
+        const Getter& get_cell_value, const Aggregator& aggregate_range);
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // the tree is kept for printing only
+    ExprPtr root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    CellList cells_;
+
+    Program program_;
+    RangeList ranges_;
+    size_t stack_size_ = 0;
 };
 
+template <typename Getter>
+double FormulaAST::Execute(const Getter& get_cell_value) const {
+    return Execute(get_cell_value, [&get_cell_value](ASTImpl::Function, const Range& range, AggregateTotals& totals) {
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                if constexpr (std::is_invocable_v<const Getter&, Position, size_t>) {
+                    totals.Add(get_cell_value(Position{ row, col }, ASTImpl::NO_SLOT));
+                }
+                else {
+                    totals.Add(get_cell_value(Position{ row, col }));
+                }
+            }
+        }
+    });
+}
+
+template <typename Getter, typename Aggregator>
+double FormulaAST::Execute(const Getter& get_cell_value, const Aggregator& aggregate_range) const {
+    if (stack_size_ <= INLINE_STACK_SIZE) {
+        double stack[INLINE_STACK_SIZE];
+        return Run(program_, ranges_, stack, get_cell_value, aggregate_range);
+    }
+    std::vector<double> stack(stack_size_);
+    return Run(program_, ranges_, stack.data(), get_cell_value, aggregate_range);
+}
+
+template <typename Getter, typename Aggregator>
+double FormulaAST::Run(const Program& program, const RangeList& ranges, double* stack,
+    const Getter& get_cell_value, const Aggregator& aggregate_range) {
+    using ASTImpl::OpCode;
+
+    using ASTImpl::OperandKind;
+
+    // top points past the last pushed value
+    double* top = stack;
+    auto load = [&top, &get_cell_value](OperandKind kind, const ASTImpl::OperandValue& value, size_t slot) {
+        switch (kind) {
+        case OperandKind::Number:
+            return value.number;
+        case OperandKind::Cell:
+            if constexpr (std::is_invocable_v<const Getter&, Position, size_t>) {
+                return static_cast<double>(get_cell_value(value.cell, slot));
+            }
+            else {
+                return static_cast<double>(get_cell_value(value.cell));
+            }
+        default:
+            return *--top;
+        }
+    };
+
+    for (const ASTImpl::Instruction& instruction : program) {
+        if (instruction.op == OpCode::Push || instruction.op == OpCode::Negate) {
+            const double value = load(instruction.lhs_kind, instruction.lhs, instruction.lhs_slot);
+            *top++ = (instruction.op == OpCode::Negate) ? -value : value;
+            continue;
+        }
+
+        if (instruction.op == OpCode::Aggregate) {
+            const ASTImpl::Call& call = instruction.lhs.call;
+            AggregateTotals totals;
+            top -= call.stack_count;
+            for (size_t i = 0; i < call.stack_count; ++i) {
+                totals.Add(top[i]);
+            }
+            for (size_t i = 0; i < call.range_count; ++i) {
+                aggregate_range(call.function, ranges[call.first_range + i], totals);
+            }
+            *top++ = totals.GetResult(call.function);
+            continue;
+        }
+
+        // a stack rhs implies a stack lhs, otherwise operands are read left to right
+        double lhs;
+        double rhs;
+        if (instruction.rhs_kind == OperandKind::Stack) {
+            rhs = *--top;
+            lhs = *--top;
+        }
+        else {
+            lhs = load(instruction.lhs_kind, instruction.lhs, instruction.lhs_slot);
+            rhs = load(instruction.rhs_kind, instruction.rhs, instruction.rhs_slot);
+        }
+
+        switch (instruction.op) {
+        case OpCode::Add:
+            *top++ = lhs + rhs;
+            break;
+        case OpCode::Subtract:
+            *top++ = lhs - rhs;
+            break;
+        case OpCode::Multiply:
+            *top++ = lhs * rhs;
+            break;
+        default:
+            // an error in the operands wins over the division by zero
+            *top++ = (std::isfinite(lhs / rhs) || GetErrorCategory(lhs / rhs))
+                ? lhs / rhs
+                : MakeErrorValue(FormulaError::Category::Div0);
+        }
+    }
+    return stack[0];
+}
+
 // -----------------------------------------------------------------------------
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// AST nodes and the cell list are allocated from the given memory resource,
+// which must outlive the returned FormulaAST.
+// Throws ParsingError for a syntactically incorrect formula and FormulaError
+// with the Ref category for a reference to a cell outside the sheet.
+FormulaAST ParseFormulaAST(std::string_view expression,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+FormulaAST ParseFormulaAST(std::istream& in,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// Appends to key the tokens of expression with every cell reference written
+// as its offset from origin (R1C1-style). Formulas that differ only by a shift
+// of all their references together with their cell get equal keys. Returns
+// false if the expression cannot be tokenized or refers to an invalid cell.
+bool AppendRelativeFormulaKey(std::string_view expression, Position origin, std::string& key);
+
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
+// Reference implementation on top of the parser ANTLR generates from
+// Formula.g4. Builds the same tree as ParseFormulaAST.
+FormulaAST ParseFormulaASTWithAntlr(std::string_view expression,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+#endif
@@ -0,0 +1,39 @@
+#include "arena.h"
+
+CountingResource::CountingResource(std::pmr::memory_resource* upstream)
+    : upstream_(upstream) {
+}
+
+void* CountingResource::do_allocate(size_t bytes, size_t alignment) {
+    void* ptr = upstream_->allocate(bytes, alignment);
+    ++allocations_;
+    bytes_allocated_ += bytes;
+    return ptr;
+}
+
+void CountingResource::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    ++deallocations_;
+    upstream_->deallocate(p, bytes, alignment);
+}
+
+bool CountingResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+// -----------------------------------------------------------------------------
+
+Arena::Arena()
+    : upstream_counter_(std::pmr::new_delete_resource())
+    , pool_(&upstream_counter_)
+    , counter_(&pool_) {
+}
+
+AllocationStats Arena::GetStats() const {
+    AllocationStats stats;
+    stats.allocations = counter_.GetAllocations();
+    stats.deallocations = counter_.GetDeallocations();
+    stats.bytes_allocated = counter_.GetBytesAllocated();
+    stats.upstream_allocations = upstream_counter_.GetAllocations();
+    stats.upstream_bytes = upstream_counter_.GetBytesAllocated();
+    return stats;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Счётчики выделений памяти.
+struct AllocationStats {
+    // Запросы к арене и освобождения через неё.
+    size_t allocations = 0;
+    size_t deallocations = 0;
+    size_t bytes_allocated = 0;
+    // Запросы, которые арена передала системному аллокатору.
+    size_t upstream_allocations = 0;
+    size_t upstream_bytes = 0;
+};
+
+// Ресурс памяти, подсчитывающий выделения и передающий их в upstream.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream);
+
+    size_t GetAllocations() const {
+        return allocations_;
+    }
+    size_t GetDeallocations() const {
+        return deallocations_;
+    }
+    size_t GetBytesAllocated() const {
+        return bytes_allocated_;
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+private:
+    std::pmr::memory_resource* upstream_;
+    size_t allocations_ = 0;
+    size_t deallocations_ = 0;
+    size_t bytes_allocated_ = 0;
+};
+
+// Удаляет объект, созданный в ресурсе памяти. Запоминает размер
+// динамического типа, поэтому объект можно удалять через указатель на базовый
+// класс.
+template <typename T>
+class ArenaDeleter {
+public:
+    ArenaDeleter() = default;
+
+    ArenaDeleter(std::pmr::memory_resource* resource, size_t size)
+        : resource_(resource)
+        , size_(size) {
+    }
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    ArenaDeleter(const ArenaDeleter<U>& other)
+        : resource_(other.GetResource())
+        , size_(other.GetSize()) {
+    }
+
+    void operator()(T* ptr) const {
+        void* block = ptr;
+        if constexpr (std::is_polymorphic_v<T>) {
+            block = dynamic_cast<void*>(ptr);
+        }
+        ptr->~T();
+        resource_->deallocate(block, size_, alignof(std::max_align_t));
+    }
+
+    std::pmr::memory_resource* GetResource() const {
+        return resource_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    std::pmr::memory_resource* resource_ = nullptr;
+    size_t size_ = 0;
+};
+
+template <typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaDeleter<T>>;
+
+template <typename T, typename... Args>
+ArenaPtr<T> MakeArenaPtr(std::pmr::memory_resource* resource, Args&&... args) {
+    void* block = resource->allocate(sizeof(T), alignof(std::max_align_t));
+    try {
+        T* ptr = new (block) T(std::forward<Args>(args)...);
+        return ArenaPtr<T>(ptr, ArenaDeleter<T>(resource, sizeof(T)));
+    }
+    catch (...) {
+        resource->deallocate(block, sizeof(T), alignof(std::max_align_t));
+        throw;
+    }
+}
+
+// Арена таблицы: пул блоков фиксированных размеров поверх системного
+// аллокатора. Ячейки, их значения, узлы формул и связи между ячейками
+// выделяются из одного пула, который целиком возвращает память системе при
+// удалении арены.
+class Arena {
+public:
+    Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    std::pmr::memory_resource* GetResource() {
+        return &counter_;
+    }
+
+    template <typename T, typename... Args>
+    T* Create(Args&&... args) {
+        void* block = counter_.allocate(sizeof(T), alignof(T));
+        try {
+            return new (block) T(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            counter_.deallocate(block, sizeof(T), alignof(T));
+            throw;
+        }
+    }
+
+    template <typename T>
+    void Destroy(T* ptr) {
+        static_assert(!std::is_polymorphic_v<T> || std::is_final_v<T>,
+            "Destroy() needs the dynamic type of the object");
+        if (ptr) {
+            ptr->~T();
+            counter_.deallocate(ptr, sizeof(T), alignof(T));
+        }
+    }
+
+    AllocationStats GetStats() const;
+
+private:
+    CountingResource upstream_counter_;
+    std::pmr::unsynchronized_pool_resource pool_;
+    CountingResource counter_;
+};
@@ -0,0 +1,1189 @@
+#include "common.h"
+#include "dependency_graph.h"
+#include "export_buffer.h"
+#include "formula.h"
+#include "FormulaAST.h"
+#include "log_duration.h"
+#include "position.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "tiled_storage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+// -----------------------------------------------------------------------------
+
+struct Payload {
+    int value = 0;
+};
+
+// Прежняя раскладка Sheet::SheetList: строка растягивается до наибольшего
+// столбца, в который когда-либо писали.
+class VectorOfRowsStorage {
+public:
+    void Insert(Position pos, std::unique_ptr<Payload> value) {
+        if (rows_.size() <= static_cast<size_t>(pos.row)) {
+            rows_.resize(pos.row + 1);
+        }
+        if (rows_[pos.row].size() <= static_cast<size_t>(pos.col)) {
+            rows_[pos.row].resize(pos.col + 1);
+        }
+        rows_[pos.row][pos.col] = std::move(value);
+    }
+
+    const Payload* Find(Position pos) const {
+        if (rows_.size() <= static_cast<size_t>(pos.row) || rows_[pos.row].size() <= static_cast<size_t>(pos.col)) {
+            return nullptr;
+        }
+        return rows_[pos.row][pos.col].get();
+    }
+
+    long long ScanRows(int rows, int cols) const {
+        long long sum = 0;
+        for (int r = 0; r < rows; ++r) {
+            for (int c = 0; c < cols; ++c) {
+                if (const Payload* p = Find({ r, c })) {
+                    sum += p->value;
+                }
+            }
+        }
+        return sum;
+    }
+
+    size_t GetMemoryUsage() const {
+        size_t bytes = rows_.capacity() * sizeof(rows_.front());
+        for (const auto& row : rows_) {
+            bytes += row.capacity() * sizeof(std::unique_ptr<Payload>);
+        }
+        return bytes;
+    }
+
+private:
+    std::vector<std::vector<std::unique_ptr<Payload>>> rows_;
+};
+
+class TiledPayloadStorage {
+public:
+    void Insert(Position pos, std::unique_ptr<Payload> value) {
+        storage_.Insert(pos, std::move(value));
+    }
+
+    const Payload* Find(Position pos) const {
+        const auto* slot = storage_.Find(pos);
+        return slot ? slot->get() : nullptr;
+    }
+
+    long long ScanRows(int rows, int cols) const {
+        long long sum = 0;
+        for (int r = 0; r < rows; ++r) {
+            storage_.ForEachInRow(r, cols, [&sum](int, const std::unique_ptr<Payload>& p) {
+                sum += p->value;
+            });
+        }
+        return sum;
+    }
+
+    size_t GetMemoryUsage() const {
+        return storage_.GetMemoryUsage();
+    }
+
+private:
+    TiledStorage<std::unique_ptr<Payload>> storage_;
+};
+
+std::vector<Position> MakeClusteredPositions(int blocks, int block_rows, int block_cols) {
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> row_origin(0, Position::MAX_ROWS - block_rows);
+    std::uniform_int_distribution<int> col_origin(0, Position::MAX_COLS - block_cols);
+    std::vector<Position> positions;
+    for (int b = 0; b < blocks; ++b) {
+        Position origin{ row_origin(generator), col_origin(generator) };
+        for (int r = 0; r < block_rows; ++r) {
+            for (int c = 0; c < block_cols; ++c) {
+                positions.push_back({ origin.row + r, origin.col + c });
+            }
+        }
+    }
+    return positions;
+}
+
+std::vector<Position> MakeUniformPositions(int count, int rows, int cols) {
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<int> row(0, rows - 1);
+    std::uniform_int_distribution<int> col(0, cols - 1);
+    std::vector<Position> positions;
+    for (int i = 0; i < count; ++i) {
+        positions.push_back({ row(generator), col(generator) });
+    }
+    return positions;
+}
+
+template <typename Storage>
+void BenchmarkStorageLayout(const std::string& name, const std::vector<Position>& positions, int scan_rows, int scan_cols) {
+    Storage storage;
+    {
+        LOG_DURATION(name + " insert"s);
+        for (const Position& pos : positions) {
+            if (!storage.Find(pos)) {
+                storage.Insert(pos, std::make_unique<Payload>(Payload{ pos.row ^ pos.col }));
+            }
+        }
+    }
+    long long checksum = 0;
+    {
+        LOG_DURATION(name + " lookup"s);
+        for (const Position& pos : positions) {
+            checksum += storage.Find(pos) != nullptr;
+        }
+    }
+    {
+        LOG_DURATION(name + " row-major scan"s);
+        checksum += storage.ScanRows(scan_rows, scan_cols);
+    }
+    std::cerr << name << " memory: "sv << storage.GetMemoryUsage() / 1024 << " KiB (checksum "sv << checksum << ")"sv << std::endl;
+}
+
+void BenchmarkStorage() {
+    std::cerr << "--- Storage: single write to XFD16384 ---"sv << std::endl;
+    const std::vector<Position> corner = { { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } };
+    BenchmarkStorageLayout<VectorOfRowsStorage>("vector of rows"s, corner, Position::MAX_ROWS, Position::MAX_COLS);
+    BenchmarkStorageLayout<TiledPayloadStorage>("tiled"s, corner, Position::MAX_ROWS, Position::MAX_COLS);
+
+    std::cerr << "--- Storage: 400 blocks of 100x10 cells scattered over the sheet ---"sv << std::endl;
+    const auto clustered = MakeClusteredPositions(400, 100, 10);
+    BenchmarkStorageLayout<VectorOfRowsStorage>("vector of rows"s, clustered, Position::MAX_ROWS, Position::MAX_COLS);
+    BenchmarkStorageLayout<TiledPayloadStorage>("tiled"s, clustered, Position::MAX_ROWS, Position::MAX_COLS);
+
+    std::cerr << "--- Storage: 3% uniform fill of 2048x2048 ---"sv << std::endl;
+    const auto uniform = MakeUniformPositions(2048 * 2048 * 3 / 100, 2048, 2048);
+    BenchmarkStorageLayout<VectorOfRowsStorage>("vector of rows"s, uniform, 2048, 2048);
+    BenchmarkStorageLayout<TiledPayloadStorage>("tiled"s, uniform, 2048, 2048);
+}
+
+// -----------------------------------------------------------------------------
+
+// Каждая пятая ячейка - формула, ссылающаяся на соседнюю слева.
+void FillBulkSheet(Sheet& sheet, int rows, int cols) {
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            Position pos{ r, c };
+            if (c % 5 == 4) {
+                sheet.SetCell(pos, "=" + Position{ r, c - 1 }.ToString() + "*2+1");
+            }
+            else {
+                sheet.SetCell(pos, std::to_string(r * cols + c));
+            }
+        }
+    }
+}
+
+void BenchmarkBulkLoad() {
+    std::cerr << "--- Bulk load of 200000 cells (20% formulas) ---"sv << std::endl;
+    auto sheet = std::make_unique<Sheet>();
+    {
+        LOG_DURATION("bulk load"s);
+        FillBulkSheet(*sheet, 10000, 20);
+    }
+    const AllocationStats stats = sheet->GetAllocationStats();
+    std::cerr << "arena allocations: "sv << stats.allocations
+        << ", bytes: "sv << stats.bytes_allocated
+        << ", upstream allocations: "sv << stats.upstream_allocations
+        << ", upstream bytes: "sv << stats.upstream_bytes << std::endl;
+    {
+        LOG_DURATION("teardown"s);
+        sheet.reset();
+    }
+}
+
+// Формула из 10 ссылок на текстовые ячейки с числами вычисляется многократно.
+void BenchmarkTextCellReads() {
+    std::cerr << "--- 1000000 evaluations of a formula reading 10 numeric text cells ---"sv << std::endl;
+    Sheet sheet;
+    std::string expression;
+    for (int r = 0; r < 10; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r * 1.5));
+        expression += (r ? "+"s : ""s) + Position{ r, 0 }.ToString();
+    }
+    const auto formula = ParseFormula(expression);
+    double checksum = 0.0;
+    {
+        LOG_DURATION("evaluate"s);
+        for (int i = 0; i < 1000000; ++i) {
+            checksum += std::get<double>(formula->Evaluate(sheet));
+        }
+    }
+    std::cerr << "checksum: "sv << checksum << std::endl;
+}
+
+// Вычисление разобранных формул без обращения к таблице: одна горячая формула
+// и много разных формул, которые по очереди вытесняют друг друга из кэша.
+void BenchmarkFormulaExecution() {
+    constexpr int FORMULAS = 200000;
+    std::cerr << "--- Formula execution: 1000000 runs of one formula, 5 passes over "sv << FORMULAS << " formulas ---"sv << std::endl;
+    auto get_cell_value = [](Position pos) {
+        return static_cast<double>(pos.row + pos.col);
+    };
+
+    const FormulaAST hot = ParseFormulaAST("(A1+2)*(B2-3)/(C3+4)-(-D4+5.5)*(E5-6)+(F6*7-G7/8)"s);
+    double checksum = 0.0;
+    {
+        LOG_DURATION("one formula"s);
+        for (int i = 0; i < 1000000; ++i) {
+            checksum += hot.Execute(get_cell_value);
+        }
+    }
+
+    // constant subexpressions, as written by users for readability
+    const FormulaAST constants = ParseFormulaAST("A1*(60*60*24)/(365.25*24*60*60)*1+-(-(B2-0))"s);
+    {
+        LOG_DURATION("one formula with constants"s);
+        for (int i = 0; i < 1000000; ++i) {
+            checksum += constants.Execute(get_cell_value);
+        }
+    }
+
+    std::vector<FormulaAST> formulas;
+    formulas.reserve(FORMULAS);
+    for (int i = 0; i < FORMULAS; ++i) {
+        const std::string cell = Position{ i % Position::MAX_ROWS, i % 26 }.ToString();
+        formulas.push_back(ParseFormulaAST("("s + cell + "+"s + std::to_string(i) + ")*2-"s + cell + "/4"s));
+    }
+    {
+        LOG_DURATION("many formulas"s);
+        for (int pass = 0; pass < 5; ++pass) {
+            for (const FormulaAST& formula : formulas) {
+                checksum += formula.Execute(get_cell_value);
+            }
+        }
+    }
+    std::cerr << "checksum: "sv << checksum << std::endl;
+}
+
+// Разбор 500000 формул рукописным парсером и, если он собран, парсером ANTLR.
+void BenchmarkFormulaParsing() {
+    constexpr int FORMULAS = 500000;
+    std::cerr << "--- Parsing "sv << FORMULAS << " formulas ---"sv << std::endl;
+    std::vector<std::string> expressions;
+    expressions.reserve(FORMULAS);
+    for (int i = 0; i < FORMULAS; ++i) {
+        const std::string cell = Position{ i % Position::MAX_ROWS, i % 100 }.ToString();
+        expressions.push_back("("s + cell + "+"s + std::to_string(i) + ".5)*2-"s + cell + "/(B7+4e-2)"s);
+    }
+
+    auto parse_all = [&expressions](const std::string& name, auto parse) {
+        Arena arena;
+        size_t cells = 0;
+        {
+            LOG_DURATION(name);
+            for (const std::string& expression : expressions) {
+                const FormulaAST ast = parse(expression, arena.GetResource());
+                cells += std::distance(ast.GetCells().begin(), ast.GetCells().end());
+            }
+        }
+        std::cerr << "cells: "sv << cells << std::endl;
+    };
+    parse_all("hand-written parser"s, [](std::string_view expression, std::pmr::memory_resource* resource) {
+        return ParseFormulaAST(expression, resource);
+    });
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
+    parse_all("ANTLR parser"s, [](std::string_view expression, std::pmr::memory_resource* resource) {
+        return ParseFormulaASTWithAntlr(expression, resource);
+    });
+#endif
+}
+
+// Память на ячейку по счётчикам арены и время чтения значений.
+void BenchmarkCellReads() {
+    constexpr int ROWS = 10000;
+    constexpr int COLS = 10;
+    constexpr int CELLS = ROWS * COLS;
+    std::cerr << "--- Memory per cell and read latency, "sv << CELLS << " cells per kind ---"sv << std::endl;
+    std::cerr << "sizeof(Cell): "sv << sizeof(Cell) << std::endl;
+    auto measure = [](const std::string& name, auto make_text) {
+        Sheet sheet;
+        const size_t bytes_before = sheet.GetAllocationStats().bytes_allocated;
+        for (int i = 0; i < CELLS; ++i) {
+            sheet.SetCell(Position{ i % ROWS, i / ROWS }, make_text(i));
+        }
+        const AllocationStats stats = sheet.GetAllocationStats();
+        const size_t live_bytes = stats.bytes_allocated - bytes_before;
+        std::cerr << name << " arena bytes per cell (incl. freed temporaries): "sv << live_bytes / CELLS << std::endl;
+        for (int i = 0; i < CELLS; ++i) {
+            sheet.GetCell(Position{ i % ROWS, i / ROWS })->GetValue();
+        }
+        size_t checksum = 0;
+        {
+            LOG_DURATION(name + " 10 x GetValue"s);
+            for (int i = 0; i < 10; ++i) {
+                for (int j = 0; j < CELLS; ++j) {
+                    checksum += sheet.GetCell(Position{ j % ROWS, j / ROWS })->GetValue().index();
+                }
+            }
+        }
+        std::cerr << "checksum: "sv << checksum << std::endl;
+    };
+    measure("short text"s, [](int r) { return std::to_string(r); });
+    measure("long text"s, [](int r) { return "a rather long text value #"s + std::to_string(r); });
+    measure("formula"s, [](int r) { return "=1+"s + std::to_string(r); });
+}
+
+// Столбцы формул, заполненные вниз: 10 столбцов по 10000 формул одного вида.
+void BenchmarkFillDown() {
+    constexpr int ROWS = 10000;
+    constexpr int COLS = 10;
+    std::cerr << "--- Fill-down of "sv << COLS << " formula columns, "sv << ROWS << " rows each ---"sv << std::endl;
+    Sheet sheet;
+    for (int r = 0; r < ROWS; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+        sheet.SetCell(Position{ r, 1 }, std::to_string(r % 7));
+    }
+
+    std::vector<std::string> texts;
+    texts.reserve(ROWS * COLS);
+    for (int c = 0; c < COLS; ++c) {
+        for (int r = 0; r < ROWS; ++r) {
+            const std::string row = std::to_string(r + 1);
+            texts.push_back("=(A"s + row + "+"s + std::to_string(c) + ")*B"s + row + "-A"s + row + "/2"s);
+        }
+    }
+
+    const size_t bytes_before = sheet.GetAllocationStats().bytes_allocated;
+    {
+        LOG_DURATION("set formulas"s);
+        for (int i = 0; i < ROWS * COLS; ++i) {
+            sheet.SetCell(Position{ i % ROWS, 2 + i / ROWS }, std::move(texts[i]));
+        }
+    }
+    const AllocationStats stats = sheet.GetAllocationStats();
+    std::cerr << "arena bytes per formula cell (incl. freed temporaries): "sv
+        << (stats.bytes_allocated - bytes_before) / (ROWS * COLS) << std::endl;
+
+    double checksum = 0.0;
+    {
+        LOG_DURATION("evaluate"s);
+        for (int i = 0; i < ROWS * COLS; ++i) {
+            checksum += std::get<double>(sheet.GetCell(Position{ i % ROWS, 2 + i / ROWS })->GetValue());
+        }
+    }
+    std::cerr << "checksum: "sv << checksum << std::endl;
+}
+
+// Ошибка во входных данных расходится по 100000 формулам. Время пересчёта
+// сравнивается с теми же формулами над числами.
+void BenchmarkErrorCascade() {
+    constexpr int ROWS = 10000;
+    constexpr int COLS = 10;
+    std::cerr << "--- Recalculation of "sv << ROWS * COLS << " formulas over numbers and over errors ---"sv << std::endl;
+    auto measure = [](const std::string& name, const std::string& input) {
+        Sheet sheet;
+        for (int c = 0; c < COLS; ++c) {
+            for (int r = 0; r < ROWS; ++r) {
+                const std::string row = std::to_string(r + 1);
+                sheet.SetCell(Position{ r, c + 1 }, "=A"s + row + "*"s + std::to_string(c + 2) + "+1"s);
+            }
+        }
+        size_t errors = 0;
+        std::chrono::steady_clock::duration duration{};
+        for (int pass = 0; pass < 5; ++pass) {
+            // новое значение входа сбрасывает кэш зависимых формул
+            for (int r = 0; r < ROWS; ++r) {
+                sheet.SetCell(Position{ r, 0 }, input + std::to_string(pass));
+            }
+            const auto start = std::chrono::steady_clock::now();
+            for (int c = 0; c < COLS; ++c) {
+                for (int r = 0; r < ROWS; ++r) {
+                    errors += std::holds_alternative<FormulaError>(sheet.GetCell(Position{ r, c + 1 })->GetValue());
+                }
+            }
+            duration += std::chrono::steady_clock::now() - start;
+        }
+        std::cerr << name << " 5 x evaluate: "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count()
+            << " us, errors: "sv << errors << std::endl;
+    };
+    measure("numbers"s, "1"s);
+    measure("errors"s, "n/a"s);
+}
+
+// Формулы, ссылающиеся на формулы: столбцы из цепочек формул, каждая
+// ссылается на ячейку над собой и на две ячейки первой строки. Изменение
+// первой строки пересчитывает весь лист. Длинные цепочки - в
+// BenchmarkDeepChain().
+void BenchmarkFormulaChains() {
+    auto measure = [](int rows, int cols, int passes) {
+        std::cerr << "--- "sv << passes << " recalculations of "sv << cols << " chains of "sv << rows << " formulas ---"sv << std::endl;
+        Sheet sheet;
+        for (int c = 0; c < cols; ++c) {
+            sheet.SetCell(Position{ 0, c }, "1"s);
+        }
+        for (int r = 1; r < rows; ++r) {
+            for (int c = 0; c < cols; ++c) {
+                sheet.SetCell(Position{ r, c }, "="s + Position{ r - 1, c }.ToString() + "/2+"s
+                    + Position{ 0, c }.ToString() + "+"s + Position{ 0, (c + 1) % cols }.ToString());
+            }
+        }
+
+        double checksum = 0.0;
+        std::chrono::steady_clock::duration duration{};
+        for (int pass = 0; pass < passes; ++pass) {
+            for (int c = 0; c < cols; ++c) {
+                sheet.SetCell(Position{ 0, c }, std::to_string(pass));
+            }
+            const auto start = std::chrono::steady_clock::now();
+            for (int c = 0; c < cols; ++c) {
+                checksum += std::get<double>(sheet.GetCell(Position{ rows - 1, c })->GetValue());
+            }
+            duration += std::chrono::steady_clock::now() - start;
+        }
+        std::cerr << "recalculate: "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count()
+            << " us, checksum: "sv << checksum << std::endl;
+    };
+    // помещается в кэш процессора
+    measure(50, 20, 1000);
+    measure(200, 500, 5);
+}
+
+// Агрегатные функции над столбцом чисел пересчитываются после изменения одной
+// ячейки столбца. Для сравнения те же диапазоны читаются по ячейкам, а сумма
+// 500 ячеек записана и через SUM, и сложением.
+void BenchmarkRangeFunctions() {
+    constexpr int ROWS = 10000;
+    constexpr int PASSES = 200;
+    std::cerr << "--- Aggregate functions over a column of "sv << ROWS << " numbers ---"sv << std::endl;
+    Sheet sheet;
+    for (int r = 0; r < ROWS; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r % 100));
+    }
+    const std::string range = "(A1:A"s + std::to_string(ROWS) + ")"s;
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    for (const std::string& function : { "SUM"s, "AVERAGE"s, "MIN"s, "MAX"s, "COUNT"s }) {
+        sheet.SetCell(Position{ static_cast<int>(formulas.size()), 1 }, "="s + function + range);
+        formulas.push_back(ParseFormula(function + range));
+    }
+    std::string addition = "=A1"s;
+    for (int r = 2; r <= 500; ++r) {
+        addition += "+A"s + std::to_string(r);
+    }
+    sheet.SetCell(Position{ 0, 2 }, addition);
+    sheet.SetCell(Position{ 1, 2 }, "=SUM(A1:A500)"s);
+
+    auto measure = [&sheet](const std::string& name, auto evaluate) {
+        double checksum = 0.0;
+        std::chrono::steady_clock::duration duration{};
+        for (int pass = 0; pass < PASSES; ++pass) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(pass));
+            const auto start = std::chrono::steady_clock::now();
+            checksum += evaluate();
+            duration += std::chrono::steady_clock::now() - start;
+        }
+        std::cerr << name << ": "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count()
+            << " us, checksum: "sv << checksum << std::endl;
+    };
+    auto get_value = [&sheet](Position pos) {
+        return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+    measure("5 functions, column values"s, [&]() {
+        double sum = 0.0;
+        for (int i = 0; i < 5; ++i) {
+            sum += get_value(Position{ i, 1 });
+        }
+        return sum;
+    });
+    measure("5 functions, cell by cell"s, [&]() {
+        double sum = 0.0;
+        for (const auto& formula : formulas) {
+            sum += std::get<double>(formula->Evaluate(sheet));
+        }
+        return sum;
+    });
+    measure("500 cells added one by one"s, [&]() {
+        return get_value(Position{ 0, 2 });
+    });
+    measure("SUM of 500 cells"s, [&]() {
+        return get_value(Position{ 1, 2 });
+    });
+}
+
+// Граф зависимостей: на одну ячейку ссылаются 100000 формул, и 2000 формул
+// ссылаются на 50 ячеек каждая. Память связей - в арене листа и в графе.
+void BenchmarkDependencyGraph() {
+    constexpr int ROWS = 10000;
+    // формулы занимают столбцы начиная с B
+    auto formula_pos = [](int i) {
+        return Position{ i % ROWS, 1 + i / ROWS };
+    };
+    auto measure = [&formula_pos](const std::string& name, int formulas, auto make_text, auto traverse) {
+        std::cerr << "--- Dependency graph, "sv << name << " ---"sv << std::endl;
+        Sheet sheet;
+        const size_t bytes_before = sheet.GetAllocationStats().bytes_allocated;
+        {
+            LOG_DURATION("set "s + std::to_string(formulas) + " formulas"s);
+            for (int i = 0; i < formulas; ++i) {
+                sheet.SetCell(formula_pos(i), make_text(i));
+            }
+        }
+        const DependencyGraph& graph = sheet.GetDependencyGraph();
+        std::cerr << "edges: "sv << graph.GetEdgeCount()
+            << ", arena bytes per formula (incl. freed temporaries): "sv
+            << (sheet.GetAllocationStats().bytes_allocated - bytes_before) / formulas
+            << ", graph bytes per edge: "sv << graph.GetMemoryUsage() / graph.GetEdgeCount() << std::endl;
+        {
+            LOG_DURATION("traverse"s);
+            std::cerr << "checksum: "sv << traverse(sheet) << std::endl;
+        }
+        {
+            LOG_DURATION("clear formulas"s);
+            for (int i = 0; i < formulas; ++i) {
+                sheet.ClearCell(formula_pos(i));
+            }
+        }
+    };
+
+    constexpr int FAN_IN = 100000;
+    measure("fan-in"s, FAN_IN, [](int i) {
+        return "=A1+"s + std::to_string(i);
+    }, [&formula_pos](Sheet& sheet) {
+        // каждое изменение A1 сбрасывает кэш всех формул
+        double checksum = 0.0;
+        for (int pass = 0; pass < 20; ++pass) {
+            sheet.SetCell(Position{ 0, 0 }, std::to_string(pass));
+            checksum += std::get<double>(sheet.GetCell(formula_pos(FAN_IN - 1))->GetValue());
+        }
+        return checksum;
+    });
+
+    constexpr int FAN_OUT = 50;
+    constexpr int FAN_OUT_FORMULAS = 2000;
+    measure("fan-out"s, FAN_OUT_FORMULAS, [](int i) {
+        std::string text = "=A"s + std::to_string(i + 1);
+        for (int j = 1; j < FAN_OUT; ++j) {
+            text += "+A"s + std::to_string(i + j + 1);
+        }
+        return text;
+    }, [&formula_pos](Sheet& sheet) {
+        size_t checksum = 0;
+        for (int pass = 0; pass < 10; ++pass) {
+            for (int i = 0; i < FAN_OUT_FORMULAS; ++i) {
+                checksum += sheet.GetCell(formula_pos(i))->GetReferencedCells().size();
+            }
+        }
+        return checksum;
+    });
+}
+
+// Проверка циклов при изменении последней формулы цепочки из 16000 формул,
+// при добавлении формул, зависящих от всей цепочки, и при попытке замкнуть
+// цепочку.
+void BenchmarkCycleCheck() {
+    constexpr int ROWS = 16000;
+    constexpr int EDITS = 10000;
+    std::cerr << "--- Cycle checks in a chain of "sv << ROWS << " formulas ---"sv << std::endl;
+    Sheet sheet;
+    {
+        LOG_DURATION("build chain"s);
+        sheet.SetCell(Position{ 0, 0 }, "1"s);
+        for (int r = 1; r < ROWS; ++r) {
+            sheet.SetCell(Position{ r, 0 }, "=A"s + std::to_string(r) + "+1"s);
+        }
+    }
+    const std::string last_row = std::to_string(ROWS - 1);
+    {
+        LOG_DURATION(std::to_string(EDITS) + " edits of the last formula"s);
+        for (int i = 0; i < EDITS; ++i) {
+            sheet.SetCell(Position{ ROWS - 1, 0 }, "=A"s + last_row + "+"s + std::to_string(i % 10));
+        }
+    }
+    {
+        LOG_DURATION(std::to_string(EDITS) + " formulas over the last cell"s);
+        for (int i = 0; i < EDITS; ++i) {
+            sheet.SetCell(Position{ i, 1 }, "=A"s + std::to_string(ROWS) + "*2"s);
+        }
+    }
+    size_t cycles = 0;
+    {
+        LOG_DURATION("100 rejected cycles"s);
+        for (int i = 0; i < 100; ++i) {
+            try {
+                sheet.SetCell(Position{ 1, 0 }, "=A"s + std::to_string(ROWS) + "+1"s);
+            }
+            catch (const CircularDependencyException&) {
+                ++cycles;
+            }
+        }
+    }
+    std::cerr << "cycles: "sv << cycles << std::endl;
+}
+
+// Запись и первое чтение после неё при ленивом и немедленном пересчёте:
+// 200 цепочек из 50 формул, каждая формула ссылается на ячейку над собой и на
+// первую строку. При немедленном пересчёте вся работа переходит в запись.
+void BenchmarkRecalculationModes() {
+    constexpr int ROWS = 50;
+    constexpr int COLS = 200;
+    constexpr int PASSES = 100;
+    std::cerr << "--- Writes and reads in "sv << COLS << " chains of "sv << ROWS << " formulas ---"sv << std::endl;
+    auto measure = [](const std::string& name, Sheet::RecalculationMode mode) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        for (int c = 0; c < COLS; ++c) {
+            sheet.SetCell(Position{ 0, c }, "1"s);
+        }
+        for (int r = 1; r < ROWS; ++r) {
+            for (int c = 0; c < COLS; ++c) {
+                sheet.SetCell(Position{ r, c }, "="s + Position{ r - 1, c }.ToString() + "/2+"s + Position{ 0, c }.ToString());
+            }
+        }
+        double checksum = 0.0;
+        std::chrono::steady_clock::duration write_duration{};
+        std::chrono::steady_clock::duration read_duration{};
+        for (int pass = 0; pass < PASSES; ++pass) {
+            const auto start = std::chrono::steady_clock::now();
+            for (int c = 0; c < COLS; ++c) {
+                sheet.SetCell(Position{ 0, c }, std::to_string(pass));
+            }
+            const auto written = std::chrono::steady_clock::now();
+            for (int r = 1; r < ROWS; ++r) {
+                for (int c = 0; c < COLS; ++c) {
+                    checksum += std::get<double>(sheet.GetCell(Position{ r, c })->GetValue());
+                }
+            }
+            write_duration += written - start;
+            read_duration += std::chrono::steady_clock::now() - written;
+        }
+        std::cerr << name << " write: "sv << std::chrono::duration_cast<std::chrono::microseconds>(write_duration).count()
+            << " us, read: "sv << std::chrono::duration_cast<std::chrono::microseconds>(read_duration).count()
+            << " us, checksum: "sv << checksum << std::endl;
+    };
+    measure("lazy"s, Sheet::RecalculationMode::Lazy);
+    measure("eager"s, Sheet::RecalculationMode::Eager);
+}
+
+// Изменения, которые не доходят до формул: 200 цепочек из 500 формул зависят
+// от максимума 1000 чисел, а меняются числа меньше максимума. Затем то же
+// число вводится в ячейку заново. Пересчёт останавливается на MAX, поэтому
+// цепочки не вычисляются заново.
+void BenchmarkEarlyCutoff() {
+    constexpr int VALUES = 1000;
+    constexpr int ROWS = 500;
+    constexpr int COLS = 200;
+    constexpr int PASSES = 100;
+    std::cerr << "--- Absorbed changes before "sv << COLS << " chains of "sv << ROWS << " formulas ---"sv << std::endl;
+    auto measure = [](const std::string& name, Sheet::RecalculationMode mode) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        for (int r = 0; r < VALUES; ++r) {
+            sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+        }
+        sheet.SetCell(Position{ 0, 1 }, "=MAX(A1:A"s + std::to_string(VALUES) + ")"s);
+        for (int c = 2; c < COLS + 2; ++c) {
+            sheet.SetCell(Position{ 0, c }, "=B1+"s + std::to_string(c));
+            for (int r = 1; r < ROWS; ++r) {
+                sheet.SetCell(Position{ r, c }, "="s + Position{ r - 1, c }.ToString() + "/2+B1"s);
+            }
+        }
+        double checksum = 0.0;
+        auto read_all = [&sheet, &checksum]() {
+            for (int r = 0; r < ROWS; ++r) {
+                for (int c = 2; c < COLS + 2; ++c) {
+                    checksum += std::get<double>(sheet.GetCell(Position{ r, c })->GetValue());
+                }
+            }
+        };
+        read_all();
+        {
+            LOG_DURATION(name + " changes below maximum"s);
+            for (int pass = 0; pass < PASSES; ++pass) {
+                sheet.SetCell(Position{ pass, 0 }, std::to_string(VALUES - 2 - pass));
+                read_all();
+            }
+        }
+        {
+            LOG_DURATION(name + " same value again"s);
+            for (int pass = 0; pass < PASSES; ++pass) {
+                sheet.SetCell(Position{ pass, 0 }, std::to_string(VALUES - 2 - pass));
+                read_all();
+            }
+        }
+        std::cerr << "checksum: "sv << checksum << std::endl;
+    };
+    measure("lazy"s, Sheet::RecalculationMode::Lazy);
+    measure("eager"s, Sheet::RecalculationMode::Eager);
+}
+
+// Такт ленты котировок: 10000 чисел столбца A, формулы по каждому и итоги по
+// всему столбцу; за такт меняется каждое десятое число. Изменения вносятся по
+// одному и пакетом при ленивом и немедленном пересчёте.
+void BenchmarkBatchUpdate() {
+    constexpr int ROWS = 10000;
+    constexpr int TICKS = 20;
+    std::cerr << "--- Ticks of "sv << ROWS / 10 << " changes to "sv << ROWS << " inputs ---"sv << std::endl;
+    auto measure = [](const std::string& name, Sheet::RecalculationMode mode, bool use_batch) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        const std::string column = "A1:A"s + std::to_string(ROWS);
+        for (int r = 0; r < ROWS; ++r) {
+            sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+            sheet.SetCell(Position{ r, 1 }, "="s + Position{ r, 0 }.ToString() + "*2"s);
+        }
+        sheet.SetCell(Position{ 0, 2 }, "=SUM("s + column + ")"s);
+        sheet.SetCell(Position{ 1, 2 }, "=MAX("s + column + ")-MIN("s + column + ")"s);
+        double checksum = 0.0;
+        {
+            LOG_DURATION(name);
+            for (int tick = 0; tick < TICKS; ++tick) {
+                if (use_batch) {
+                    sheet.BeginBatch();
+                }
+                for (int r = tick % 10; r < ROWS; r += 10) {
+                    sheet.SetCell(Position{ r, 0 }, std::to_string(r + tick));
+                }
+                if (use_batch) {
+                    sheet.CommitBatch();
+                }
+                checksum += std::get<double>(sheet.GetCell(Position{ 0, 2 })->GetValue());
+                checksum += std::get<double>(sheet.GetCell(Position{ 1, 2 })->GetValue());
+            }
+        }
+        std::cerr << "checksum: "sv << checksum << std::endl;
+    };
+    measure("lazy, one by one"s, Sheet::RecalculationMode::Lazy, false);
+    measure("lazy, batch"s, Sheet::RecalculationMode::Lazy, true);
+    measure("eager, one by one"s, Sheet::RecalculationMode::Eager, false);
+    measure("eager, batch"s, Sheet::RecalculationMode::Eager, true);
+}
+
+// Пересчёт после массового изменения: 200 независимых цепочек по 1000
+// формул, каждая формула ссылается на ячейку над собой и на первую строку.
+void BenchmarkParallelRecalculation() {
+    constexpr int ROWS = 1000;
+    constexpr int COLS = 200;
+    std::cerr << "--- Recalculation of "sv << COLS << " chains of "sv << ROWS << " formulas ---"sv << std::endl;
+    Sheet sheet;
+    for (int c = 0; c < COLS; ++c) {
+        sheet.SetCell(Position{ 0, c }, "1"s);
+    }
+    for (int r = 1; r < ROWS; ++r) {
+        for (int c = 0; c < COLS; ++c) {
+            sheet.SetCell(Position{ r, c }, "="s + Position{ r - 1, c }.ToString() + "/2+"s + Position{ 0, c }.ToString());
+        }
+    }
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads : { size_t{ 1 }, size_t{ 2 }, size_t{ 4 }, hardware_threads }) {
+        sheet.SetThreadCount(threads);
+        for (int c = 0; c < COLS; ++c) {
+            sheet.SetCell(Position{ 0, c }, std::to_string(threads));
+        }
+        {
+            LOG_DURATION(std::to_string(threads) + " threads"s);
+            sheet.Recalculate();
+        }
+        double checksum = 0.0;
+        for (int c = 0; c < COLS; ++c) {
+            checksum += std::get<double>(sheet.GetCell(Position{ ROWS - 1, c })->GetValue());
+        }
+        std::cerr << "checksum: "sv << checksum << std::endl;
+    }
+}
+
+// Потоки читают один лист: каждый 10 раз читает все формулы, поэтому
+// при идеальном масштабировании время не зависит от числа потоков. Чтение
+// без защиты сравнивается с чтением под общим мьютексом листа, а чтение
+// вычисленных формул - с первым чтением после изменения листа.
+void BenchmarkConcurrentReads() {
+    constexpr int ROWS = 10000;
+    constexpr int COLS = 10;
+    constexpr int PASSES = 10;
+    std::cerr << "--- Concurrent reads of "sv << ROWS * COLS << " formulas ---"sv << std::endl;
+    Sheet sheet;
+    for (int c = 0; c < COLS; ++c) {
+        sheet.SetCell(Position{ 0, c }, "1"s);
+        for (int r = 1; r < ROWS; ++r) {
+            sheet.SetCell(Position{ r, c }, "="s + Position{ r - 1, c }.ToString() + "*0.5+"s + Position{ 0, c }.ToString());
+        }
+    }
+    std::mutex sheet_mutex;
+    auto run = [&sheet, &sheet_mutex](const std::string& name, size_t threads, int passes, bool use_mutex) {
+        std::vector<double> checksums(threads);
+        {
+            LOG_DURATION(name + ", "s + std::to_string(threads) + " threads"s);
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t]() {
+                    double checksum = 0.0;
+                    for (int pass = 0; pass < passes; ++pass) {
+                        for (int r = 1; r < ROWS; ++r) {
+                            for (int c = 0; c < COLS; ++c) {
+                                // потоки начинают с разных столбцов
+                                const Position pos{ r, static_cast<int>((c + t) % COLS) };
+                                if (use_mutex) {
+                                    std::lock_guard lock(sheet_mutex);
+                                    checksum += std::get<double>(sheet.GetCell(pos)->GetValue());
+                                }
+                                else {
+                                    checksum += std::get<double>(sheet.GetCell(pos)->GetValue());
+                                }
+                            }
+                        }
+                    }
+                    checksums[t] = checksum;
+                });
+            }
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+        }
+        std::cerr << "checksum: "sv << checksums.front() << std::endl;
+    };
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    int step = 2;
+    for (size_t threads : { size_t{ 1 }, size_t{ 2 }, size_t{ 4 }, hardware_threads }) {
+        for (int c = 0; c < COLS; ++c) {
+            sheet.SetCell(Position{ 0, c }, std::to_string(step));
+        }
+        ++step;
+        run("first read after change"s, threads, 1, false);
+        run("cached, lock-free"s, threads, PASSES, false);
+        run("cached, sheet mutex"s, threads, PASSES, true);
+    }
+}
+
+// Снимки листа из 100000 ячеек: полный, после изменений нескольких ячеек и
+// выгрузка листа, пока в него пишут. Без снимков читатель держит лист под
+// защитой всё время выгрузки.
+void BenchmarkSnapshots() {
+    constexpr int ROWS = 10000;
+    constexpr int COLS = 10;
+    constexpr int SNAPSHOTS = 100;
+    constexpr int CHANGES = 2000;
+    constexpr int EXPORTS = 3;
+    std::cerr << "--- Snapshots of "sv << ROWS * COLS << " cells ---"sv << std::endl;
+    Sheet sheet;
+    for (int r = 0; r < ROWS; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+        for (int c = 1; c < COLS; ++c) {
+            sheet.SetCell(Position{ r, c }, "="s + Position{ r, 0 }.ToString() + "*"s + std::to_string(c));
+        }
+    }
+
+    std::shared_ptr<const SheetSnapshot> snapshot;
+    {
+        LOG_DURATION("first snapshot"s);
+        snapshot = sheet.GetSnapshot();
+    }
+    {
+        LOG_DURATION(std::to_string(SNAPSHOTS) + " snapshots, each after changing one cell"s);
+        for (int i = 0; i < SNAPSHOTS; ++i) {
+            sheet.SetCell(Position{ i * (ROWS / SNAPSHOTS), 0 }, std::to_string(i));
+            snapshot = sheet.GetSnapshot();
+        }
+    }
+    std::cerr << "tiles: "sv << snapshot->GetTiles().size() << std::endl;
+
+    std::mutex sheet_mutex;
+    auto run = [&](const std::string& name, bool use_snapshot) {
+        size_t exported = 0;
+        // писатель ждёт дольше всего, пока читатель держит лист
+        std::chrono::steady_clock::duration longest_change{};
+        {
+            LOG_DURATION(name);
+            std::thread reader([&]() {
+                for (int i = 0; i < EXPORTS; ++i) {
+                    std::ostringstream output;
+                    if (use_snapshot) {
+                        std::shared_ptr<const SheetSnapshot> current;
+                        {
+                            std::lock_guard lock(sheet_mutex);
+                            current = sheet.GetSnapshot();
+                        }
+                        current->PrintValues(output);
+                    }
+                    else {
+                        std::lock_guard lock(sheet_mutex);
+                        sheet.PrintValues(output);
+                    }
+                    exported += output.str().size();
+                }
+            });
+            for (int i = 0; i < CHANGES; ++i) {
+                const auto start = std::chrono::steady_clock::now();
+                {
+                    std::lock_guard lock(sheet_mutex);
+                    sheet.SetCell(Position{ (i * 7919) % ROWS, 0 }, std::to_string(i));
+                }
+                longest_change = std::max(longest_change, std::chrono::steady_clock::now() - start);
+            }
+            reader.join();
+        }
+        std::cerr << "exported: "sv << exported << ", longest change: "sv
+                  << std::chrono::duration_cast<std::chrono::microseconds>(longest_change).count() << " us"sv << std::endl;
+    };
+    run(std::to_string(CHANGES) + " changes, "s + std::to_string(EXPORTS) + " exports of locked sheet"s, false);
+    run(std::to_string(CHANGES) + " changes, "s + std::to_string(EXPORTS) + " exports of snapshots"s, true);
+}
+
+// Независимые источники пишут каждый в свои строки: под одной блокировкой
+// листа и в режиме одновременной записи. Первый проход создаёт ячейки,
+// следующие меняют их значения.
+void BenchmarkConcurrentWriters() {
+    constexpr int FEEDS = 16;
+    constexpr int FEED_ROWS = 640;
+    constexpr int COLS = 8;
+    constexpr int PASSES = 3;
+    std::cerr << "--- "sv << FEEDS << " feeds writing "sv << FEEDS * FEED_ROWS * COLS << " cells, "sv
+              << std::thread::hardware_concurrency() << " hardware threads ---"sv << std::endl;
+    // тексты готовятся заранее, чтобы мерить только запись
+    std::vector<std::string> texts;
+    for (int i = 0; i < FEED_ROWS * COLS; ++i) {
+        texts.push_back(std::to_string(i * 0.25));
+    }
+    auto run = [&texts](const std::string& name, bool concurrent) {
+        Sheet sheet;
+        sheet.SetConcurrentWrites(concurrent);
+        std::mutex sheet_mutex;
+        for (int pass = 0; pass < PASSES; ++pass) {
+            LOG_DURATION(name + (pass == 0 ? ", create"s : ", update"s));
+            std::vector<std::thread> feeds;
+            for (int feed = 0; feed < FEEDS; ++feed) {
+                feeds.emplace_back([&, feed]() {
+                    for (int r = 0; r < FEED_ROWS; ++r) {
+                        for (int c = 0; c < COLS; ++c) {
+                            const Position pos{ feed * FEED_ROWS + r, c };
+                            const std::string& text = texts[(r * COLS + c + pass) % texts.size()];
+                            if (concurrent) {
+                                sheet.SetCell(pos, text);
+                            }
+                            else {
+                                std::lock_guard lock(sheet_mutex);
+                                sheet.SetCell(pos, text);
+                            }
+                        }
+                    }
+                });
+            }
+            for (std::thread& feed : feeds) {
+                feed.join();
+            }
+        }
+    };
+    run("sheet mutex"s, false);
+    run("concurrent writes"s, true);
+}
+
+// Цепочка из 1000000 формул, каждая ссылается на предыдущую (нарастающий
+// итог). Цепочка идёт сверху вниз по столбцу и переходит в следующий.
+void BenchmarkDeepChain() {
+    constexpr int LENGTH = 1000000;
+    constexpr int ROWS = Position::MAX_ROWS;
+    std::cerr << "--- Chain of "sv << LENGTH << " formulas ---"sv << std::endl;
+    auto link = [](int i) {
+        return Position{ i % ROWS, i / ROWS };
+    };
+    Sheet sheet;
+    {
+        LOG_DURATION("build chain"s);
+        sheet.SetCell(link(0), "1"s);
+        for (int i = 1; i < LENGTH; ++i) {
+            sheet.SetCell(link(i), "="s + link(i - 1).ToString() + "+1"s);
+        }
+    }
+    const CellInterface* last = sheet.GetCell(link(LENGTH - 1));
+    {
+        LOG_DURATION("evaluate last formula"s);
+        std::cerr << "value: "sv << static_cast<long long>(std::get<double>(last->GetValue())) << std::endl;
+    }
+    {
+        LOG_DURATION("change first cell"s);
+        sheet.SetCell(link(0), "2"s);
+    }
+    {
+        LOG_DURATION("evaluate last formula again"s);
+        std::cerr << "value: "sv << static_cast<long long>(std::get<double>(last->GetValue())) << std::endl;
+    }
+    {
+        LOG_DURATION("referenced cells of last formula"s);
+        std::cerr << "cells: "sv << last->GetReferencedCells().size() << std::endl;
+    }
+    {
+        LOG_DURATION("rejected cycle"s);
+        try {
+            sheet.SetCell(link(0), "="s + link(LENGTH - 1).ToString());
+        }
+        catch (const CircularDependencyException&) {
+            std::cerr << "cycle"sv << std::endl;
+        }
+    }
+    {
+        LOG_DURATION("eager change of first cell"s);
+        sheet.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+        sheet.SetCell(link(0), "3"s);
+        std::cerr << "value: "sv << static_cast<long long>(std::get<double>(last->GetValue())) << std::endl;
+    }
+}
+
+void BenchmarkImportTexts() {
+    constexpr int ROWS = 16000;
+    constexpr int COLS = 18;
+    constexpr int GROUP = 6;
+    std::cerr << "--- Import of "sv << ROWS * COLS << " cells ---"sv << std::endl;
+    // группы одинаковых столбцов: числа, текст и формулы
+    auto text = [](int r, int c) {
+        auto cell = [r, c](int row, int col_in_group) {
+            return Position{ row, c - c % GROUP + col_in_group }.ToString();
+        };
+        switch (c % GROUP) {
+        case 0:
+            return std::to_string(r) + ".5"s;
+        case 1:
+            return "item "s + std::to_string(r);
+        case 2:
+            return "="s + cell(r, 0) + "*2"s;
+        case 3:
+            return "="s + cell(r, 2) + (r == 0 ? ""s : "+"s + cell(r - 1, 3));
+        case 4:
+            return "=SUM("s + cell(r, 0) + ":"s + cell(r, 3) + ")"s;
+        default:
+            return "=MAX("s + cell(0, 0) + ":"s + cell(r, 0) + ")"s;
+        }
+    };
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+
+    Sheet expected;
+    {
+        LOG_DURATION("SetCell for each cell"s);
+        for (int r = 0; r < ROWS; ++r) {
+            for (int c = 0; c < COLS; ++c) {
+                expected.SetCell(Position{ r, c }, text(r, c));
+            }
+        }
+    }
+    {
+        Sheet sheet;
+        LOG_DURATION("one batch"s);
+        sheet.BeginBatch();
+        for (int r = 0; r < ROWS; ++r) {
+            for (int c = 0; c < COLS; ++c) {
+                sheet.SetCell(Position{ r, c }, text(r, c));
+            }
+        }
+        sheet.CommitBatch();
+    }
+    const std::string dump = texts(expected);
+    std::cerr << "bytes: "sv << dump.size() << std::endl;
+    for (size_t threads : { 1, 4 }) {
+        Sheet sheet;
+        sheet.SetThreadCount(threads);
+        std::istringstream input(dump);
+        {
+            LOG_DURATION("ImportTexts, threads: "s + std::to_string(threads));
+            sheet.ImportTexts(input);
+        }
+        std::cerr << "same texts: "sv << (texts(sheet) == dump) << std::endl;
+    }
+}
+
+void BenchmarkExport() {
+    constexpr int ROWS = 16000;
+    constexpr int COLS = 20;
+    constexpr size_t BUFFER_SIZE = 16 << 20;
+    std::cerr << "--- Export of "sv << ROWS << "x"sv << COLS << " cells ---"sv << std::endl;
+    Sheet sheet;
+    sheet.BeginBatch();
+    for (int r = 0; r < ROWS; ++r) {
+        for (int c = 0; c < COLS; ++c) {
+            const Position pos{ r, c };
+            switch (c % 4) {
+            case 0:
+                sheet.SetCell(pos, std::to_string(r * 1.25 + c));
+                break;
+            case 1:
+                sheet.SetCell(pos, "item "s + std::to_string(r));
+                break;
+            case 2:
+                sheet.SetCell(pos, "="s + Position{ r, c - 2 }.ToString() + "/3"s);
+                break;
+            default:
+                // каждая четвёртая строка пустая, кроме первых столбцов
+                if (r % 4 != 0) {
+                    sheet.SetCell(pos, "=SUM("s + Position{ r, c - 3 }.ToString() + ":"s + Position{ r, c - 1 }.ToString() + ")"s);
+                }
+            }
+        }
+    }
+    sheet.CommitBatch();
+    sheet.Recalculate();
+    sheet.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+
+    auto print = [&sheet](const std::string& name, auto method) {
+        std::ostringstream output;
+        {
+            LOG_DURATION(name);
+            (sheet.*method)(output);
+        }
+        return output.str();
+    };
+    const std::string values = print("PrintValues to std::ostringstream"s, &Sheet::PrintValues);
+    const std::string texts = print("PrintTexts to std::ostringstream"s, &Sheet::PrintTexts);
+    std::cerr << "bytes: "sv << values.size() << " and "sv << texts.size() << std::endl;
+
+    std::vector<char> buffer(BUFFER_SIZE);
+    for (size_t threads : { 1, 4 }) {
+        sheet.SetThreadCount(threads);
+        auto run = [&](const std::string& name, auto method, const std::string& expected) {
+            std::string exported;
+            exported.reserve(expected.size());
+            {
+                LOG_DURATION(name + ", threads: "s + std::to_string(threads));
+                ExportBuffer output(buffer.data(), buffer.size(), MakeStringSink(exported));
+                (sheet.*method)(output);
+            }
+            std::cerr << "same: "sv << (exported == expected) << std::endl;
+        };
+        run("ExportValues to a 16 MB buffer"s, &Sheet::ExportValues, values);
+        run("ExportTexts to a 16 MB buffer"s, &Sheet::ExportTexts, texts);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+}  // namespace
+
+void Benchmarks() {
+    BenchmarkStorage();
+    BenchmarkBulkLoad();
+    BenchmarkTextCellReads();
+    BenchmarkFormulaExecution();
+    BenchmarkFormulaParsing();
+    BenchmarkCellReads();
+    BenchmarkFillDown();
+    BenchmarkErrorCascade();
+    BenchmarkFormulaChains();
+    BenchmarkRangeFunctions();
+    BenchmarkDependencyGraph();
+    BenchmarkCycleCheck();
+    BenchmarkRecalculationModes();
+    BenchmarkEarlyCutoff();
+    BenchmarkBatchUpdate();
+    BenchmarkParallelRecalculation();
+    BenchmarkConcurrentReads();
+    BenchmarkSnapshots();
+    BenchmarkConcurrentWriters();
+    BenchmarkDeepChain();
+    BenchmarkImportTexts();
+    BenchmarkExport();
+}
@@ -1,156 +1,749 @@
 #include "cell.h"
 
+#include "column_values.h"
+#include "sheet.h"
+
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <optional>
 
-Cell::Cell(SheetInterface& sheet)
-    : Cell("", sheet) {
+std::optional<double> cell_detail::ParseNumericText(const std::string& text) {
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    errno = 0;
+    const double value = std::strtod(begin, &end);
+    if (end == begin || errno == ERANGE) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// -----------------------------------------------------------------------------
+
+namespace {
+
+// Числа совпадают побитово: ошибки различаются кодом, а 0 отличается от -0.
+bool IsSameNumber(double lhs, double rhs) {
+    uint64_t lhs_bits;
+    uint64_t rhs_bits;
+    std::memcpy(&lhs_bits, &lhs, sizeof(double));
+    std::memcpy(&rhs_bits, &rhs, sizeof(double));
+    return lhs_bits == rhs_bits;
+}
+
+}  // namespace
+
+// -----------------------------------------------------------------------------
+
+using cell_detail::CellValue;
+
+namespace {
+
+// Сколько вычислений формул вложено друг в друга в этом потоке.
+thread_local int evaluation_depth = 0;
+
+struct EvaluationScope {
+    EvaluationScope() {
+        ++evaluation_depth;
+    }
+    ~EvaluationScope() {
+        --evaluation_depth;
+    }
+};
+
+}  // namespace
+
+CellValue::CellValue() noexcept
+    : heap_text_{ nullptr, 0 } {
+}
+
+CellValue CellValue::MakeText(const std::string& text) {
+    CellValue value;
+    if (text.empty()) {
+        return value;
+    }
+    value.type_ = Type::Text;
+    if (text.size() <= INLINE_TEXT_CAPACITY) {
+        std::memcpy(value.inline_text_, text.data(), text.size());
+        value.text_size_ = static_cast<uint8_t>(text.size());
+    }
+    else {
+        value.heap_text_.data = new char[text.size()];
+        std::memcpy(value.heap_text_.data, text.data(), text.size());
+        value.heap_text_.size = text.size();
+        value.text_size_ = HEAP_TEXT;
+    }
+    if (auto number = ParseNumericText(text)) {
+        value.SetNumericValue(*number);
+    }
+    else {
+        value.SetNumericValue(FormulaError(FormulaError::Category::Value));
+    }
+    return value;
+}
+
+CellValue CellValue::MakeFormula(ArenaPtr<FormulaInterface> formula) {
+    CellValue value;
+    new (&value.formula_) ArenaPtr<FormulaInterface>(std::move(formula));
+    value.type_ = Type::Formula;
+    value.SetState(State::Unevaluated);
+    return value;
+}
+
+CellValue::CellValue(CellValue&& other) noexcept {
+    MoveFrom(other);
+}
+
+CellValue& CellValue::operator=(CellValue&& other) noexcept {
+    if (this != &other) {
+        Destroy();
+        MoveFrom(other);
+    }
+    return *this;
+}
+
+CellValue::~CellValue() {
+    Destroy();
 }
 
-Cell::Cell(std::string text, SheetInterface& sheet)
-    : sheet_(sheet) {
-    Set(std::move(text));
+std::string_view CellValue::GetText() const {
+    assert(type_ == Type::Text);
+    if (text_size_ == HEAP_TEXT) {
+        return { heap_text_.data, heap_text_.size };
+    }
+    return { inline_text_, text_size_ };
+}
+
+const FormulaInterface& CellValue::GetFormula() const {
+    assert(type_ == Type::Formula);
+    return *formula_;
+}
+
+FormulaInterface& CellValue::GetFormula() {
+    assert(type_ == Type::Formula);
+    return *formula_;
+}
+
+FormulaInterface::Value CellValue::GetNumericValue() const {
+    if (auto category = GetErrorCategory(number_)) {
+        return FormulaError(*category);
+    }
+    return number_;
+}
+
+void CellValue::SetNumericValue(const FormulaInterface::Value& value) const {
+    if (const double* number = std::get_if<double>(&value)) {
+        number_ = *number;
+    }
+    else {
+        number_ = MakeErrorValue(std::get<FormulaError>(value).GetCategory());
+    }
+    SetState(State::Valid);
+}
+
+void CellValue::KeepPreviousValue(const CellValue& previous) {
+    assert(type_ == Type::Formula && previous.type_ == Type::Formula);
+    if (previous.GetState() != State::Unevaluated) {
+        number_ = previous.number_;
+        SetState(State::Dirty);
+    }
+}
+
+bool CellValue::HasSameObservedValue(const CellValue& other) const {
+    if (GetState() == State::Unevaluated || other.GetState() == State::Unevaluated) {
+        return false;
+    }
+    // текст, который не является числом, диапазоны пропускают, а ошибку
+    // формулы - нет
+    auto is_counted_in_ranges = [](const CellValue& value) {
+        return value.type_ == Type::Formula || (value.type_ == Type::Text && !GetErrorCategory(value.number_));
+    };
+    return IsSameNumber(number_, other.number_) && is_counted_in_ranges(*this) == is_counted_in_ranges(other);
+}
+
+void CellValue::Destroy() noexcept {
+    if (type_ == Type::Formula) {
+        formula_.~ArenaPtr<FormulaInterface>();
+    }
+    else if (type_ == Type::Text && text_size_ == HEAP_TEXT) {
+        delete[] heap_text_.data;
+    }
+    type_ = Type::Empty;
+}
+
+void CellValue::MoveFrom(CellValue& other) noexcept {
+    if (other.type_ == Type::Formula) {
+        new (&formula_) ArenaPtr<FormulaInterface>(std::move(other.formula_));
+        other.formula_.~ArenaPtr<FormulaInterface>();
+    }
+    else {
+        // Текст в куче переходит вместе с указателем.
+        std::memcpy(inline_text_, other.inline_text_, INLINE_TEXT_CAPACITY);
+    }
+    number_ = other.number_;
+    type_ = other.type_;
+    text_size_ = other.text_size_;
+    SetState(other.GetState());
+
+    other.type_ = Type::Empty;
+    other.text_size_ = 0;
+    other.number_ = 0.0;
+    other.SetState(State::Valid);
+}
+
+// -----------------------------------------------------------------------------
+
+Cell::Cell(Sheet& sheet, Position pos, std::pmr::memory_resource* resource)
+    : sheet_(sheet)
+    , pos_(pos)
+    , resource_(resource)
+    , node_(sheet.GetDependencyGraph().AddNode(this)) {
 }
 
 Cell::~Cell() {
 }
 
 void Cell::Set(std::string text) {
-    std::unique_ptr<cell_detail::CellValueInterface> new_cell_value = CreateCell(std::move(text));
-    std::unordered_set<const Cell*> visited_cells = { this };
-    if (DoesCellHaveCircularDependency(this, new_cell_value, visited_cells)) {
+    SetValue(CreateCell(std::move(text), Position::NONE, nullptr));
+}
+
+void Cell::Set(std::string text, FormulaTable& formulas) {
+    SetValue(CreateCell(std::move(text), pos_, &formulas));
+}
+
+void Cell::SetValue(cell_detail::CellValue new_cell_value) {
+    CreateReferencedCells(new_cell_value);
+    if (DoesCellHaveCircularDependency(new_cell_value)) {
         throw CircularDependencyException("Cell has circular dependency exception");
     }
-    Clear();
+    const cell_detail::CellValue previous = Detach();
     cell_value_ = std::move(new_cell_value);
     BindingReferencedDependency();
+    CompleteChange(previous);
 }
 
-void Cell::Clear() {
-    if (cell_value_) {
-        std::unordered_set<const Cell*> visited_cells = { this };
-        InvalidateBindingCache(visited_cells);
-        UnbindReferencedDependency();
-        cell_value_.reset();
+cell_detail::CellValue Cell::MakeValue(std::string text, FormulaTable& formulas) {
+    return CreateCell(std::move(text), pos_, &formulas);
+}
+
+cell_detail::CellValue Cell::Detach() {
+    UnbindReferencedDependency();
+    // перемещённое значение становится пустым
+    return std::move(cell_value_);
+}
+
+bool Cell::Attach(cell_detail::CellValue& value) {
+    assert(cell_value_.GetType() == cell_detail::CellValue::Type::Empty);
+    if (DoesCellHaveCircularDependency(value)) {
+        return false;
     }
-    cell_value_ = std::make_unique<cell_detail::EmptyCellValue>();
+    cell_value_ = std::move(value);
+    BindingReferencedDependency();
+    return true;
+}
+
+void Cell::CompleteChange(const cell_detail::CellValue& previous) {
+    using Type = cell_detail::CellValue::Type;
+    using State = cell_detail::CellValue::State;
+
+    // Зависимые формулы устаревают, только если значение ячейки для них
+    // изменится. Новую формулу, которая заменяет формулу, сначала вычислят и
+    // сравнят с прежним значением, а до тех пор зависимым нужна проверка.
+    std::optional<State> dependents_state;
+    if (cell_value_.GetType() == Type::Formula && previous.GetType() == Type::Formula) {
+        cell_value_.KeepPreviousValue(previous);
+        dependents_state = State::Check;
+    }
+    else if (cell_value_.GetType() == Type::Formula || !cell_value_.HasSameObservedValue(previous)) {
+        dependents_state = State::Dirty;
+    }
+
+    // значение пустой ячейки тоже могли прочитать зависимые формулы
+    if (dependents_state && (HasBindingCells() || sheet_.GetColumnValues().IsTracked(pos_.col))) {
+        MarkDependents(*dependents_state);
+    }
+    PublishValue();
+    if (IsDirty()) {
+        sheet_.MarkDirty(this);
+    }
+    sheet_.MarkTextChanged(pos_);
+}
+
+void Cell::Clear() {
+    SetValue(cell_detail::CellValue());
+}
+
+void Cell::LoadValue(cell_detail::CellValue value) {
+    assert(cell_value_.GetType() == cell_detail::CellValue::Type::Empty);
+    cell_value_ = std::move(value);
+}
+
+void Cell::BindLoadedFormula() {
+    CreateReferencedCells(cell_value_);
+    BindingReferencedDependency();
+}
+
+bool Cell::OrderLoadedCells(Sheet& sheet) {
+    DependencyGraph& graph = sheet.GetDependencyGraph();
+    const ColumnValues& columns = sheet.GetColumnValues();
+    return graph.RebuildOrder([&](DependencyGraph::NodeId node, auto func) {
+        graph.ForEachPrecedent(node, func);
+        const Cell* cell = graph.GetCell(node);
+        if (!cell->IsFormula() || !cell->cell_value_.GetFormula().HasReferencedRanges()) {
+            return;
+        }
+        // Формулы не вычислены, поэтому формулы диапазона - это его
+        // невычисленные значения: по ним не нужно обходить все ячейки.
+        for (const Range& range : cell->cell_value_.GetFormula().GetReferencedRanges()) {
+            columns.ForEachPending(range, [&sheet, &func](Position pos) {
+                func(static_cast<const Cell*>(sheet.GetCell(pos))->node_);
+            });
+        }
+    });
+}
+
+void Cell::SetText(std::string text) {
+    assert(!IsFormula() && !sheet_.GetColumnValues().IsTracked(pos_.col));
+    assert(text.size() <= 1 || text.front() != FORMULA_SIGN);
+    cell_value_ = cell_detail::CellValue::MakeText(text);
 }
 
 Cell::Value Cell::GetValue() const {
-    return cell_value_->GetValue();
+    switch (cell_value_.GetType()) {
+    case cell_detail::CellValue::Type::Text: {
+        std::string_view text = cell_value_.GetText();
+        if (text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return std::string(text);
+    }
+    case cell_detail::CellValue::Type::Formula:
+        return std::visit(cell_detail::CellValueConverter{}, GetNumericValue());
+    default:
+        return 0.0;
+    }
+}
+
+std::optional<double> Cell::GetRangeValue() const {
+    switch (cell_value_.GetType()) {
+    case cell_detail::CellValue::Type::Text: {
+        const double value = cell_value_.GetEvaluationValue();
+        if (GetErrorCategory(value)) {
+            return std::nullopt;
+        }
+        return value;
+    }
+    case cell_detail::CellValue::Type::Formula:
+        return GetEvaluationValue();
+    default:
+        return std::nullopt;
+    }
+}
+
+void Cell::PublishValue() const {
+    using Kind = ColumnValues::Kind;
+
+    ColumnValues& columns = sheet_.GetColumnValues();
+    if (!columns.IsTracked(pos_.col)) {
+        return;
+    }
+    if (cell_value_.GetType() == cell_detail::CellValue::Type::Empty) {
+        columns.Set(pos_, Kind::Blank);
+    }
+    else if (!cell_value_.HasNumericValue()) {
+        columns.Set(pos_, Kind::Pending);
+    }
+    else if (const double value = cell_value_.GetEvaluationValue(); !GetErrorCategory(value)) {
+        columns.Set(pos_, Kind::Number, value);
+    }
+    else if (cell_value_.GetType() == cell_detail::CellValue::Type::Text) {
+        columns.Set(pos_, Kind::Blank);
+    }
+    else {
+        columns.Set(pos_, Kind::Error, value);
+    }
+}
+
+void Cell::UpdateWithPrecedents() const {
+    if (evaluation_depth == 0) {
+        // Потоки, которые читают устаревшие формулы, вычисляют их по очереди.
+        // Формулу, которую вычислил поток, получивший защиту раньше, второй
+        // раз не вычисляют.
+        std::lock_guard lock(sheet_.GetEvaluationMutex());
+        UpdateIfStale();
+        return;
+    }
+
+    DependencyGraph& graph = sheet_.GetDependencyGraph();
+    const ColumnValues& columns = sheet_.GetColumnValues();
+    // Устаревшие формулы диапазонов отмечены в значениях столбцов, а ячейки
+    // без формулы обновлять не нужно.
+    std::vector<const Cell*> stack;
+    auto push_precedents = [this, &graph, &columns, &stack](const Cell* cell) {
+        auto push = [&graph, &stack](const Cell* precedent) {
+            if (precedent->IsDirty() && graph.Visit(precedent->node_)) {
+                stack.push_back(precedent);
+            }
+        };
+        graph.ForEachPrecedent(cell->node_, [&graph, &push](DependencyGraph::NodeId node) {
+            push(graph.GetCell(node));
+        });
+        const FormulaInterface& formula = cell->cell_value_.GetFormula();
+        if (!formula.HasReferencedRanges()) {
+            return;
+        }
+        for (const Range& range : formula.GetReferencedRanges()) {
+            columns.ForEachPending(range, [this, &push](Position pos) {
+                push(static_cast<const Cell*>(sheet_.GetCell(pos)));
+            });
+        }
+    };
+    graph.StartVisit();
+    graph.Visit(node_);
+    push_precedents(this);
+    if (stack.empty()) {
+        Update();
+        return;
+    }
+    std::vector<const Cell*> cells{ this };
+    while (!stack.empty()) {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        cells.push_back(cell);
+        push_precedents(cell);
+    }
+    std::sort(cells.begin(), cells.end(), [&graph](const Cell* lhs, const Cell* rhs) {
+        return graph.GetOrder(lhs->node_) < graph.GetOrder(rhs->node_);
+    });
+    for (const Cell* cell : cells) {
+        cell->Update();
+    }
+}
+
+void Cell::UpdateIfStale() const {
+    if (cell_value_.HasNumericValue()) {
+        return;
+    }
+    // Обычно всё, от чего зависит формула, уже обновлено, поэтому она сначала
+    // просто вычисляется. Устаревшая ячейка, которая встретится при этом,
+    // обновит обходом всё, от чего зависит сама, так что вычисления
+    // вкладываются не глубже двух уровней. Формулу, которой нужна только
+    // проверка, сразу обходят: возможно, её не придётся вычислять.
+    EvaluationScope scope;
+    if (cell_value_.GetState() == cell_detail::CellValue::State::Check) {
+        UpdateWithPrecedents();
+    }
+    else {
+        Update();
+    }
+}
+
+void Cell::Update() const {
+    using State = cell_detail::CellValue::State;
+
+    // формулы, от которых зависит Check, уже обновлены, и ни одна не
+    // изменилась, иначе Check стала бы Dirty
+    if (cell_value_.GetState() == State::Check) {
+        cell_value_.SetState(State::Valid);
+        PublishValue();
+    }
+    // при ленивом пересчёте всё, что зависит от формулы, уже Dirty
+    else if (Recompute() && sheet_.GetRecalculationMode() == Sheet::RecalculationMode::Eager
+        && (HasBindingCells() || sheet_.GetColumnValues().IsTracked(pos_.col))) {
+        MarkDependents(State::Dirty);
+    }
+}
+
+bool Cell::Recompute() const {
+    const bool had_value = cell_value_.GetState() != cell_detail::CellValue::State::Unevaluated;
+    const double previous = cell_value_.GetEvaluationValue();
+    EvaluateFormula();
+    return !had_value || !IsSameNumber(previous, cell_value_.GetEvaluationValue());
+}
+
+void Cell::EvaluateFormula() const {
+    cell_value_.SetNumericValue(cell_value_.GetFormula().Evaluate(sheet_, sheet_.GetColumnValues()));
+    PublishValue();
 }
 
-Cell::Value Cell::GetRawValue() const {
-    return cell_value_->GetRawValue();
+bool Cell::UpdateConcurrently(bool inputs_changed, std::mutex& columns_mutex) const {
+    using State = cell_detail::CellValue::State;
+
+    const bool is_tracked = sheet_.GetColumnValues().IsTracked(pos_.col);
+    if (cell_value_.GetState() == State::Check && !inputs_changed) {
+        cell_value_.SetState(State::Valid);
+        if (is_tracked) {
+            std::lock_guard lock(columns_mutex);
+            PublishValue();
+        }
+        return false;
+    }
+
+    const bool had_value = cell_value_.GetState() != State::Unevaluated;
+    const double previous = cell_value_.GetEvaluationValue();
+    const FormulaInterface& formula = cell_value_.GetFormula();
+    if (formula.HasReferencedRanges()) {
+        // индекс столбца достраивается при чтении, поэтому и чтение под защитой
+        std::lock_guard lock(columns_mutex);
+        EvaluateFormula();
+    }
+    else {
+        cell_value_.SetNumericValue(formula.Evaluate(sheet_));
+        if (is_tracked) {
+            std::lock_guard lock(columns_mutex);
+            PublishValue();
+        }
+    }
+    return !had_value || !IsSameNumber(previous, cell_value_.GetEvaluationValue());
 }
 
 std::string Cell::GetText() const {
-    return cell_value_->GetText();
+    switch (cell_value_.GetType()) {
+    case cell_detail::CellValue::Type::Text:
+        return std::string(cell_value_.GetText());
+    case cell_detail::CellValue::Type::Formula:
+        return '=' + cell_value_.GetFormula().GetExpression();
+    default:
+        return std::string();
+    }
+}
+
+void Cell::PrintValue(ExportBuffer& output) const {
+    switch (cell_value_.GetType()) {
+    case cell_detail::CellValue::Type::Text: {
+        std::string_view text = cell_value_.GetText();
+        if (text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        output.Write(text);
+        break;
+    }
+    case cell_detail::CellValue::Type::Formula:
+        std::visit([&output](const auto& value) {
+            output.Write(value);
+        }, GetNumericValue());
+        break;
+    default:
+        output.Write(0.0);
+    }
+}
+
+void Cell::PrintText(ExportBuffer& output) const {
+    switch (cell_value_.GetType()) {
+    case cell_detail::CellValue::Type::Text:
+        output.Write(cell_value_.GetText());
+        break;
+    case cell_detail::CellValue::Type::Formula:
+        output.Write(FORMULA_SIGN);
+        cell_value_.GetFormula().PrintExpression(output.GetStream());
+        break;
+    default:
+        break;
+    }
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        std::unordered_set<const Cell*> visited_cells;
+    if (cell_value_.GetType() == cell_detail::CellValue::Type::Formula) {
         std::vector<Position> referenced_cells;
-        CreateReferencedCellsInPlace(referenced_cells, visited_cells);
+        CreateReferencedCellsInPlace(referenced_cells);
         return referenced_cells;
     }
     return {};
 }
 
 bool Cell::IsReferenced() const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        return !dynamic_cast<cell_detail::FormulaCellValue*>(cell_value_.get())->GetReferencedCells().empty();
-    }
-    return false;
+    return sheet_.GetDependencyGraph().GetPrecedentCount(node_) != 0;
+}
+
+bool Cell::HasBindingCells() const {
+    return sheet_.GetDependencyGraph().GetDependentCount(node_) != 0;
 }
 
 bool Cell::IsCacheValie() const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        return dynamic_cast<cell_detail::FormulaCellValue*>(cell_value_.get())->IsCacheValid();
+    return cell_value_.GetType() == cell_detail::CellValue::Type::Formula && cell_value_.HasNumericValue();
+}
+
+void Cell::CreateReferencedCellsInPlace(std::vector<Position>& referenced_cells) const {
+    // Путь от ячейки: узел и сколько его предшественников уже пройдено.
+    // Порядок тот же, что у рекурсивного обхода: ячейка добавляется, когда
+    // до неё дошли, и сразу обходятся её предшественники. Метод вызывают
+    // из нескольких потоков сразу, поэтому посещённые узлы отмечаются в
+    // своём массиве, а не общими отметками графа.
+    struct Frame {
+        DependencyGraph::NodeId node;
+        size_t next_precedent;
+    };
+    const DependencyGraph& graph = static_cast<const Sheet&>(sheet_).GetDependencyGraph();
+    std::vector<bool> visited(graph.GetNodeLimit(), false);
+    std::vector<Frame> path{ { node_, 0 } };
+    while (!path.empty()) {
+        Frame& frame = path.back();
+        if (frame.next_precedent == graph.GetPrecedentCount(frame.node)) {
+            path.pop_back();
+            continue;
+        }
+        const DependencyGraph::NodeId node = graph.GetPrecedent(frame.node, frame.next_precedent++);
+        if (!visited[node]) {
+            visited[node] = true;
+            referenced_cells.push_back(graph.GetCell(node)->pos_);
+            path.push_back({ node, 0 });
+        }
     }
-    return false;
 }
 
-void Cell::CreateReferencedCellsInPlace(std::vector<Position>& referenced_cells, std::unordered_set<const Cell*>& visited_cells) const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        for (const Position& pos : dynamic_cast<cell_detail::FormulaCellValue*>(cell_value_.get())->GetReferencedCells()) {
-            const Cell* cell = dynamic_cast<const Cell*>(sheet_.GetCell(pos));
-            if (!visited_cells.count(cell)) {
-                referenced_cells.push_back(pos);
-                visited_cells.insert(cell);
-                cell->CreateReferencedCellsInPlace(referenced_cells, visited_cells);
+void Cell::CreateReferencedCells(const cell_detail::CellValue& value) {
+    if (value.GetType() == cell_detail::CellValue::Type::Formula) {
+        for (const Position& pos : value.GetFormula().GetReferencedCells()) {
+            if (!sheet_.GetCell(pos)) {
+                sheet_.AddCell(pos);
             }
         }
     }
 }
 
-bool Cell::DoesCellHaveCircularDependency(const Cell* const self, const std::unique_ptr<cell_detail::CellValueInterface>& current_cell_value, std::unordered_set<const Cell*>& visited_cells) const {
-    if (current_cell_value->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        for (const Position& pos : dynamic_cast<cell_detail::FormulaCellValue*>(current_cell_value.get())->GetReferencedCells()) {
-            const Cell* cell = dynamic_cast<const Cell*>(sheet_.GetCell(pos));
-            if (self == cell) {
-                return true;
-            }
-            if (!cell) {
-                sheet_.SetCell(pos, "");
-                cell = dynamic_cast<const Cell*>(sheet_.GetCell(pos));
+bool Cell::DoesCellHaveCircularDependency(const cell_detail::CellValue& new_cell_value) {
+    using Type = cell_detail::CellValue::Type;
+    if (new_cell_value.GetType() != Type::Formula) {
+        return false;
+    }
+    DependencyGraph& graph = sheet_.GetDependencyGraph();
+    const ColumnValues& columns = sheet_.GetColumnValues();
+    // Связи формул с диапазонами хранятся в значениях столбцов. Порядок
+    // учитывает только формулы в диапазонах: ячейка без формулы ни от чего не
+    // зависит, поэтому не может замкнуть цикл.
+    auto for_each_successor = [&graph, &columns](DependencyGraph::NodeId node, auto func) {
+        graph.ForEachDependent(node, func);
+        columns.ForEachDependent(graph.GetCell(node)->pos_, [&func](const Cell* cell) {
+            func(cell->node_);
+        });
+    };
+    auto for_each_formula_in_range = [this](const Range& range, auto func) {
+        sheet_.ForEachCellInRange(range, [&func](const Cell* cell) {
+            if (cell->cell_value_.GetType() == Type::Formula) {
+                func(cell->node_);
             }
-            if (!visited_cells.count(cell)) {
-                visited_cells.insert(cell);
-                if (cell->DoesCellHaveCircularDependency(self, cell->cell_value_, visited_cells)) {
-                    return true;
-                }
+        });
+    };
+    auto for_each_predecessor = [&graph, &for_each_formula_in_range](DependencyGraph::NodeId node, auto func) {
+        graph.ForEachPrecedent(node, func);
+        const Cell* cell = graph.GetCell(node);
+        if (cell->cell_value_.GetType() == Type::Formula) {
+            for (const Range& range : cell->cell_value_.GetFormula().GetReferencedRanges()) {
+                for_each_formula_in_range(range, func);
             }
         }
+    };
+
+    // Формула в диапазоне идёт раньше формул, которые читают диапазон. Пока
+    // ячейка не формула, от неё ничего не зависит, и перестановка не может
+    // найти цикл.
+    if (cell_value_.GetType() != Type::Formula) {
+        columns.ForEachDependent(pos_, [&](const Cell* cell) {
+            [[maybe_unused]] const bool is_ordered = graph.OrderBefore({ node_ }, cell->node_,
+                for_each_successor, for_each_predecessor);
+            assert(is_ordered);
+        });
     }
-    return false;
-}
 
-void Cell::InvalidateBindingCache(std::unordered_set<const Cell*>& visited_cells) const {
-    for (const Cell* cell : binding_cells_) {
-        if (!visited_cells.count(cell)) {
-            visited_cells.insert(cell);
-            cell->InvalidateCache();
-            cell->InvalidateBindingCache(visited_cells);
+    std::vector<DependencyGraph::NodeId> sources;
+    const FormulaInterface& formula = new_cell_value.GetFormula();
+    for (const Position& pos : formula.GetReferencedCells()) {
+        sources.push_back(static_cast<const Cell*>(sheet_.GetCell(pos))->node_);
+    }
+    for (const Range& range : formula.GetReferencedRanges()) {
+        if (range.Contains(pos_)) {
+            return true;
         }
+        for_each_formula_in_range(range, [&sources](DependencyGraph::NodeId node) {
+            sources.push_back(node);
+        });
     }
+    return !graph.OrderBefore(sources, node_, for_each_successor, for_each_predecessor);
 }
 
-void Cell::InvalidateCache() const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        dynamic_cast<cell_detail::FormulaCellValue*>(cell_value_.get())->ResetCache();
+void Cell::MarkDependents(cell_detail::CellValue::State state) const {
+    using State = cell_detail::CellValue::State;
+
+    const DependencyGraph& graph = sheet_.GetDependencyGraph();
+    const ColumnValues& columns = sheet_.GetColumnValues();
+    // формулы, которые только что устарели и зависимые которых ещё не отмечены
+    std::vector<const Cell*> stack;
+    auto mark_dependents = [&graph, &columns, &stack](const Cell* cell, State state) {
+        auto mark = [&stack, state](const Cell* dependent) {
+            if (dependent->MarkStale(state)) {
+                stack.push_back(dependent);
+            }
+        };
+        graph.ForEachDependent(cell->node_, [&graph, &mark](DependencyGraph::NodeId node) {
+            mark(graph.GetCell(node));
+        });
+        columns.ForEachDependent(cell->pos_, mark);
+    };
+    if (sheet_.GetRecalculationMode() == Sheet::RecalculationMode::Eager) {
+        mark_dependents(this, state);
+        return;
+    }
+    mark_dependents(this, State::Dirty);
+    while (!stack.empty()) {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        mark_dependents(cell, State::Dirty);
     }
 }
 
-void Cell::UnbindReferencedDependency() const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        for (const Position& pos : dynamic_cast<cell_detail::FormulaCellValue*>(cell_value_.get())->GetReferencedCells()) {
-            const Cell* cell = dynamic_cast<const Cell*>(sheet_.GetCell(pos));
-            cell->UnbindCell(this);
-        }
+bool Cell::MarkStale(cell_detail::CellValue::State state) const {
+    const cell_detail::CellValue::State previous = cell_value_.GetState();
+    if (previous >= state) {
+        return false;
     }
+    cell_value_.SetState(state);
+    if (previous != cell_detail::CellValue::State::Valid) {
+        return false;
+    }
+    PublishValue();
+    sheet_.MarkDirty(this);
+    sheet_.MarkValueChanged(pos_);
+    return true;
 }
 
-void Cell::BindingReferencedDependency() const {
-    if (cell_value_->GetCellValueType() == cell_detail::CellValueInterface::CellValueType::Formula) {
-        for (const Position& pos : dynamic_cast<cell_detail::FormulaCellValue*>(cell_value_.get())->GetReferencedCells()) {
-            const Cell* cell = dynamic_cast<const Cell*>(sheet_.GetCell(pos));
-            cell->BindCell(this);
+void Cell::UnbindReferencedDependency() {
+    if (cell_value_.GetType() == cell_detail::CellValue::Type::Formula) {
+        FormulaInterface& formula = cell_value_.GetFormula();
+        formula.UnbindReferencedCells();
+        sheet_.GetDependencyGraph().ClearPrecedents(node_);
+        for (const Range& range : formula.GetReferencedRanges()) {
+            sheet_.UnbindRange(range, this);
         }
     }
 }
 
-std::unique_ptr<cell_detail::CellValueInterface> Cell::CreateCell(std::string text) {
-    if (!text.empty()) {
-        if (text.size() > 1 && text.front() == FORMULA_SIGN) {
-            return std::make_unique<cell_detail::FormulaCellValue>(std::string(text.begin() + 1, text.end()), this, sheet_);
-        }
-        else {
-            return std::make_unique<cell_detail::TextCellValue>(std::move(text));
+void Cell::BindingReferencedDependency() {
+    if (cell_value_.GetType() == cell_detail::CellValue::Type::Formula) {
+        FormulaInterface& formula = cell_value_.GetFormula();
+        const std::vector<Position> referenced_cells = formula.GetReferencedCells();
+        std::vector<DependencyGraph::NodeId> precedents(referenced_cells.size());
+        std::transform(referenced_cells.begin(), referenced_cells.end(), precedents.begin(), [this](Position pos) {
+            return static_cast<const Cell*>(sheet_.GetCell(pos))->node_;
+        });
+        sheet_.GetDependencyGraph().SetPrecedents(node_, precedents.begin(), precedents.end());
+        for (const Range& range : formula.GetReferencedRanges()) {
+            sheet_.BindRange(range, this);
         }
+        formula.BindReferencedCells(sheet_);
+    }
+}
+
+cell_detail::CellValue Cell::CreateCell(std::string text, Position pos, FormulaTable* formulas) {
+    if (text.size() > 1 && text.front() == FORMULA_SIGN) {
+        std::string expression(text.begin() + 1, text.end());
+        return cell_detail::CellValue::MakeFormula(formulas
+            ? ParseFormula(std::move(expression), pos, *formulas)
+            : ParseFormula(std::move(expression), resource_));
     }
-    return std::make_unique<cell_detail::EmptyCellValue>();
+    return cell_detail::CellValue::MakeText(text);
 }
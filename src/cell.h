@@ -1,81 +1,135 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <string_view>
 
+#include "arena.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "export_buffer.h"
 #include "formula.h"
-#include <unordered_set>
 
-class Cell;
+class Sheet;
 
 namespace cell_detail {
 
-class CellValueInterface {
+// Разбирает число так же, как std::stod: допускаются ведущие пробелы и
+// произвольный хвост после числа. Возвращает nullopt, если число не найдено
+// или выходит за пределы double.
+std::optional<double> ParseNumericText(const std::string& text);
+
+// Содержимое ячейки: пусто, текст или формула. Хранится прямо в ячейке,
+// без отдельного объекта с виртуальными методами. Текст длиной до
+// INLINE_TEXT_CAPACITY символов лежит внутри значения, более длинный - в куче.
+// Число, которое представляет текст, и закэшированное значение формулы
+// занимают одно и то же поле.
+class CellValue {
 public:
-    using Value = CellInterface::Value;
-
-    enum class CellValueType {
+    enum class Type : uint8_t {
         Empty,
         Text,
         Formula
     };
 
-public:
-    explicit CellValueInterface(CellValueType type)
-        : type_(type) {
-    }
-    virtual ~CellValueInterface() = default;
-    virtual Value GetValue() const = 0;
-    virtual Value GetRawValue() const = 0;
-    virtual std::string GetText() const = 0;
-    CellValueType GetCellValueType() const {
+    // Состояние значения формулы. Устаревшая формула хранит значение,
+    // вычисленное последним: новое сравнивается с ним, и если оно то же,
+    // формулы, которые ссылаются на эту, не пересчитываются. Состояния
+    // упорядочены от свежего к самому устаревшему.
+    enum class State : uint8_t {
+        Valid,
+        // могли измениться значения формул, от которых зависит формула
+        Check,
+        // изменились значения ячеек, на которые ссылается формула, или сама
+        // формула
+        Dirty,
+        // формула ещё не вычислялась
+        Unevaluated,
+    };
+
+    static constexpr size_t INLINE_TEXT_CAPACITY = sizeof(ArenaPtr<FormulaInterface>);
+
+    CellValue() noexcept;
+    static CellValue MakeText(const std::string& text);
+    static CellValue MakeFormula(ArenaPtr<FormulaInterface> formula);
+
+    CellValue(const CellValue&) = delete;
+    CellValue& operator=(const CellValue&) = delete;
+    CellValue(CellValue&& other) noexcept;
+    CellValue& operator=(CellValue&& other) noexcept;
+    ~CellValue();
+
+    Type GetType() const {
         return type_;
     }
 
-private:
-    CellValueType type_;
-};
+    // Текст в том виде, в котором его задали. Только для Type::Text.
+    std::string_view GetText() const;
 
-class EmptyCellValue : public CellValueInterface {
-public:
-    EmptyCellValue()
-        : CellValueInterface(CellValueInterface::CellValueType::Empty) {
-    }
+    // Только для Type::Formula.
+    const FormulaInterface& GetFormula() const;
+    FormulaInterface& GetFormula();
 
-    Value GetValue() const override {
-        return 0.0;
+    // Для пустой ячейки и текста значение известно всегда, для формулы - пока
+    // оно не устарело.
+    bool HasNumericValue() const {
+        return GetState() == State::Valid;
     }
-
-    Value GetRawValue() const override {
-        return 0.0;
+    // Только после HasNumericValue(): состояние здесь не читается ещё раз.
+    FormulaInterface::Value GetNumericValue() const;
+    // Значение становится верным.
+    void SetNumericValue(const FormulaInterface::Value& value) const;
+
+    // Состояние публикует значение: поток, который прочитал Valid, видит
+    // число, записанное до того, как состояние стало Valid. Поэтому верное
+    // значение читается без блокировок.
+    State GetState() const {
+        return state_.load(std::memory_order_acquire);
     }
-
-    std::string GetText() const override {
-        return std::string();
+    void SetState(State state) const {
+        state_.store(state, std::memory_order_release);
     }
-};
 
-class TextCellValue : public CellValueInterface {
-public:
-    TextCellValue(std::string text)
-        : CellValueInterface(CellValueInterface::CellValueType::Text)
-        , text_(std::move(text)) {
-    }
+    // Формула, которая заменяет формулу previous, до вычисления сравнивается
+    // с её значением.
+    void KeepPreviousValue(const CellValue& previous);
 
-    Value GetValue() const  override {
-        return (!text_.empty() && text_.front() == ESCAPE_SIGN) ? std::string(text_.begin() + 1, text_.end()) : text_;
-    }
+    // Видят ли формулы, которые ссылаются на ячейку, одно и то же значение:
+    // то же число или ошибку и то же значение для диапазонов.
+    bool HasSameObservedValue(const CellValue& other) const;
 
-    Value GetRawValue() const override {
-        return text_;
+    // Значение для вычисления формул: ошибка закодирована в NaN, см.
+    // MakeErrorValue().
+    double GetEvaluationValue() const {
+        return number_;
     }
 
-    std::string GetText() const override {
-        return text_;
-    }
+private:
+    struct HeapText {
+        char* data;
+        size_t size;
+    };
+
+    // Отмечает в text_size_ текст, хранящийся в куче.
+    static constexpr uint8_t HEAP_TEXT = UINT8_MAX;
+
+    void Destroy() noexcept;
+    void MoveFrom(CellValue& other) noexcept;
 
 private:
-    std::string text_;
+    union {
+        char inline_text_[INLINE_TEXT_CAPACITY];
+        HeapText heap_text_;
+        ArenaPtr<FormulaInterface> formula_;
+    };
+    // число, которое представляет текст, или значение формулы
+    mutable double number_ = 0.0;
+    Type type_ = Type::Empty;
+    uint8_t text_size_ = 0;
+    mutable std::atomic<State> state_{ State::Valid };
 };
 
 struct CellValueConverter {
@@ -88,99 +142,206 @@ struct CellValueConverter {
     }
 };
 
-class FormulaCellValue : public CellValueInterface {
+} // namespace cell_detail
+
+class Cell final : public CellInterface {
 public:
-    FormulaCellValue(std::string text, Cell* self, SheetInterface& sheet)
-        : CellValueInterface(CellValueInterface::CellValueType::Formula)
-        , formula_(ParseFormula(std::move(text)))
-        , sheet_(sheet) {
-    }
+    // Пустая ячейка pos листа sheet, узел графа зависимостей листа. Значение
+    // ячейки размещается в переданном ресурсе памяти.
+    Cell(Sheet& sheet, Position pos, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
-    Value GetValue() const  override {
-        if (!cache_value_) {
-            cache_value_ = std::visit(CellValueConverter{}, formula_->Evaluate(sheet_));
-        }
-        return *cache_value_;
-    }
+    ~Cell();
 
-    Value GetRawValue() const override {
-        return GetValue();
-    }
+    void Set(std::string text);
 
-    std::string GetText() const override {
-        return '=' + formula_->GetExpression();
-    }
+    // То же, но формула разбирается один раз для всех ячеек с такой же
+    // относительной формулой из таблицы formulas.
+    void Set(std::string text, FormulaTable& formulas);
 
-    void ResetCache() const {
-        cache_value_.reset();
-    }
+    void Clear();
 
-    std::vector<Position> GetReferencedCells() const {
-        return formula_->GetReferencedCells();
-    }
+    // Задаёт ячейке текст, который не является формулой. Ячейка не должна
+    // быть формулой, а её значение не должны читать ни формулы, ни диапазоны:
+    // тогда изменение не касается ни других ячеек, ни графа зависимостей, ни
+    // значений столбцов листа. Для снимков изменение отмечает лист.
+    void SetText(std::string text);
 
-    bool IsCacheValid() const {
-        return cache_value_.has_value();
-    }
+    // Пакетное изменение листа (см. Sheet::CommitBatch()) меняет значения
+    // ячеек в несколько шагов: разбирает все новые значения, снимает связи
+    // прежних, связывает новые и только потом отмечает зависимые формулы.
 
-private:
-    std::unique_ptr<FormulaInterface> formula_;
-    SheetInterface& sheet_;
-    mutable std::optional<Value> cache_value_;
-};
+    // Значение для этой ячейки из текста text. Формула разбирается один раз
+    // для всех ячеек с такой же относительной формулой из таблицы formulas.
+    cell_detail::CellValue MakeValue(std::string text, FormulaTable& formulas);
 
-} // namespace cell_detail
+    // Снимает связи значения ячейки с другими ячейками и возвращает его.
+    // Ячейка остаётся пустой, пока не получит значение через Attach().
+    // Значение в столбцах листа и зависимые формулы не обновляются.
+    cell_detail::CellValue Detach();
 
-class Cell : public CellInterface {
-public:
-    Cell(SheetInterface& sheet);
+    // Связывает пустую ячейку со значением value, если оно не создаёт цикл.
+    // Ячейки, на которые ссылается формула, должны существовать. Если цикл
+    // есть, возвращает false и ничего не меняет.
+    bool Attach(cell_detail::CellValue& value);
 
-    Cell(std::string text, SheetInterface& sheet);
+    // Значение previous, которое ячейка имела до Detach(), заменено.
+    // Отмечает зависимые формулы, если значение ячейки для них изменилось, и
+    // записывает значение в столбцы листа.
+    void CompleteChange(const cell_detail::CellValue& previous);
 
-    ~Cell();
+    // Массовая загрузка листа (см. Sheet::ImportTexts()) задаёт значения
+    // ячеек без связей, а потом связывает все формулы и строит порядок графа
+    // за один проход.
 
-    void Set(std::string text);
+    // Задаёт значение пустой ячейке. Формула пока не связана с ячейками, на
+    // которые ссылается, и не вычислена.
+    void LoadValue(cell_detail::CellValue value);
 
-    void Clear();
+    // Связывает загруженную формулу с ячейками, на которые она ссылается,
+    // создавая недостающие. Порядок графа листа при этом не поддерживается.
+    void BindLoadedFormula();
+
+    // Заново строит топологический порядок графа листа sheet с учётом
+    // диапазонов формул, когда все формулы загружены и связаны, но ещё не
+    // вычислены. Возвращает false, если формулы образуют цикл.
+    static bool OrderLoadedCells(Sheet& sheet);
 
     Value GetValue() const override;
 
-    Value GetRawValue() const;
+    // Вычисленное значение читается без блокировок, поэтому проверка
+    // состояния встраивается в место вызова.
+    FormulaInterface::Value GetNumericValue() const {
+        if (!cell_value_.HasNumericValue()) {
+            UpdateWithPrecedents();
+        }
+        return cell_value_.GetNumericValue();
+    }
+
+    // То же, но ошибка закодирована в NaN, см. MakeErrorValue().
+    double GetEvaluationValue() const {
+        if (!cell_value_.HasNumericValue()) {
+            UpdateWithPrecedents();
+        }
+        return cell_value_.GetEvaluationValue();
+    }
+
+    // Значение ячейки для агрегатных функций: nullopt для пустой ячейки и
+    // текста, который не является числом.
+    std::optional<double> GetRangeValue() const;
+
+    // Записывает значение ячейки в значения столбцов листа, если столбец
+    // читают диапазоны формул.
+    void PublishValue() const;
 
     std::string GetText() const override;
 
+    // Печатают в output то же, что operator<< для GetValue() и GetText(),
+    // но без копий текста.
+    void PrintValue(ExportBuffer& output) const;
+    void PrintText(ExportBuffer& output) const;
+
     std::vector<Position> GetReferencedCells() const override;
 
     bool IsReferenced() const;
 
+    // Есть ли формулы, которые ссылаются на эту ячейку.
+    bool HasBindingCells() const;
+
+    DependencyGraph::NodeId GetNode() const {
+        return node_;
+    }
+
+    Position GetPosition() const {
+        return pos_;
+    }
+
     bool IsCacheValie() const;
 
+    bool IsFormula() const {
+        return cell_value_.GetType() == cell_detail::CellValue::Type::Formula;
+    }
+
+    // Формула, значение которой устарело или не вычислено.
+    bool IsDirty() const {
+        return cell_value_.GetType() == cell_detail::CellValue::Type::Formula && !cell_value_.HasNumericValue();
+    }
+
+    // Обновляет формулу, ячейки которой (в том числе ячейки её диапазонов) уже
+    // обновлены. inputs_changed - изменились ли при этом значения формул, от
+    // которых она зависит; если нет, формула, которой нужна только проверка,
+    // не вычисляется. Возвращает, изменилось ли значение. Зависимые формулы не
+    // отмечаются: это делает вызывающий. Формулы разных ячеек можно обновлять
+    // так одновременно: значения столбцов листа читаются и записываются под
+    // columns_mutex.
+    bool UpdateConcurrently(bool inputs_changed, std::mutex& columns_mutex) const;
+
+    // Обновляет формулу, если её значение устарело, вместе с устаревшими
+    // формулами, от которых она зависит. Вызывающий держит
+    // Sheet::GetEvaluationMutex().
+    void UpdateIfStale() const;
+
+    // Формулы, которые зависят от этой устаревшей формулы, получают
+    // состояние не свежее Check.
+    void MarkDependentsToCheck() const {
+        MarkDependents(cell_detail::CellValue::State::Check);
+    }
+
 private:
-    void CreateReferencedCellsInPlace(std::vector<Position>& referenced_cells, std::unordered_set<const Cell*>& visited_cells) const;
+    // Обходы ниже отмечают посещённые ячейки в графе зависимостей листа и
+    // хранят путь в явном стеке, поэтому не зависят от глубины цепочек.
 
-    bool DoesCellHaveCircularDependency(const Cell* const self, const std::unique_ptr<cell_detail::CellValueInterface>& current_cell_value, std::unordered_set<const Cell*>& visited_cells) const;
+    // Добавляет ячейки, от которых формула зависит напрямую или через другие
+    // формулы, в порядке обхода в глубину.
+    void CreateReferencedCellsInPlace(std::vector<Position>& referenced_cells) const;
 
-    void InvalidateBindingCache(std::unordered_set<const Cell*>& visited_cells) const;
+    // Создаёт пустыми ячейки, на которые ссылается формула value, если их нет.
+    void CreateReferencedCells(const cell_detail::CellValue& value);
 
-    void InvalidateCache() const;
+    // Создаст ли значение new_cell_value цикл. Если нет, ячейка ставится в
+    // топологическом порядке графа после ячеек, от которых будет зависеть.
+    bool DoesCellHaveCircularDependency(const cell_detail::CellValue& new_cell_value);
 
-    void UnbindReferencedDependency() const;
+    // Значение ячейки изменилось. При немедленном пересчёте формулы, которые
+    // ссылаются на неё напрямую или через диапазон, получают состояние не
+    // свежее state, а дальше пересчёт идёт сам, если их значения изменятся.
+    // При ленивом значения вычисляются по запросу, и проверка формулы стоит
+    // почти столько же, сколько её вычисление, поэтому Dirty становятся все
+    // формулы, которые зависят от ячейки. Обход останавливается на
+    // устаревших формулах: всё, что от них зависит, уже устарело.
+    void MarkDependents(cell_detail::CellValue::State state) const;
 
-    void UnbindCell(const Cell* cell) const {
-        binding_cells_.erase(cell);
-    }
+    // Обновляет формулу и все устаревшие формулы, от которых она зависит, в
+    // топологическом порядке: каждая формула читает уже обновлённые значения,
+    // и вычисления не вкладываются друг в друга.
+    void UpdateWithPrecedents() const;
 
-    void BindCell(const Cell* cell) const {
-        binding_cells_.insert(cell);
-    }
+    // Формула получает состояние не свежее state. Возвращает, было ли её
+    // значение верным.
+    bool MarkStale(cell_detail::CellValue::State state) const;
+
+    void UnbindReferencedDependency();
 
-    void BindingReferencedDependency() const;
+    void BindingReferencedDependency();
 
 private:
-    std::unique_ptr<cell_detail::CellValueInterface> CreateCell(std::string text);
+    // formulas может быть nullptr, тогда формула разбирается только для этой ячейки
+    cell_detail::CellValue CreateCell(std::string text, Position pos, FormulaTable* formulas);
+
+    void SetValue(cell_detail::CellValue new_cell_value);
+
+    // Обновляет только эту формулу. Если её значение изменилось, зависимые
+    // формулы отмечаются Dirty.
+    void Update() const;
+
+    // Вычисляет только эту формулу. Возвращает, изменилось ли значение.
+    bool Recompute() const;
+
+    void EvaluateFormula() const;
 
 private:
-    SheetInterface& sheet_;
-    std::unique_ptr<cell_detail::CellValueInterface> cell_value_;
-    mutable std::unordered_set<const Cell*> binding_cells_;
+    Sheet& sheet_;
+    Position pos_;
+    cell_detail::CellValue cell_value_;
+    std::pmr::memory_resource* resource_;
+    DependencyGraph::NodeId node_;
 };
@@ -0,0 +1,287 @@
+#include "column_values.h"
+
+#include "cell.h"
+
+#include <algorithm>
+#include <cassert>
+
+using ASTImpl::Function;
+
+namespace {
+
+// Несколько независимых сумм не ждут друг друга, и компилятор может
+// разложить их по одному векторному регистру.
+double SumValues(const double* values, size_t count) {
+    double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sums[0] += values[i];
+        sums[1] += values[i + 1];
+        sums[2] += values[i + 2];
+        sums[3] += values[i + 3];
+    }
+    for (; i < count; ++i) {
+        sums[0] += values[i];
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+// NaN, который не является ошибкой, пропускается так же, как в
+// AggregateTotals::Add().
+void UpdateMinMax(const double* values, size_t count, double& min, double& max) {
+    double mins[4] = { min, min, min, min };
+    double maxs[4] = { max, max, max, max };
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (size_t j = 0; j < 4; ++j) {
+            mins[j] = (values[i + j] < mins[j]) ? values[i + j] : mins[j];
+            maxs[j] = (values[i + j] > maxs[j]) ? values[i + j] : maxs[j];
+        }
+    }
+    for (; i < count; ++i) {
+        mins[0] = (values[i] < mins[0]) ? values[i] : mins[0];
+        maxs[0] = (values[i] > maxs[0]) ? values[i] : maxs[0];
+    }
+    min = std::min(std::min(mins[0], mins[1]), std::min(mins[2], mins[3]));
+    max = std::max(std::max(maxs[0], maxs[1]), std::max(maxs[2], maxs[3]));
+}
+
+} // namespace
+
+ColumnValues::ColumnValues() = default;
+ColumnValues::~ColumnValues() = default;
+
+size_t ColumnValues::GetIndexedColumnCount() const {
+    return std::count_if(columns_.begin(), columns_.end(), [](const std::unique_ptr<Column>& column) {
+        return column && column->index;
+    });
+}
+
+void ColumnValues::Set(Position pos, Kind kind, double value) {
+    assert(IsTracked(pos.col));
+    Column& column = *columns_[pos.col];
+    const int chunk_index = pos.row >> CHUNK_BITS;
+    const uint64_t chunk_bit = uint64_t{ 1 } << chunk_index;
+    auto& chunk = column.chunks[chunk_index];
+    if (!chunk) {
+        if (kind == Kind::Blank) {
+            return;
+        }
+        chunk = std::make_unique<Chunk>();
+    }
+
+    const int row = pos.row & (CHUNK_ROWS - 1);
+    const int word = row / WORD_BITS;
+    const uint64_t bit = uint64_t{ 1 } << (row % WORD_BITS);
+    const bool was_blank = !((chunk->numbers[word] | chunk->errors[word] | chunk->pending[word]) & bit);
+
+    chunk->numbers[word] &= ~bit;
+    chunk->errors[word] &= ~bit;
+    chunk->pending[word] &= ~bit;
+    chunk->values[row] = 0.0;
+    switch (kind) {
+    case Kind::Number:
+        chunk->numbers[word] |= bit;
+        chunk->values[row] = value;
+        break;
+    case Kind::Error:
+        chunk->errors[word] |= bit;
+        chunk->values[row] = value;
+        break;
+    case Kind::Pending:
+        chunk->pending[word] |= bit;
+        break;
+    default:
+        break;
+    }
+
+    column.stale_chunks |= chunk_bit;
+    if (kind == Kind::Pending) {
+        column.pending_chunks |= chunk_bit;
+    }
+    else if (std::all_of(chunk->pending.begin(), chunk->pending.end(), [](uint64_t word) { return word == 0; })) {
+        column.pending_chunks &= ~chunk_bit;
+    }
+
+    chunk->size += was_blank - (kind == Kind::Blank);
+    if (chunk->size == 0) {
+        chunk.reset();
+    }
+}
+
+void ColumnValues::RemoveDependent(const Range& range, const Cell* cell) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        assert(IsTracked(col));
+        std::vector<Dependent>& dependents = columns_[col]->dependents;
+        auto it = std::find_if(dependents.begin(), dependents.end(), [&range, cell](const Dependent& dependent) {
+            return dependent.cell == cell && dependent.first_row == range.first.row && dependent.last_row == range.last.row;
+        });
+        assert(it != dependents.end());
+        *it = dependents.back();
+        dependents.pop_back();
+
+        if (dependents.empty()) {
+            columns_[col].reset();
+            --tracked_count_;
+        }
+    }
+    while (!columns_.empty() && !columns_.back()) {
+        columns_.pop_back();
+    }
+}
+
+void ColumnValues::Aggregate(Function function, const Range& range, const SheetInterface& sheet,
+    AggregateTotals& totals) const {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        if (IsTracked(col)) {
+            AggregateColumn(function, col, range.first.row, range.last.row, sheet, totals);
+        }
+        else {
+            AggregateCells(function, Range{ { range.first.row, col }, { range.last.row, col } }, sheet, totals);
+        }
+    }
+}
+
+void ColumnValues::AggregateColumn(Function function, int col, int first, int last,
+    const SheetInterface& sheet, AggregateTotals& totals) const {
+    // результат уже известен: ошибка
+    if (totals.error && function != Function::Count) {
+        return;
+    }
+    EvaluatePending(col, first, last, sheet);
+
+    const Column& column = *columns_[col];
+    const bool with_sum = (function == Function::Sum || function == Function::Average);
+    const bool with_extremes = (function == Function::Min || function == Function::Max);
+    auto summarize = [&](int chunk_index, int chunk_first, int chunk_last) {
+        if (const Chunk* chunk = column.chunks[chunk_index].get()) {
+            Summarize(*chunk, chunk_first, chunk_last, with_sum, with_extremes, totals);
+        }
+    };
+
+    const int first_chunk = first >> CHUNK_BITS;
+    const int last_chunk = last >> CHUNK_BITS;
+    if (first_chunk == last_chunk) {
+        summarize(first_chunk, first - (first_chunk << CHUNK_BITS), last - (last_chunk << CHUNK_BITS));
+        return;
+    }
+
+    // неполные массивы на концах читаются напрямую, целые - из индекса
+    int full_first = first_chunk;
+    int full_last = last_chunk;
+    if (const int offset = first - (first_chunk << CHUNK_BITS); offset != 0) {
+        summarize(first_chunk, offset, CHUNK_ROWS - 1);
+        ++full_first;
+    }
+    if (const int offset = last - (last_chunk << CHUNK_BITS); offset != CHUNK_ROWS - 1) {
+        summarize(last_chunk, 0, offset);
+        --full_last;
+    }
+    if (full_first <= full_last) {
+        totals.Merge(QueryIndex(column, full_first, full_last));
+    }
+}
+
+void ColumnValues::EvaluatePending(int col, int first, int last, const SheetInterface& sheet) const {
+    // формулы записывают сюда свои значения по мере вычисления
+    ForEachPending(Range{ { first, col }, { last, col } }, [&sheet](Position pos) {
+        static_cast<const Cell*>(sheet.GetCell(pos))->GetEvaluationValue();
+    });
+}
+
+AggregateTotals ColumnValues::QueryIndex(const Column& column, int first_chunk, int last_chunk) const {
+    if (!column.index) {
+        column.index = std::make_unique<Index>();
+        column.stale_chunks = ~uint64_t{ 0 } >> (64 - CHUNK_COUNT);
+    }
+    auto& nodes = column.index->nodes;
+    for (; column.stale_chunks != 0; column.stale_chunks &= column.stale_chunks - 1) {
+        const int chunk_index = storage_detail::CountTrailingZeros(column.stale_chunks);
+        AggregateTotals& leaf = nodes[CHUNK_COUNT + chunk_index];
+        leaf = AggregateTotals{};
+        if (const Chunk* chunk = column.chunks[chunk_index].get()) {
+            Summarize(*chunk, 0, CHUNK_ROWS - 1, true, true, leaf);
+        }
+        for (int node = (CHUNK_COUNT + chunk_index) / 2; node > 0; node /= 2) {
+            nodes[node] = nodes[2 * node];
+            nodes[node].Merge(nodes[2 * node + 1]);
+        }
+    }
+
+    AggregateTotals totals;
+    for (int left = CHUNK_COUNT + first_chunk, right = CHUNK_COUNT + last_chunk + 1; left < right; left /= 2, right /= 2) {
+        if (left & 1) {
+            totals.Merge(nodes[left++]);
+        }
+        if (right & 1) {
+            totals.Merge(nodes[--right]);
+        }
+    }
+    return totals;
+}
+
+void ColumnValues::Summarize(const Chunk& chunk, int first, int last, bool with_sum, bool with_extremes,
+    AggregateTotals& totals) {
+    const int first_word = first / WORD_BITS;
+    const int last_word = last / WORD_BITS;
+    auto window = [first, last](int word) {
+        return storage_detail::BitRange(std::max(first, word * WORD_BITS) - word * WORD_BITS,
+            std::min(last, word * WORD_BITS + WORD_BITS - 1) - word * WORD_BITS);
+    };
+
+    size_t count = 0;
+    bool is_dense = true;
+    bool has_error = false;
+    for (int word = first_word; word <= last_word; ++word) {
+        const uint64_t mask = window(word);
+        const uint64_t numbers = chunk.numbers[word] & mask;
+        count += storage_detail::CountBits(numbers);
+        is_dense &= (numbers == mask);
+        if (const uint64_t errors = chunk.errors[word] & mask; errors != 0 && !has_error) {
+            totals.AddError(chunk.values[word * WORD_BITS + storage_detail::CountTrailingZeros(errors)]);
+            has_error = true;
+        }
+    }
+    totals.count += count;
+    // с ошибкой сумма и крайние значения не нужны: результат - ошибка
+    if (count == 0 || has_error) {
+        return;
+    }
+
+    const double* values = chunk.values.data() + first;
+    const size_t size = last - first + 1;
+    if (with_sum) {
+        totals.sum += SumValues(values, size);
+    }
+    if (!with_extremes) {
+        return;
+    }
+    if (is_dense) {
+        UpdateMinMax(values, size, totals.min, totals.max);
+        return;
+    }
+    for (int word = first_word; word <= last_word; ++word) {
+        for (uint64_t numbers = chunk.numbers[word] & window(word); numbers != 0; numbers &= numbers - 1) {
+            const double value = chunk.values[word * WORD_BITS + storage_detail::CountTrailingZeros(numbers)];
+            totals.min = (value < totals.min) ? value : totals.min;
+            totals.max = (value > totals.max) ? value : totals.max;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+void AggregateCells(Function function, const Range& range, const SheetInterface& sheet,
+    AggregateTotals& totals) {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const auto* cell = static_cast<const Cell*>(sheet.GetCell({ row, col }));
+            if (!cell) {
+                continue;
+            }
+            if (const std::optional<double> value = cell->GetRangeValue()) {
+                totals.Add(*value);
+            }
+        }
+    }
+}
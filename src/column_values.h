@@ -0,0 +1,202 @@
+#pragma once
+
+#include "common.h"
+#include "FormulaAST.h"
+#include "position.h"
+#include "tiled_storage.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Cell;
+
+// Значения ячеек тех столбцов, которые читают диапазоны формул (A1:C100).
+// Значения лежат в плотных массивах по CHUNK_ROWS строк, поэтому агрегатные
+// функции проходят их подряд, не обращаясь к ячейкам. Массив создаётся, когда
+// в его строках появляется значение, и удаляется, когда они пустеют.
+// Для столбца, диапазон которого впервые покрыл целый массив, строится индекс
+// - дерево отрезков над итогами массивов. Тогда длинный диапазон читается за
+// O(log n) узлов плюс неполные массивы на его концах. Изменение значения лишь
+// помечает итоги массива устаревшими, они пересчитываются при чтении.
+// Столбец отслеживается, пока его читает хотя бы один диапазон. Для столбца
+// хранятся и формулы, диапазоны которых его читают: изменение ячейки
+// сбрасывает их кэш без отдельной связи с каждой ячейкой диапазона.
+class ColumnValues {
+public:
+    enum class Kind : uint8_t {
+        Blank,    // пустая ячейка или текст, который не является числом
+        Number,
+        Error,
+        Pending,  // формула, значение которой ещё не вычислено
+    };
+
+    static constexpr int CHUNK_BITS = 8;
+    static constexpr int CHUNK_ROWS = 1 << CHUNK_BITS;
+
+    ColumnValues();
+    ColumnValues(const ColumnValues&) = delete;
+    ColumnValues& operator=(const ColumnValues&) = delete;
+    ~ColumnValues();
+
+    bool IsTracked(int col) const {
+        return col < static_cast<int>(columns_.size()) && columns_[col];
+    }
+
+    // Количество отслеживаемых столбцов.
+    size_t GetTrackedColumnCount() const {
+        return tracked_count_;
+    }
+
+    // Количество столбцов, для которых построен индекс.
+    size_t GetIndexedColumnCount() const;
+
+    // Записывает значение ячейки pos отслеживаемого столбца. value - число
+    // или значение ошибки, см. MakeErrorValue().
+    void Set(Position pos, Kind kind, double value = 0.0);
+
+    // Учитывает формулу cell, которая читает range. Для каждого столбца,
+    // который начинает отслеживаться, вызывает track(int col): он должен
+    // записать значения уже существующих ячеек столбца.
+    template <typename Track>
+    void AddDependent(const Range& range, const Cell* cell, Track track);
+
+    void RemoveDependent(const Range& range, const Cell* cell);
+
+    // Вызывает func(const Cell*) для каждой формулы, диапазон которой
+    // содержит pos.
+    template <typename Func>
+    void ForEachDependent(Position pos, Func func) const;
+
+    // Вызывает func(Position pos) для каждой невычисленной формулы range в
+    // отслеживаемых столбцах.
+    template <typename Func>
+    void ForEachPending(const Range& range, Func func) const;
+
+    // Добавляет к totals значения ячеек range листа sheet. Невычисленные
+    // формулы диапазона вычисляются (и записывают сюда свои значения).
+    // Столбцы, которые не отслеживаются, читаются по ячейкам.
+    void Aggregate(ASTImpl::Function function, const Range& range, const SheetInterface& sheet,
+        AggregateTotals& totals) const;
+
+private:
+    static constexpr int WORD_BITS = 64;
+    static constexpr int CHUNK_WORDS = CHUNK_ROWS / WORD_BITS;
+    static constexpr int CHUNK_COUNT = (Position::MAX_ROWS + CHUNK_ROWS - 1) / CHUNK_ROWS;
+
+    // Строки first_row..last_row столбца читает формула cell.
+    struct Dependent {
+        int first_row;
+        int last_row;
+        const Cell* cell;
+    };
+
+    // Пустые ячейки и невычисленные формулы хранят ноль, поэтому сумму
+    // можно считать по всему окну строк сразу.
+    struct Chunk {
+        std::array<double, CHUNK_ROWS> values{};
+        std::array<uint64_t, CHUNK_WORDS> numbers{};
+        std::array<uint64_t, CHUNK_WORDS> errors{};
+        std::array<uint64_t, CHUNK_WORDS> pending{};
+        int size = 0;
+    };
+
+    static_assert(CHUNK_COUNT <= 64, "chunks of a column are marked in uint64_t");
+
+    // Дерево отрезков: лист CHUNK_COUNT + i хранит итоги массива i, узел -
+    // итоги двух своих детей.
+    struct Index {
+        std::array<AggregateTotals, 2 * CHUNK_COUNT> nodes;
+    };
+
+    struct Column {
+        std::array<std::unique_ptr<Chunk>, CHUNK_COUNT> chunks{};
+        // массивы с невычисленными формулами
+        uint64_t pending_chunks = 0;
+        // Индекс и отметки об устаревших итогах обновляются при чтении.
+        mutable std::unique_ptr<Index> index;
+        mutable uint64_t stale_chunks = 0;
+        std::vector<Dependent> dependents;
+    };
+
+    // Итоги строк first..last (включительно) массива: количество чисел и
+    // первая ошибка, а также сумма и наименьшее и наибольшее числа, если они
+    // нужны.
+    static void Summarize(const Chunk& chunk, int first, int last, bool with_sum, bool with_extremes,
+        AggregateTotals& totals);
+
+    // Строки first..last (включительно) столбца col.
+    void AggregateColumn(ASTImpl::Function function, int col, int first, int last,
+        const SheetInterface& sheet, AggregateTotals& totals) const;
+
+    // Вычисляет формулы строк first..last столбца col.
+    void EvaluatePending(int col, int first, int last, const SheetInterface& sheet) const;
+
+    // Итоги массивов с first_chunk по last_chunk включительно.
+    AggregateTotals QueryIndex(const Column& column, int first_chunk, int last_chunk) const;
+
+private:
+    std::vector<std::unique_ptr<Column>> columns_;
+    size_t tracked_count_ = 0;
+};
+
+template <typename Track>
+void ColumnValues::AddDependent(const Range& range, const Cell* cell, Track track) {
+    if (range.last.col >= static_cast<int>(columns_.size())) {
+        columns_.resize(range.last.col + 1);
+    }
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        if (!columns_[col]) {
+            columns_[col] = std::make_unique<Column>();
+            ++tracked_count_;
+            track(col);
+        }
+        columns_[col]->dependents.push_back({ range.first.row, range.last.row, cell });
+    }
+}
+
+template <typename Func>
+void ColumnValues::ForEachDependent(Position pos, Func func) const {
+    if (!IsTracked(pos.col)) {
+        return;
+    }
+    for (const Dependent& dependent : columns_[pos.col]->dependents) {
+        if (pos.row >= dependent.first_row && pos.row <= dependent.last_row) {
+            func(dependent.cell);
+        }
+    }
+}
+
+template <typename Func>
+void ColumnValues::ForEachPending(const Range& range, Func func) const {
+    const int first = range.first.row;
+    const int last = range.last.row;
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        if (!IsTracked(col)) {
+            continue;
+        }
+        const Column& column = *columns_[col];
+        // маски копируются: func может вычислить формулу и снять её отметку
+        const uint64_t chunks = column.pending_chunks & storage_detail::BitRange(first >> CHUNK_BITS, last >> CHUNK_BITS);
+        for (uint64_t chunk_mask = chunks; chunk_mask != 0; chunk_mask &= chunk_mask - 1) {
+            const int chunk_index = storage_detail::CountTrailingZeros(chunk_mask);
+            const Chunk* chunk = column.chunks[chunk_index].get();
+            const int base = chunk_index << CHUNK_BITS;
+            const int chunk_first = std::max(first, base) - base;
+            const int chunk_last = std::min(last, base + CHUNK_ROWS - 1) - base;
+            for (int word = chunk_first / WORD_BITS; word <= chunk_last / WORD_BITS; ++word) {
+                const uint64_t window = storage_detail::BitRange(std::max(chunk_first, word * WORD_BITS) - word * WORD_BITS,
+                    std::min(chunk_last, word * WORD_BITS + WORD_BITS - 1) - word * WORD_BITS);
+                for (uint64_t pending = chunk->pending[word] & window; pending != 0; pending &= pending - 1) {
+                    func(Position{ base + word * WORD_BITS + storage_detail::CountTrailingZeros(pending), col });
+                }
+            }
+        }
+    }
+}
+
+// Добавляет к totals значения ячеек range листа sheet, читая каждую ячейку.
+void AggregateCells(ASTImpl::Function function, const Range& range, const SheetInterface& sheet,
+    AggregateTotals& totals);
@@ -0,0 +1,185 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+
+DependencyGraph::DependencyGraph() {
+    std::fill(std::begin(free_blocks_), std::end(free_blocks_), NO_BLOCK);
+}
+
+DependencyGraph::NodeId DependencyGraph::AddNode(const Cell* cell) {
+    NodeId node;
+    if (free_nodes_.empty()) {
+        node = static_cast<NodeId>(nodes_.size());
+        assert(node != NO_NODE);
+        nodes_.emplace_back();
+    }
+    else {
+        node = free_nodes_.back();
+        free_nodes_.pop_back();
+    }
+    nodes_[node].cell = cell;
+    if (next_order_ == UINT32_MAX) {
+        RenumberOrder();
+    }
+    nodes_[node].order = next_order_++;
+    return node;
+}
+
+void DependencyGraph::RemoveNode(NodeId node) {
+    Node& data = nodes_[node];
+    assert(data.precedents_size == 0 && data.dependents_size == 0);
+    data = Node{};
+    free_nodes_.push_back(node);
+}
+
+void DependencyGraph::ClearPrecedents(NodeId node) {
+    Node& data = nodes_[node];
+    for (uint32_t i = 0; i < data.precedents_size; ++i) {
+        const Edge& edge = precedents_[data.precedents_begin + i];
+        RemoveDependent(edge.node, edge.other_index);
+    }
+    if (data.precedents_begin + data.precedents_size == precedents_.size()) {
+        precedents_.resize(data.precedents_begin);
+    }
+    else {
+        free_precedents_ += data.precedents_size;
+    }
+    edge_count_ -= data.precedents_size;
+    data.precedents_begin = 0;
+    data.precedents_size = 0;
+}
+
+void DependencyGraph::StartVisit() {
+    if (++visit_epoch_ == 0) {
+        for (Node& data : nodes_) {
+            data.visit_mark = 0;
+        }
+        visit_epoch_ = 1;
+    }
+}
+
+size_t DependencyGraph::GetMemoryUsage() const {
+    return nodes_.capacity() * sizeof(Node)
+        + free_nodes_.capacity() * sizeof(NodeId)
+        + (precedents_.capacity() + dependents_.capacity()) * sizeof(Edge);
+}
+
+uint32_t DependencyGraph::AddDependent(NodeId node, NodeId dependent, uint32_t precedent_index) {
+    Node& data = nodes_[node];
+    if (data.dependents_order == NO_ORDER) {
+        MoveDependents(data, 0);
+    }
+    else if (data.dependents_size == uint32_t{ 1 } << data.dependents_order) {
+        MoveDependents(data, data.dependents_order + 1);
+    }
+    const uint32_t index = data.dependents_size++;
+    dependents_[data.dependents_begin + index] = { dependent, precedent_index };
+    return index;
+}
+
+void DependencyGraph::RemoveDependent(NodeId node, uint32_t index) {
+    Node& data = nodes_[node];
+    const uint32_t last = data.dependents_size - 1;
+    if (index != last) {
+        // последняя связь занимает место снятой, и её формула узнаёт об этом
+        const Edge moved = dependents_[data.dependents_begin + last];
+        dependents_[data.dependents_begin + index] = moved;
+        precedents_[nodes_[moved.node].precedents_begin + moved.other_index].other_index = index;
+    }
+    data.dependents_size = last;
+    // список, заполненный меньше чем на четверть, переезжает в блок вдвое меньше
+    if (data.dependents_size == 0) {
+        MoveDependents(data, NO_ORDER);
+    }
+    else if (data.dependents_size * 4 <= uint32_t{ 1 } << data.dependents_order) {
+        MoveDependents(data, data.dependents_order - 1);
+    }
+}
+
+void DependencyGraph::MoveDependents(Node& data, uint8_t order) {
+    uint32_t begin = 0;
+    if (order != NO_ORDER) {
+        assert(order < ORDER_COUNT);
+        uint32_t& free_block = free_blocks_[order];
+        if (free_block != NO_BLOCK) {
+            begin = free_block;
+            free_block = dependents_[begin].node;
+        }
+        else {
+            begin = static_cast<uint32_t>(dependents_.size());
+            dependents_.resize(begin + (uint32_t{ 1 } << order));
+        }
+        std::copy_n(dependents_.begin() + data.dependents_begin, data.dependents_size, dependents_.begin() + begin);
+    }
+    if (data.dependents_order != NO_ORDER) {
+        dependents_[data.dependents_begin].node = free_blocks_[data.dependents_order];
+        free_blocks_[data.dependents_order] = data.dependents_begin;
+    }
+    data.dependents_begin = begin;
+    data.dependents_order = order;
+}
+
+uint32_t DependencyGraph::AllocatePrecedents(uint32_t size) {
+    if (free_precedents_ * 2 > precedents_.size()) {
+        CompactPrecedents();
+    }
+    const uint32_t begin = static_cast<uint32_t>(precedents_.size());
+    precedents_.resize(begin + size);
+    return begin;
+}
+
+// Места связей внутри списков не меняются, поэтому ссылки между
+// направлениями остаются верными.
+void DependencyGraph::CompactPrecedents() {
+    std::vector<Edge> precedents;
+    precedents.reserve(precedents_.size() - free_precedents_);
+    for (Node& data : nodes_) {
+        const uint32_t begin = static_cast<uint32_t>(precedents.size());
+        precedents.insert(precedents.end(), precedents_.begin() + data.precedents_begin,
+            precedents_.begin() + data.precedents_begin + data.precedents_size);
+        data.precedents_begin = begin;
+    }
+    precedents_.swap(precedents);
+    free_precedents_ = 0;
+}
+
+void DependencyGraph::Reorder() {
+    orders_.clear();
+    auto by_order = [this](NodeId lhs, NodeId rhs) {
+        return nodes_[lhs].order < nodes_[rhs].order;
+    };
+    for (const std::vector<NodeId>* nodes : { &backward_, &forward_ }) {
+        for (NodeId node : *nodes) {
+            orders_.push_back(nodes_[node].order);
+        }
+    }
+    std::sort(orders_.begin(), orders_.end());
+    std::sort(backward_.begin(), backward_.end(), by_order);
+    std::sort(forward_.begin(), forward_.end(), by_order);
+    auto order = orders_.begin();
+    for (const std::vector<NodeId>* nodes : { &backward_, &forward_ }) {
+        for (NodeId node : *nodes) {
+            nodes_[node].order = *order++;
+        }
+    }
+}
+
+void DependencyGraph::RenumberOrder() {
+    std::vector<bool> is_free(nodes_.size());
+    for (NodeId node : free_nodes_) {
+        is_free[node] = true;
+    }
+    std::vector<NodeId> live;
+    for (NodeId node = 0; node < nodes_.size(); ++node) {
+        if (!is_free[node]) {
+            live.push_back(node);
+        }
+    }
+    std::sort(live.begin(), live.end(), [this](NodeId lhs, NodeId rhs) {
+        return nodes_[lhs].order < nodes_[rhs].order;
+    });
+    next_order_ = 0;
+    for (NodeId node : live) {
+        nodes_[node].order = next_order_++;
+    }
+}
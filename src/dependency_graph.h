@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class Cell;
+
+// Связи между ячейками листа: формула ссылается на ячейки (предшественники),
+// на ячейку ссылаются формулы (зависимые). Ячейки получают плотные номера
+// узлов, а списки связей обоих направлений лежат в двух общих массивах,
+// поэтому обход не прыгает по корзинам хэш-таблиц, а связь занимает 8 байт
+// в каждом направлении.
+// Список предшественников задаётся целиком, когда формула связывается, и
+// лежит подряд с другими такими списками; освободившиеся места собираются,
+// когда их становится больше, чем занятых. Список зависимых растёт по одной
+// связи и занимает блок из степени двойки связей. Заполненный список
+// переносится в блок вдвое больше, а освободившийся блок достаётся
+// следующему списку того же размера. Каждая связь помнит своё место в
+// списке другого направления, поэтому снимается за O(1) даже у ячейки, на
+// которую ссылаются сотни тысяч формул.
+// Граф поддерживает топологический порядок узлов (алгоритм Пирса - Келли):
+// ячейка идёт раньше формул, которые от неё зависят. Новая связь, которая
+// порядок не нарушает, ничего не стоит; иначе переставляются только узлы
+// между её концами, которые с ней связаны.
+class DependencyGraph {
+public:
+    using NodeId = uint32_t;
+
+    static constexpr NodeId NO_NODE = UINT32_MAX;
+
+    DependencyGraph();
+
+    // Новый узел без связей для ячейки cell.
+    NodeId AddNode(const Cell* cell);
+
+    // Узел не должен иметь связей. Его номер может достаться новому узлу.
+    void RemoveNode(NodeId node);
+
+    const Cell* GetCell(NodeId node) const {
+        return nodes_[node].cell;
+    }
+
+    // Связывает формулу node с ячейками [first, last) в порядке ссылок.
+    // Ячейки не повторяются. Прежних предшественников у узла быть не должно.
+    template <typename It>
+    void SetPrecedents(NodeId node, It first, It last);
+
+    // Снимает все связи формулы node с ячейками, на которые она ссылается.
+    void ClearPrecedents(NodeId node);
+
+    size_t GetPrecedentCount(NodeId node) const {
+        return nodes_[node].precedents_size;
+    }
+    size_t GetDependentCount(NodeId node) const {
+        return nodes_[node].dependents_size;
+    }
+
+    // Ячейка, на которую формула node ссылается index-й по порядку.
+    NodeId GetPrecedent(NodeId node, size_t index) const {
+        return precedents_[nodes_[node].precedents_begin + index].node;
+    }
+
+    // func(NodeId) для каждой ячейки, на которую ссылается формула node, в
+    // порядке ссылок.
+    template <typename Func>
+    void ForEachPrecedent(NodeId node, Func func) const;
+
+    // func(NodeId) для каждой формулы, которая ссылается на node.
+    template <typename Func>
+    void ForEachDependent(NodeId node, Func func) const;
+
+    // Начинает новый обход: все узлы становятся непосещёнными. Обходы не
+    // вкладываются друг в друга.
+    void StartVisit();
+
+    // Отмечает узел посещённым. Возвращает false, если он уже был отмечен в
+    // текущем обходе.
+    bool Visit(NodeId node) {
+        if (nodes_[node].visit_mark == visit_epoch_) {
+            return false;
+        }
+        nodes_[node].visit_mark = visit_epoch_;
+        return true;
+    }
+
+    // Место узла в топологическом порядке. Новый узел становится последним.
+    uint32_t GetOrder(NodeId node) const {
+        return nodes_[node].order;
+    }
+
+    // Переставляет узлы так, чтобы каждый из sources шёл раньше node, как
+    // если бы от них к node вели связи. Возвращает false, не меняя порядок,
+    // если node достижим из какого-либо source: связь создала бы цикл.
+    // Кроме связей графа учитываются и те, что перечисляют
+    // for_each_successor(NodeId node, func) и for_each_predecessor(NodeId
+    // node, func): они вызывают func(NodeId) для каждого узла, который
+    // зависит от node, и каждого, от которого зависит node. Использует
+    // отметки посещённых узлов.
+    template <typename ForEachSuccessor, typename ForEachPredecessor>
+    bool OrderBefore(const std::vector<NodeId>& sources, NodeId node,
+        ForEachSuccessor for_each_successor, ForEachPredecessor for_each_predecessor);
+
+    // Нумерует все узлы заново в топологическом порядке: узел идёт после
+    // тех, которые перечисляет for_each_predecessor(NodeId node, func) - она
+    // вызывает func(NodeId) для каждого узла, от которого зависит node,
+    // включая связи графа. Так порядок строится разом для связей, заданных
+    // через SetPrecedents() без OrderBefore(). Возвращает false, не меняя
+    // порядок, если связи образуют цикл.
+    template <typename ForEachPredecessor>
+    bool RebuildOrder(ForEachPredecessor for_each_predecessor);
+
+    size_t GetNodeCount() const {
+        return nodes_.size() - free_nodes_.size();
+    }
+    // Номера всех узлов меньше этого числа.
+    size_t GetNodeLimit() const {
+        return nodes_.size();
+    }
+    size_t GetEdgeCount() const {
+        return edge_count_;
+    }
+
+    // Байты, занятые узлами и массивами связей.
+    size_t GetMemoryUsage() const;
+
+private:
+    // Связь в списке предшественников: ячейка node и место этой связи в её
+    // списке зависимых. В списке зависимых: формула node и место связи в её
+    // списке предшественников.
+    struct Edge {
+        NodeId node;
+        uint32_t other_index;
+    };
+
+    // Блок списка зависимых порядка k вмещает 2^k связей.
+    static constexpr uint8_t NO_ORDER = UINT8_MAX;
+    static constexpr int ORDER_COUNT = 32;
+    static constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+    struct Node {
+        const Cell* cell = nullptr;
+        uint32_t precedents_begin = 0;
+        uint32_t precedents_size = 0;
+        uint32_t dependents_begin = 0;
+        uint32_t dependents_size = 0;
+        uint8_t dependents_order = NO_ORDER;
+        uint32_t visit_mark = 0;
+        uint32_t order = 0;
+    };
+
+    // Добавляет формулу dependent в конец списка зависимых node и
+    // возвращает место связи в нём.
+    uint32_t AddDependent(NodeId node, NodeId dependent, uint32_t precedent_index);
+
+    void RemoveDependent(NodeId node, uint32_t index);
+
+    // Переносит список зависимых в блок порядка order, NO_ORDER - освобождает
+    // блок пустого списка.
+    void MoveDependents(Node& data, uint8_t order);
+
+    uint32_t AllocatePrecedents(uint32_t size);
+
+    // Раздаёт узлам backward_ и forward_ их же места в порядке так, что все
+    // узлы backward_ идут раньше узлов forward_, а внутри каждого набора
+    // порядок сохраняется.
+    void Reorder();
+
+    // Нумерует узлы подряд, сохраняя порядок, когда номера кончаются.
+    void RenumberOrder();
+
+    // Переписывает списки предшественников подряд, без освободившихся мест.
+    void CompactPrecedents();
+
+private:
+    std::vector<Node> nodes_;
+    std::vector<NodeId> free_nodes_;
+    std::vector<Edge> precedents_;
+    std::vector<Edge> dependents_;
+    // освободившиеся места в массиве предшественников
+    size_t free_precedents_ = 0;
+    // Свободные блоки зависимых каждого порядка. Первая связь блока хранит
+    // начало следующего свободного блока того же порядка.
+    uint32_t free_blocks_[ORDER_COUNT];
+    size_t edge_count_ = 0;
+    uint32_t visit_epoch_ = 0;
+    uint32_t next_order_ = 0;
+    // рабочие массивы OrderBefore()
+    std::vector<NodeId> stack_;
+    std::vector<NodeId> forward_;
+    std::vector<NodeId> backward_;
+    std::vector<uint32_t> orders_;
+};
+
+template <typename It>
+void DependencyGraph::SetPrecedents(NodeId node, It first, It last) {
+    assert(nodes_[node].precedents_size == 0);
+    const uint32_t size = static_cast<uint32_t>(last - first);
+    if (size == 0) {
+        return;
+    }
+    const uint32_t begin = AllocatePrecedents(size);
+    nodes_[node].precedents_begin = begin;
+    nodes_[node].precedents_size = size;
+    for (uint32_t i = 0; i < size; ++i, ++first) {
+        const NodeId precedent = *first;
+        const uint32_t index = AddDependent(precedent, node, i);
+        precedents_[begin + i] = { precedent, index };
+    }
+    edge_count_ += size;
+}
+
+template <typename ForEachSuccessor, typename ForEachPredecessor>
+bool DependencyGraph::OrderBefore(const std::vector<NodeId>& sources, NodeId node,
+    ForEachSuccessor for_each_successor, ForEachPredecessor for_each_predecessor) {
+    const uint32_t lower = nodes_[node].order;
+    uint32_t upper = lower;
+    for (NodeId source : sources) {
+        if (source == node) {
+            return false;
+        }
+        upper = std::max(upper, nodes_[source].order);
+    }
+    if (upper == lower) {
+        // порядок уже верный
+        return true;
+    }
+
+    // узлы между node и последним из sources, которые зависят от node
+    StartVisit();
+    forward_.clear();
+    Visit(node);
+    stack_.assign(1, node);
+    while (!stack_.empty()) {
+        const NodeId current = stack_.back();
+        stack_.pop_back();
+        forward_.push_back(current);
+        for_each_successor(current, [this, upper](NodeId next) {
+            if (nodes_[next].order <= upper && Visit(next)) {
+                stack_.push_back(next);
+            }
+        });
+    }
+    for (NodeId source : sources) {
+        if (nodes_[source].visit_mark == visit_epoch_) {
+            return false;
+        }
+    }
+
+    // узлы после node, от которых зависят sources
+    StartVisit();
+    backward_.clear();
+    for (NodeId source : sources) {
+        if (nodes_[source].order > lower && Visit(source)) {
+            stack_.push_back(source);
+        }
+    }
+    while (!stack_.empty()) {
+        const NodeId current = stack_.back();
+        stack_.pop_back();
+        backward_.push_back(current);
+        for_each_predecessor(current, [this, lower](NodeId previous) {
+            if (nodes_[previous].order > lower && Visit(previous)) {
+                stack_.push_back(previous);
+            }
+        });
+    }
+
+    Reorder();
+    return true;
+}
+
+template <typename ForEachPredecessor>
+bool DependencyGraph::RebuildOrder(ForEachPredecessor for_each_predecessor) {
+    enum class State : uint8_t {
+        New,
+        // узел на пути обхода: его предшественники ещё обходятся
+        OnPath,
+        Done,
+    };
+    std::vector<State> states(nodes_.size(), State::New);
+    orders_.assign(nodes_.size(), 0);
+    uint32_t next_order = 0;
+    // Обход в глубину по предшественникам. Узел лежит в стеке второй раз
+    // (с отметкой), пока обходятся его предшественники, и получает номер,
+    // когда отметка снимается.
+    std::vector<std::pair<NodeId, bool>> stack;
+    for (NodeId root = 0; root < nodes_.size(); ++root) {
+        if (!nodes_[root].cell || states[root] != State::New) {
+            continue;
+        }
+        stack.push_back({ root, false });
+        while (!stack.empty()) {
+            const auto [node, is_finished] = stack.back();
+            stack.pop_back();
+            if (is_finished) {
+                states[node] = State::Done;
+                orders_[node] = next_order++;
+                continue;
+            }
+            if (states[node] != State::New) {
+                continue;
+            }
+            states[node] = State::OnPath;
+            stack.push_back({ node, true });
+            bool has_cycle = false;
+            for_each_predecessor(node, [&](NodeId previous) {
+                if (states[previous] == State::OnPath) {
+                    has_cycle = true;
+                }
+                else if (states[previous] == State::New) {
+                    stack.push_back({ previous, false });
+                }
+            });
+            if (has_cycle) {
+                return false;
+            }
+        }
+    }
+    for (NodeId node = 0; node < nodes_.size(); ++node) {
+        nodes_[node].order = orders_[node];
+    }
+    next_order_ = next_order;
+    return true;
+}
+
+template <typename Func>
+void DependencyGraph::ForEachPrecedent(NodeId node, Func func) const {
+    const Node& data = nodes_[node];
+    for (uint32_t i = 0; i < data.precedents_size; ++i) {
+        func(precedents_[data.precedents_begin + i].node);
+    }
+}
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(NodeId node, Func func) const {
+    const Node& data = nodes_[node];
+    for (uint32_t i = 0; i < data.dependents_size; ++i) {
+        func(dependents_[data.dependents_begin + i].node);
+    }
+}
@@ -0,0 +1,121 @@
+#include "export_buffer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <system_error>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Столько символов хватит на любое число в формате %.6g.
+constexpr std::ptrdiff_t MAX_NUMBER_SIZE = 32;
+
+}  // namespace
+
+ExportBuffer::ExportBuffer(char* data, size_t size, Sink sink)
+    : sink_(std::move(sink))
+    , stream_(this) {
+    assert(size >= MIN_SIZE);
+    // pbump() сдвигает на int
+    setp(data, data + std::min<size_t>(size, INT_MAX));
+    stream_.exceptions(std::ios_base::badbit);
+}
+
+void ExportBuffer::Write(char c, size_t count) {
+    while (count > 0) {
+        if (pptr() == epptr()) {
+            Drain();
+        }
+        const size_t size = std::min(count, static_cast<size_t>(epptr() - pptr()));
+        std::memset(pptr(), c, size);
+        pbump(static_cast<int>(size));
+        count -= size;
+    }
+}
+
+void ExportBuffer::Write(std::string_view text) {
+    if (text.size() <= static_cast<size_t>(epptr() - pptr())) {
+        std::memcpy(pptr(), text.data(), text.size());
+        pbump(static_cast<int>(text.size()));
+        return;
+    }
+    // текст длиннее буфера отдаётся приёмнику без копирования
+    Drain();
+    if (text.size() >= static_cast<size_t>(epptr() - pbase())) {
+        sink_(text);
+        return;
+    }
+    std::memcpy(pptr(), text.data(), text.size());
+    pbump(static_cast<int>(text.size()));
+}
+
+void ExportBuffer::Write(double value) {
+    if (epptr() - pptr() < MAX_NUMBER_SIZE) {
+        Drain();
+    }
+    // формат general с точностью 6 - это %.6g, как у std::ostream
+    const auto result = std::to_chars(pptr(), epptr(), value, std::chars_format::general, 6);
+    assert(result.ec == std::errc());
+    pbump(static_cast<int>(result.ptr - pptr()));
+}
+
+ExportBuffer::int_type ExportBuffer::overflow(int_type c) {
+    Drain();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        Write(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize ExportBuffer::xsputn(const char* text, std::streamsize count) {
+    Write(std::string_view(text, static_cast<size_t>(count)));
+    return count;
+}
+
+int ExportBuffer::sync() {
+    Drain();
+    return 0;
+}
+
+void ExportBuffer::Drain() {
+    if (pptr() != pbase()) {
+        sink_(std::string_view(pbase(), static_cast<size_t>(pptr() - pbase())));
+        setp(pbase(), epptr());
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+ExportBuffer::Sink MakeStringSink(std::string& output) {
+    return [&output](std::string_view text) {
+        output += text;
+    };
+}
+
+ExportBuffer::Sink MakeFileSink(int fd) {
+    return [fd](std::string_view text) {
+        while (!text.empty()) {
+#ifdef _WIN32
+            const auto written = _write(fd, text.data(), static_cast<unsigned>(std::min<size_t>(text.size(), INT_MAX)));
+#else
+            const auto written = write(fd, text.data(), text.size());
+#endif
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "Export write failed");
+            }
+            text.remove_prefix(static_cast<size_t>(written));
+        }
+    };
+}
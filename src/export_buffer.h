@@ -0,0 +1,82 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+// Буфер, через который лист печатает себя быстрее, чем через std::ostream.
+// Текст копится в памяти, которую даёт пользователь, и отдаётся приёмнику
+// целыми заполненными буферами, а остаток - в Flush(). Числа печатаются
+// через std::to_chars, но так же, как их печатает std::ostream с
+// настройками по умолчанию. Буфер - это и std::streambuf: то, что умеет
+// печатать только в поток (например выражение формулы), пишется через
+// GetStream() сразу в буфер, без промежуточной строки.
+class ExportBuffer : public std::streambuf {
+public:
+    // Приёмник получает текст кусками по порядку.
+    using Sink = std::function<void(std::string_view)>;
+
+    // Наименьший размер буфера: в него помещается любое число.
+    static constexpr size_t MIN_SIZE = 64;
+
+    // Буфер в памяти data размера size, которая должна его пережить.
+    ExportBuffer(char* data, size_t size, Sink sink);
+
+    ExportBuffer(const ExportBuffer&) = delete;
+    ExportBuffer& operator=(const ExportBuffer&) = delete;
+
+    void Write(char c) {
+        if (pptr() == epptr()) {
+            Drain();
+        }
+        *pptr() = c;
+        pbump(1);
+    }
+
+    // count символов c подряд.
+    void Write(char c, size_t count);
+
+    void Write(std::string_view text);
+
+    // Не больше 6 значащих цифр, как у std::ostream по умолчанию.
+    void Write(double value);
+
+    void Write(FormulaError error) {
+        Write(error.ToString());
+    }
+
+    // Поток, который пишет в этот буфер. Ошибку приёмника он пробрасывает.
+    std::ostream& GetStream() {
+        return stream_;
+    }
+
+    // Отдаёт приёмнику накопленный текст.
+    void Flush() {
+        Drain();
+    }
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* text, std::streamsize count) override;
+    int sync() override;
+
+private:
+    // Отдаёт приёмнику заполненную часть буфера и начинает буфер заново.
+    void Drain();
+
+private:
+    Sink sink_;
+    std::ostream stream_;
+};
+
+// Приёмник, который дописывает текст в конец output.
+ExportBuffer::Sink MakeStringSink(std::string& output);
+
+// Приёмник, который пишет текст в файловый дескриптор fd. Ошибку записи
+// бросает как std::system_error.
+ExportBuffer::Sink MakeFileSink(int fd);
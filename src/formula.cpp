@@ -1,11 +1,13 @@
 #include "formula.h"
 
 #include "cell.h"
+#include "column_values.h"
 #include "FormulaAST.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <iterator>
 #include <sstream>
 #include <stdexcept>
 
@@ -21,69 +23,118 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 
 namespace {
 
-struct FormulaValueGetter {
-    double operator() (const std::string& value) {
-        try {
-            return std::stod(value);
-        }
-        catch (...) {
-            throw FormulaError(FormulaError::Category::Value);
+// ,    ,   FormulaAST::GetCells().
+//      ,   , 
+//  ;    ,    .
+//      :    
+//         .  
+// CAPACITY     .
+class BoundCells {
+public:
+    static constexpr size_t CAPACITY = 4;
+
+    void Bind(const FormulaAST& ast, Position shift, const SheetInterface& sheet) {
+        size_t slot = 0;
+        for (auto it = ast.GetCells().begin(); it != ast.GetCells().end() && slot < CAPACITY; ++it) {
+            cells_[slot++] = static_cast<const Cell*>(sheet.GetCell({ it->row + shift.row, it->col + shift.col }));
         }
     }
 
-    double operator() (double value) {
-        return value;
+    void Unbind() {
+        std::fill(std::begin(cells_), std::end(cells_), nullptr);
     }
 
-    double operator() (const FormulaError& value) {
-        throw value;
+    // nullptr,    
+    const Cell* Get(size_t slot) const {
+        return slot < CAPACITY ? cells_[slot] : nullptr;
     }
+
+private:
+    const Cell* cells_[CAPACITY] = {};
 };
 
+Range ShiftRange(const Range& range, Position shift) {
+    return { { range.first.row + shift.row, range.first.col + shift.col },
+             { range.last.row + shift.row, range.last.col + shift.col } };
+}
+
+//  ,     shift.  
+//  ,      .  
+//  columns,    -   .
+FormulaInterface::Value EvaluateAST(const FormulaAST& ast, const SheetInterface& sheet, Position shift, const BoundCells& cells,
+    const ColumnValues* columns) {
+    const auto get_cell_value = [&sheet, shift, &cells](const Position& pos, size_t slot) {
+        const Cell* cell = cells.Get(slot);
+        if (!cell) {
+            cell = static_cast<const Cell*>(sheet.GetCell({ pos.row + shift.row, pos.col + shift.col }));
+        }
+        return cell->GetEvaluationValue();
+    };
+    const auto aggregate_range = [&sheet, shift, columns](ASTImpl::Function function, const Range& range, AggregateTotals& totals) {
+        if (columns) {
+            columns->Aggregate(function, ShiftRange(range, shift), sheet, totals);
+        }
+        else {
+            AggregateCells(function, ShiftRange(range, shift), sheet, totals);
+        }
+    };
+    const double value = ast.Execute(get_cell_value, aggregate_range);
+    if (auto category = GetErrorCategory(value)) {
+        return FormulaError(*category);
+    }
+    return value;
+}
+
 class Formula : public FormulaInterface {
 public:
 //   :
-    explicit Formula(std::string expression)
-        : ast_(FormulaCreator(std::move(expression)))
-        , referenced_cells_(ast_.GetCells().begin(), ast_.GetCells().end()) {
+    Formula(std::string_view expression, std::pmr::memory_resource* resource)
+        : ast_(ParseFormulaAST(expression, resource))
+        , referenced_cells_(ast_.GetCells().begin(), ast_.GetCells().end(), resource) {
     }
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        try {
-            return ast_.Execute(
-                [&sheet](const Position& pos) {
-                    const auto* cell = dynamic_cast<const Cell*>(sheet.GetCell(pos));
-                    return std::visit(FormulaValueGetter{}, cell->GetRawValue());
-                }
-            );
-        }
-        catch (FormulaError& e) {
-            return std::move(e);
-        }
-        catch (...) {
-            throw;
-        }
+        return EvaluateAST(ast_, sheet, Position{ 0, 0 }, cells_, nullptr);
+    }
+
+    Value Evaluate(const SheetInterface& sheet, const ColumnValues& columns) const override {
+        return EvaluateAST(ast_, sheet, Position{ 0, 0 }, cells_, &columns);
+    }
+
+    void BindReferencedCells(const SheetInterface& sheet) override {
+        cells_.Bind(ast_, Position{ 0, 0 }, sheet);
+    }
+
+    void UnbindReferencedCells() override {
+        cells_.Unbind();
     }
 
     std::string GetExpression() const override {
         std::ostringstream out;
-        ast_.PrintFormula(out);
+        PrintExpression(out);
         return out.str();
     }
 
+    void PrintExpression(std::ostream& output) const override {
+        ast_.PrintFormula(output);
+    }
+
     std::vector<Position> GetReferencedCells() const override {
-        return referenced_cells_;
+        return { referenced_cells_.begin(), referenced_cells_.end() };
     }
 
-private:
-    FormulaAST FormulaCreator(std::string expression) {
-        std::istringstream in(std::move(expression));
-        return ParseFormulaAST(in);
+    std::vector<Range> GetReferencedRanges() const override {
+        return { ast_.GetRanges().begin(), ast_.GetRanges().end() };
+    }
+
+    bool HasReferencedRanges() const override {
+        return !ast_.GetRanges().empty();
     }
 
 private:
     FormulaAST ast_;
-    std::vector<Position> referenced_cells_;
+    std::pmr::vector<Position> referenced_cells_;
+    BoundCells cells_;
 };
 
 class FormulaRefError : public FormulaInterface {
@@ -101,13 +152,141 @@ public:
     }
 };
 
+//     FormulaTable   pos.
+class SharedFormula : public FormulaInterface {
+public:
+    SharedFormula(FormulaTable& table, FormulaTable::Entry& entry, Position pos);
+
+    ~SharedFormula() override {
+        table_.Release(&entry_);
+    }
+
+    Value Evaluate(const SheetInterface& sheet) const override;
+
+    Value Evaluate(const SheetInterface& sheet, const ColumnValues& columns) const override;
+
+    std::string GetExpression() const override;
+
+    void PrintExpression(std::ostream& output) const override;
+
+    std::vector<Position> GetReferencedCells() const override;
+
+    std::vector<Range> GetReferencedRanges() const override;
+
+    bool HasReferencedRanges() const override {
+        return !entry_.ast.GetRanges().empty();
+    }
+
+    void BindReferencedCells(const SheetInterface& sheet) override {
+        cells_.Bind(entry_.ast, shift_, sheet);
+    }
+
+    void UnbindReferencedCells() override {
+        cells_.Unbind();
+    }
+
+private:
+    FormulaTable& table_;
+    FormulaTable::Entry& entry_;
+    //     ,    
+    Position shift_;
+    BoundCells cells_;
+};
+
+}  // namespace
+
+// -----------------------------------------------------------------------------
+
+FormulaTable::FormulaTable(std::pmr::memory_resource* resource)
+    : resource_(resource)
+    , entries_(resource) {
+}
+
+FormulaTable::~FormulaTable() {
+    assert(entries_.empty());
+}
+
+FormulaTable::Entry* FormulaTable::Acquire(std::string_view expression, Position pos) {
+    key_.clear();
+    if (!AppendRelativeFormulaKey(expression, pos, key_)) {
+        return nullptr;
+    }
+    return Acquire(expression, pos, key_);
+}
+
+FormulaTable::Entry* FormulaTable::Acquire(std::string_view expression, Position pos, const std::string& key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        it = entries_.try_emplace(key, ParseFormulaAST(expression, resource_), pos).first;
+        it->second.key = &it->first;
+    }
+    ++it->second.uses;
+    return &it->second;
+}
+
+void FormulaTable::Release(Entry* entry) {
+    assert(entry->uses > 0);
+    if (--entry->uses == 0) {
+        entries_.erase(entries_.find(*entry->key));
+    }
+    if (entries_.empty()) {
+        //       
+        decltype(entries_)(resource_).swap(entries_);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+namespace {
+
+SharedFormula::SharedFormula(FormulaTable& table, FormulaTable::Entry& entry, Position pos)
+    : table_(table)
+    , entry_(entry)
+    , shift_{ pos.row - entry.origin.row, pos.col - entry.origin.col } {
+}
+
+FormulaInterface::Value SharedFormula::Evaluate(const SheetInterface& sheet) const {
+    return EvaluateAST(entry_.ast, sheet, shift_, cells_, nullptr);
+}
+
+FormulaInterface::Value SharedFormula::Evaluate(const SheetInterface& sheet, const ColumnValues& columns) const {
+    return EvaluateAST(entry_.ast, sheet, shift_, cells_, &columns);
+}
+
+std::string SharedFormula::GetExpression() const {
+    std::ostringstream out;
+    PrintExpression(out);
+    return out.str();
+}
+
+void SharedFormula::PrintExpression(std::ostream& output) const {
+    entry_.ast.PrintFormula(output, shift_);
+}
+
+std::vector<Position> SharedFormula::GetReferencedCells() const {
+    //    
+    std::vector<Position> cells;
+    for (const Position& cell : entry_.ast.GetCells()) {
+        cells.push_back({ cell.row + shift_.row, cell.col + shift_.col });
+    }
+    return cells;
+}
+
+std::vector<Range> SharedFormula::GetReferencedRanges() const {
+    std::vector<Range> ranges;
+    for (const Range& range : entry_.ast.GetRanges()) {
+        ranges.push_back(ShiftRange(range, shift_));
+    }
+    return ranges;
+}
+
 }  // namespace
 
 // -----------------------------------------------------------------------------
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     try {
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_unique<Formula>(expression, std::pmr::get_default_resource());
     }
     catch (const FormulaError& e) {
         return std::make_unique<FormulaRefError>();
@@ -116,3 +295,50 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
         throw FormulaException(e.what());
     }
 }
+
+ArenaPtr<FormulaInterface> ParseFormula(std::string expression, std::pmr::memory_resource* resource) {
+    try {
+        return MakeArenaPtr<Formula>(resource, expression, resource);
+    }
+    catch (const FormulaError& e) {
+        return MakeArenaPtr<FormulaRefError>(resource);
+    }
+    catch (const std::exception& e) {
+        throw FormulaException(e.what());
+    }
+}
+
+namespace {
+
+//    pos  table. acquire(expression)  
+//     nullptr,     
+//  .
+template <typename Acquire>
+ArenaPtr<FormulaInterface> ParseSharedFormula(std::string expression, Position pos, FormulaTable& table, Acquire acquire) {
+    try {
+        if (FormulaTable::Entry* entry = acquire(expression)) {
+            return MakeArenaPtr<SharedFormula>(table.GetResource(), table, *entry, pos);
+        }
+    }
+    catch (const FormulaError& e) {
+        return MakeArenaPtr<FormulaRefError>(table.GetResource());
+    }
+    catch (const std::exception& e) {
+        throw FormulaException(e.what());
+    }
+    return ParseFormula(std::move(expression), table.GetResource());
+}
+
+}  // namespace
+
+ArenaPtr<FormulaInterface> ParseFormula(std::string expression, Position pos, FormulaTable& table) {
+    return ParseSharedFormula(std::move(expression), pos, table, [&](const std::string& expression) {
+        return table.Acquire(expression, pos);
+    });
+}
+
+ArenaPtr<FormulaInterface> ParseFormula(std::string expression, Position pos, const std::string* key, FormulaTable& table) {
+    return ParseSharedFormula(std::move(expression), pos, table, [&](const std::string& expression) {
+        return key ? table.Acquire(expression, pos, *key) : nullptr;
+    });
+}
@@ -1,18 +1,28 @@
 #pragma once
 
+#include "arena.h"
 #include "common.h"
 #include "FormulaAST.h"
 #include "test_runner_p.h"
 
 #include <memory>
+#include <memory_resource>
+#include <ostream>
+#include <string>
+#include <unordered_map>
 #include <variant>
 
+class ColumnValues;
+
 // -----------------------------------------------------------------------------
 
 // ,      .
 //  :
 // *     , : 1+2*3, 2.5*(2+3.5/7)
 // *     : A1+B2*C3
+// *   SUM, AVERAGE, MIN, MAX, COUNT,  
+//       : SUM(A1:C100,D1*2).    ,
+//      ,   .
 // ,   ,    ,   .  
 // ,    ,      . 
 //          .
@@ -30,14 +40,42 @@ public:
     // .
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    //  ,        columns.
+    virtual Value Evaluate(const SheetInterface& sheet, const ColumnValues& columns) const {
+        return Evaluate(sheet);
+    }
+
     //  ,   .
     //      .
     virtual std::string GetExpression() const = 0;
 
+    //   output  ,   GetExpression().
+    virtual void PrintExpression(std::ostream& output) const {
+        output << GetExpression();
+    }
+
     //   ,     
     // .        
-    // .
+    // .      .
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    //  ,     .
+    virtual std::vector<Range> GetReferencedRanges() const {
+        return {};
+    }
+
+    //  ,  !GetReferencedRanges().empty(),    .
+    virtual bool HasReferencedRanges() const {
+        return false;
+    }
+
+    //   ,    ,  Evaluate()
+    //   ,    .   ,
+    //      .
+    virtual void BindReferencedCells(const SheetInterface& sheet) {
+    }
+    virtual void UnbindReferencedCells() {
+    }
 };
 
 // -----------------------------------------------------------------------------
@@ -45,3 +83,76 @@ public:
 //       .
 //  FormulaException  ,    .
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+//  ,          
+// ,    .
+ArenaPtr<FormulaInterface> ParseFormula(std::string expression, std::pmr::memory_resource* resource);
+
+// -----------------------------------------------------------------------------
+
+//   . ,      
+//     (=B1*C1  D1, =B2*C2  D2  ..),  
+// :           .
+//      .    ,
+//     .    .
+class FormulaTable {
+public:
+    explicit FormulaTable(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    FormulaTable(const FormulaTable&) = delete;
+    FormulaTable& operator=(const FormulaTable&) = delete;
+
+    ~FormulaTable();
+
+    std::pmr::memory_resource* GetResource() const {
+        return resource_;
+    }
+
+    //     .
+    size_t GetSize() const {
+        return entries_.size();
+    }
+
+    //      .
+    struct Entry {
+        Entry(FormulaAST ast, Position origin)
+            : ast(std::move(ast))
+            , origin(origin) {
+        }
+
+        FormulaAST ast;
+        // ,    
+        Position origin;
+        //   
+        const std::string* key = nullptr;
+        size_t uses = 0;
+    };
+
+    //       pos,  
+    //  ,    .  nullptr, 
+    //       (,   
+    //  ).   .
+    Entry* Acquire(std::string_view expression, Position pos);
+
+    //  ,      AppendRelativeFormulaKey(),
+    //    .
+    Entry* Acquire(std::string_view expression, Position pos, const std::string& key);
+
+    //        .
+    void Release(Entry* entry);
+
+private:
+    std::pmr::memory_resource* resource_;
+    std::pmr::unordered_map<std::string, Entry> entries_;
+    //   ,       
+    std::string key_;
+};
+
+//    pos,     
+//   table.      .
+//  FormulaException  ,    .
+ArenaPtr<FormulaInterface> ParseFormula(std::string expression, Position pos, FormulaTable& table);
+
+//  ,        AppendRelativeFormulaKey().
+// key - nullptr,       .
+ArenaPtr<FormulaInterface> ParseFormula(std::string expression, Position pos, const std::string* key, FormulaTable& table);
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <string_view>
 
 #include "sheet.h"
 
@@ -7,8 +8,14 @@ inline Position operator"" _pos(const char* str, std::size_t) {
 }
 
 void Tests();
+void Benchmarks();
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string_view(argv[1]) == "--bench") {
+        Benchmarks();
+        return 0;
+    }
 
-int main() {
     Tests();
 
 // ---------- Usage example ----------------------------------------------------
@@ -3,7 +3,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
-#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <sstream>
 #include <tuple>
@@ -94,16 +94,21 @@ static bool IsValidNumber(It begin, It end) {
 
 template <typename It>
 static Position CreatePosition(It letters_begin, It letters_end, It end) {
-    int row = std::stoi(std::string(letters_end, end)) - 1;
+    // MAX_NUMBER_LENGTH digits fit into int64_t
+    int64_t row = 0;
+    for (It it = letters_end; it != end; ++it) {
+        row = row * 10 + (*it - '0');
+    }
+    if (row > Position::MAX_ROWS) {
+        return Position::NONE;
+    }
 
     int col = 0;
-    int power = (letters_end - letters_begin) - 1;
-    while (power != 0) {
-        col += (GetIndex(*letters_begin++) + 1) * std::pow(PositionCreator::LETTERS, power--);
+    for (It it = letters_begin; it != letters_end; ++it) {
+        col = col * PositionCreator::LETTERS + GetIndex(*it) + 1;
     }
-    col += GetIndex(*letters_begin);
 
-    return { row, col };
+    return { static_cast<int>(row) - 1, col - 1 };
 }
 
 };
@@ -127,3 +132,15 @@ std::string Position::ToString() const {
 Position Position::FromString(std::string_view str) {
     return PositionCreator::Build(str);
 }
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+std::string Range::ToString() const {
+    return first.ToString() + ':' + last.ToString();
+}
@@ -21,3 +21,21 @@ struct Position {
     static const int MAX_COLS = 16384;
     static const Position NONE;
 };
+
+// Прямоугольный диапазон ячеек от first до last включительно.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+
+    // Обе границы валидны, first не правее и не ниже last.
+    bool IsValid() const;
+
+    bool Contains(Position pos) const {
+        return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+    }
+
+    // Запись вида A1:B2.
+    std::string ToString() const;
+};
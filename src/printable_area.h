@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include "position.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+// Поддерживает ограничивающий прямоугольник занятых позиций таблицы.
+// Для каждой строки и столбца хранится число занятых позиций, поэтому
+// добавление позиции стоит O(1). Если удаляется последняя позиция на краю
+// прямоугольника, он сразу сжимается до ближайших занятых строки и столбца:
+// размер только читается, и его можно запрашивать из нескольких потоков.
+class PrintableArea {
+public:
+    void Add(Position pos) {
+        Increment(row_counts_, pos.row);
+        Increment(col_counts_, pos.col);
+        size_.rows = std::max(size_.rows, pos.row + 1);
+        size_.cols = std::max(size_.cols, pos.col + 1);
+    }
+
+    void Remove(Position pos) {
+        assert(static_cast<size_t>(pos.row) < row_counts_.size() && row_counts_[pos.row] > 0);
+        assert(static_cast<size_t>(pos.col) < col_counts_.size() && col_counts_[pos.col] > 0);
+        --row_counts_[pos.row];
+        --col_counts_[pos.col];
+        size_.rows = Shrink(row_counts_, size_.rows);
+        size_.cols = Shrink(col_counts_, size_.cols);
+    }
+
+    Size GetSize() const {
+        return size_;
+    }
+
+private:
+    static void Increment(std::vector<int>& counts, int index) {
+        if (counts.size() <= static_cast<size_t>(index)) {
+            counts.resize(index + 1);
+        }
+        ++counts[index];
+    }
+
+    static int Shrink(const std::vector<int>& counts, int bound) {
+        while (bound > 0 && counts[bound - 1] == 0) {
+            --bound;
+        }
+        return bound;
+    }
+
+private:
+    std::vector<int> row_counts_;
+    std::vector<int> col_counts_;
+    Size size_;
+};
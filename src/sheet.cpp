@@ -1,112 +1,899 @@
 #include "sheet.h"
 
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <locale>
+#include <memory>
 #include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string_view>
 
 using namespace std::literals;
 
-Sheet::Sheet() {
+namespace {
+
+// Меньше устаревших формул быстрее вычислить в одном потоке.
+constexpr size_t MIN_PARALLEL_CELLS = 256;
+
+constexpr uint32_t NO_TASK = UINT32_MAX;
+
+// Печать в std::ostream идёт через буфер такого размера.
+constexpr size_t PRINT_BUFFER_SIZE = 64 << 10;
+
+// При параллельной печати задача печатает блок из стольких строк через свой
+// буфер, а потоки печатают сразу по нескольку блоков.
+constexpr int EXPORT_BLOCK_ROWS = 256;
+constexpr size_t EXPORT_TASK_BUFFER_SIZE = 16 << 10;
+constexpr size_t EXPORT_BLOCKS_PER_THREAD = 4;
+
+// ExportBuffer печатает так же, как output, только если у output
+// настройки форматирования по умолчанию.
+bool HasDefaultFormat(const std::ostream& output) {
+    return output.flags() == (std::ios_base::dec | std::ios_base::skipws) && output.precision() == 6
+        && output.width() == 0 && output.getloc() == std::locale::classic();
+}
+
+ExportBuffer::Sink MakeStreamSink(std::ostream& output) {
+    return [&output](std::string_view text) {
+        output.write(text.data(), static_cast<std::streamsize>(text.size()));
+    };
+}
+
+// Загрузка читает текст блоками такого размера и делит блок на куски по
+// целым строкам, которые разбираются параллельно.
+constexpr size_t IMPORT_BLOCK_SIZE = 4 << 20;
+constexpr size_t IMPORT_CHUNK_SIZE = 64 << 10;
+
+// Разобранная ячейка загружаемого текста: значение текста или выражение
+// формулы с ключом в таблице формул (нет ключа, если выражение нельзя
+// записать в относительном виде).
+struct ImportedCell {
+    Position pos;
+    cell_detail::CellValue value;
+    std::string expression;
+    std::optional<std::string> key;
+};
+
+// Кусок загружаемого текста из целых строк, первая из которых - строка
+// first_row листа, и его разобранные ячейки.
+struct ImportedChunk {
+    std::string_view text;
+    int first_row = 0;
+    // наибольшее число полей в строке куска
+    int max_fields = 0;
+    std::vector<ImportedCell> cells;
+    std::exception_ptr error;
+};
+
+ImportedCell MakeImportedCell(Position pos, std::string_view text) {
+    ImportedCell cell{ pos, {}, {}, std::nullopt };
+    if (text.size() > 1 && text.front() == FORMULA_SIGN) {
+        cell.expression.assign(text.substr(1));
+        std::string key;
+        if (AppendRelativeFormulaKey(cell.expression, pos, key)) {
+            cell.key = std::move(key);
+        }
+    }
+    else {
+        cell.value = cell_detail::CellValue::MakeText(std::string(text));
+    }
+    return cell;
+}
+
+void ParseImportedChunk(ImportedChunk& chunk, char delimiter) {
+    try {
+        std::string_view text = chunk.text;
+        for (int row = chunk.first_row; !text.empty(); ++row) {
+            const size_t line_end = text.find('\n');
+            std::string_view line = text.substr(0, line_end);
+            text.remove_prefix(line_end == std::string_view::npos ? text.size() : line_end + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            int col = 0;
+            for (;; ++col) {
+                const size_t field_end = line.find(delimiter);
+                const std::string_view field = line.substr(0, field_end);
+                if (!field.empty()) {
+                    chunk.cells.push_back(MakeImportedCell({ row, col }, field));
+                }
+                if (field_end == std::string_view::npos) {
+                    break;
+                }
+                line.remove_prefix(field_end + 1);
+            }
+            chunk.max_fields = std::max(chunk.max_fields, col + 1);
+        }
+    }
+    catch (...) {
+        chunk.error = std::current_exception();
+    }
+}
+
+}  // namespace
+
+Sheet::Sheet()
+    : formulas_(arena_.GetResource()) {
 }
 
 Sheet::~Sheet() {
+    cells_.ForEach([this](Position, Cell* cell) {
+        arena_.Destroy(cell);
+    });
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
     CheckPosInPlace(pos);
 
-    if (auto* cell = GetCell(pos)) {
-        dynamic_cast<Cell*>(cell)->Set(std::move(text));
+    std::optional<std::string> change(std::move(text));
+    if (HasConcurrentWrites() && TryChangeInRegion(pos, change)) {
+        return;
     }
-    else {
-        ResizeSheetList(pos);
-        sheet_list_.at(pos.row).at(pos.col) = std::make_unique<Cell>("", *this);
-        SetCell(pos, std::move(text));
+    auto lock = LockSheet();
+    if (in_batch_) {
+        batch_.push_back({ pos, std::move(change) });
+        return;
     }
+    auto* slot = cells_.Find(pos);
+    Cell* cell = slot && *slot ? *slot : AddCell(pos);
+    cell->Set(std::move(*change), formulas_);
+    RecalculateDirtyCells();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
-    return const_cast<Sheet*>(this)->GetCell(pos);
+    CheckPosInPlace(pos);
+    const auto* slot = cells_.Find(pos);
+    return slot ? *slot : nullptr;
 }
 CellInterface* Sheet::GetCell(Position pos) {
-    CheckPosInPlace(pos);
-    if (sheet_list_.size() <= static_cast<size_t>(pos.row)) {
-        return nullptr;
-    }
-    if (sheet_list_.at(pos.row).size() <= static_cast<size_t>(pos.col)) {
-        return nullptr;
-    }
-    return sheet_list_.at(pos.row).at(pos.col).get();
+    return const_cast<CellInterface*>(static_cast<const Sheet*>(this)->GetCell(pos));
 }
 
 void Sheet::ClearCell(Position pos) {
     CheckPosInPlace(pos);
-    if (GetCell(pos)) {
-        sheet_list_.at(pos.row).at(pos.col).reset();
+    std::optional<std::string> change;
+    if (HasConcurrentWrites() && TryChangeInRegion(pos, change)) {
+        return;
     }
+    auto lock = LockSheet();
+    if (in_batch_) {
+        batch_.push_back({ pos, std::nullopt });
+        return;
+    }
+    auto* slot = cells_.Find(pos);
+    if (!slot || !*slot) {
+        return;
+    }
+    // очистка отвязывает формулу ячейки от ячеек, на которые она ссылается
+    (*slot)->Clear();
+    RecalculateDirtyCells();
+    if ((*slot)->HasBindingCells()) {
+        // формулы держат указатели на ячейку, поэтому она остаётся пустой,
+        // как ячейка, созданная по ссылке из формулы
+        return;
+    }
+    RemoveCell(pos);
 }
 
 Size Sheet::GetPrintableSize() const {
-    return CreatePrintableSize();
+    return printable_area_.GetSize();
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
+    if (HasDefaultFormat(output)) {
+        auto buffer = std::make_unique<char[]>(PRINT_BUFFER_SIZE);
+        ExportBuffer export_buffer(buffer.get(), PRINT_BUFFER_SIZE, MakeStreamSink(output));
+        ExportValues(export_buffer);
+        return;
+    }
     auto print_get_value = [&output](const CellInterface* ptr_value) {
         std::visit([&](const auto& x) { output << x; }, ptr_value->GetValue());
     };
     Printer(output, print_get_value);
 }
 void Sheet::PrintTexts(std::ostream& output) const {
+    if (HasDefaultFormat(output)) {
+        auto buffer = std::make_unique<char[]>(PRINT_BUFFER_SIZE);
+        ExportBuffer export_buffer(buffer.get(), PRINT_BUFFER_SIZE, MakeStreamSink(output));
+        ExportTexts(export_buffer);
+        return;
+    }
     auto print_get_text = [&output](const CellInterface* ptr_value) {
         output << ptr_value->GetText();
     };
     Printer(output, print_get_text);
 }
 
-void Sheet::CheckPosInPlace(Position pos) const {
-    if (!pos.IsValid()) {
-        using namespace std;
-        std::stringstream ss;
-        ss << "Position is invalid "s << pos.ToString();
-        throw InvalidPositionException(ss.str());
+void Sheet::ExportValues(ExportBuffer& output) const {
+    Export(output, [](const Cell* cell, ExportBuffer& output) {
+        cell->PrintValue(output);
+    });
+}
+
+void Sheet::ExportTexts(ExportBuffer& output) const {
+    Export(output, [](const Cell* cell, ExportBuffer& output) {
+        cell->PrintText(output);
+    });
+}
+
+template <typename Print>
+void Sheet::ExportRows(int first_row, int last_row, int cols, ExportBuffer& output, Print print) const {
+    for (int r = first_row; r < last_row; ++r) {
+        int printed_tabs = 0;
+        cells_.ForEachInRow(r, cols, [&](int c, const Cell* cell) {
+            output.Write('\t', static_cast<size_t>(c - printed_tabs));
+            printed_tabs = c;
+            print(cell, output);
+        });
+        if (printed_tabs + 1 < cols) {
+            output.Write('\t', static_cast<size_t>(cols - 1 - printed_tabs));
+        }
+        output.Write('\n');
+    }
+}
+
+template <typename Print>
+void Sheet::Export(ExportBuffer& output, Print print) const {
+    const Size size = GetPrintableSize();
+    std::unique_lock lock(export_mutex_, std::defer_lock);
+    if (!pool_ || size.rows < 2 * EXPORT_BLOCK_ROWS || !lock.try_lock()) {
+        ExportRows(0, size.rows, size.cols, output, print);
+        output.Flush();
+        return;
+    }
+
+    // Блоки печатаются волнами, чтобы в памяти лежало лишь несколько
+    // блоков, а не весь текст листа.
+    const int block_count = (size.rows + EXPORT_BLOCK_ROWS - 1) / EXPORT_BLOCK_ROWS;
+    const int wave_size = static_cast<int>(pool_->GetThreadCount() * EXPORT_BLOCKS_PER_THREAD);
+    std::vector<std::string> blocks(wave_size);
+    std::vector<std::exception_ptr> errors(wave_size);
+    std::vector<WorkStealingPool::Task> tasks;
+    for (int first_block = 0; first_block < block_count; first_block += wave_size) {
+        tasks.resize(std::min(wave_size, block_count - first_block));
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            tasks[i] = static_cast<WorkStealingPool::Task>(i);
+        }
+        pool_->Run(tasks, [&](WorkStealingPool::Task task, size_t) {
+            const int first_row = (first_block + static_cast<int>(task)) * EXPORT_BLOCK_ROWS;
+            try {
+                blocks[task].clear();
+                char buffer[EXPORT_TASK_BUFFER_SIZE];
+                ExportBuffer block_output(buffer, sizeof(buffer), MakeStringSink(blocks[task]));
+                ExportRows(first_row, std::min(first_row + EXPORT_BLOCK_ROWS, size.rows), size.cols, block_output, print);
+                block_output.Flush();
+            }
+            catch (...) {
+                errors[task] = std::current_exception();
+            }
+        });
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            if (errors[i]) {
+                std::rethrow_exception(errors[i]);
+            }
+            output.Write(blocks[i]);
+        }
     }
+    output.Flush();
+}
+
+AllocationStats Sheet::GetAllocationStats() const {
+    return arena_.GetStats();
 }
 
-void Sheet::ResizeSheetList(Position pos) {
-    if (sheet_list_.size() <= static_cast<size_t>(pos.row)) {
-        int new_row = pos.row + 1;
-        sheet_list_.resize(new_row);
+size_t Sheet::GetSharedFormulaCount() const {
+    return formulas_.GetSize();
+}
+
+void Sheet::SetRecalculationMode(RecalculationMode mode) {
+    recalculation_mode_ = mode;
+    dirty_cells_.clear();
+    if (mode == RecalculationMode::Eager) {
+        Recalculate();
     }
-    if (sheet_list_.at(pos.row).size() <= static_cast<size_t>(pos.col)) {
-        int new_col = pos.col + 1;
-        sheet_list_.at(pos.row).resize(new_col);
+}
+
+void Sheet::Recalculate() {
+    dirty_cells_.clear();
+    cells_.ForEach([this](Position, const Cell* cell) {
+        if (cell->IsDirty()) {
+            dirty_cells_.push_back(cell);
+        }
+    });
+    RecalculateDirtyCells();
+}
+
+void Sheet::BeginBatch() {
+    auto lock = LockSheet();
+    if (in_batch_) {
+        throw std::logic_error("Batch is already open");
     }
+    in_batch_ = true;
+    batch_.clear();
 }
 
-Size Sheet::CreatePrintableSize() const {
-    int row = 0;
-    int col = 0;
+void Sheet::CommitBatch() {
+    using Type = cell_detail::CellValue::Type;
 
-    int local_row = 1;
-    for (const auto& row_value : sheet_list_) {
-        int local_col = 1;
-        for (const auto& col_value : row_value) {
-            if (col_value) {
-                if (local_col > col) {
-                    col = local_col;
+    auto lock = LockSheet();
+    if (!in_batch_) {
+        throw std::logic_error("No batch to commit");
+    }
+    in_batch_ = false;
+    // изменения остаются в batch_, чтобы следующий пакет не выделял память заново
+    std::vector<BatchChange>& changes = batch_;
+    // Для каждой ячейки остаётся последнее изменение. Сортируются номера
+    // изменений, а не сами изменения с их текстом. Пакет, в котором ячейки
+    // уже идут по порядку, например при загрузке таблицы, не сортируется.
+    std::vector<std::pair<Position, size_t>> order;
+    order.reserve(changes.size());
+    for (size_t i = 0; i < changes.size(); ++i) {
+        order.push_back({ changes[i].pos, i });
+    }
+    const bool is_ordered = std::adjacent_find(order.begin(), order.end(), [](const auto& lhs, const auto& rhs) {
+        return !(lhs.first < rhs.first);
+    }) == order.end();
+    if (!is_ordered) {
+        std::sort(order.begin(), order.end());
+    }
+    size_t change_count = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i + 1 == order.size() || !(order[i + 1].first == order[i].first)) {
+            order[change_count++] = order[i];
+        }
+    }
+    order.resize(change_count);
+
+    // Без формул цикл не появится, а текст разбирается без ошибок, поэтому
+    // изменения применяются по одному, а пересчитываются вместе.
+    const bool has_formulas = std::any_of(order.begin(), order.end(), [&changes](const auto& entry) {
+        const std::optional<std::string>& text = changes[entry.second].text;
+        return text && text->size() > 1 && text->front() == FORMULA_SIGN;
+    });
+    if (!has_formulas) {
+        for (const auto& [pos, index] : order) {
+            if (changes[index].text) {
+                auto* slot = cells_.Find(pos);
+                Cell* cell = slot && *slot ? *slot : AddCell(pos);
+                cell->Set(std::move(*changes[index].text), formulas_);
+            }
+            else if (auto* slot = cells_.Find(pos); slot && *slot) {
+                (*slot)->Clear();
+                if (!(*slot)->HasBindingCells()) {
+                    RemoveCell(pos);
                 }
-                row = local_row;
             }
-            local_col++;
         }
-        local_row++;
+        RecalculateDirtyCells();
+        return;
     }
 
-    return { row, col };
+    // Новое и прежнее значения каждой изменённой ячейки. Значения
+    // разбираются, и недостающие ячейки создаются раньше, чем меняется
+    // какая-либо ячейка, поэтому ошибка разбора не затрагивает лист.
+    struct CellChange {
+        Cell* cell;
+        cell_detail::CellValue value;
+        cell_detail::CellValue previous;
+        bool is_clear;
+    };
+    std::vector<CellChange> cell_changes;
+    cell_changes.reserve(order.size());
+    std::vector<Position> created_cells;
+    auto find_or_add_cell = [this, &created_cells](Position pos) {
+        if (auto* slot = cells_.Find(pos); slot && *slot) {
+            return *slot;
+        }
+        created_cells.push_back(pos);
+        return AddCell(pos);
+    };
+    auto remove_created_cells = [this, &cell_changes, &created_cells]() {
+        // значения держат общие формулы таблицы и удаляются первыми
+        cell_changes.clear();
+        for (auto it = created_cells.rbegin(); it != created_cells.rend(); ++it) {
+            RemoveCell(*it);
+        }
+    };
+    try {
+        for (const auto& [pos, index] : order) {
+            BatchChange& change = changes[index];
+            if (change.text) {
+                Cell* cell = find_or_add_cell(pos);
+                cell_changes.push_back({ cell, cell->MakeValue(std::move(*change.text), formulas_), {}, false });
+            }
+            else if (auto* slot = cells_.Find(pos); slot && *slot) {
+                cell_changes.push_back({ *slot, {}, {}, true });
+            }
+        }
+        for (const CellChange& change : cell_changes) {
+            if (change.value.GetType() == Type::Formula) {
+                for (const Position& pos : change.value.GetFormula().GetReferencedCells()) {
+                    find_or_add_cell(pos);
+                }
+            }
+        }
+    }
+    catch (...) {
+        remove_created_cells();
+        throw;
+    }
+
+    // Сначала снимаются связи всех прежних значений, поэтому цикл, который
+    // создала бы только часть изменений, не найдётся.
+    for (CellChange& change : cell_changes) {
+        change.previous = change.cell->Detach();
+    }
+    size_t attached = 0;
+    while (attached < cell_changes.size() && cell_changes[attached].cell->Attach(cell_changes[attached].value)) {
+        ++attached;
+    }
+    if (attached < cell_changes.size()) {
+        // Связи без новых значений снова образуют прежний лист без циклов.
+        // Зависимые формулы ещё не отмечены, а прежние значения сохранили
+        // свои кэши.
+        for (size_t i = 0; i < attached; ++i) {
+            cell_changes[i].cell->Detach();
+        }
+        for (CellChange& change : cell_changes) {
+            [[maybe_unused]] const bool is_attached = change.cell->Attach(change.previous);
+            assert(is_attached);
+            change.cell->PublishValue();
+        }
+        remove_created_cells();
+        throw CircularDependencyException("Batch has circular dependency exception");
+    }
+
+    for (const CellChange& change : cell_changes) {
+        change.cell->CompleteChange(change.previous);
+    }
+    // очищенная ячейка удаляется, как в ClearCell(), если на неё не ссылаются
+    for (const CellChange& change : cell_changes) {
+        if (change.is_clear && !change.cell->HasBindingCells()) {
+            RemoveCell(change.cell->GetPosition());
+        }
+    }
+    RecalculateDirtyCells();
+}
+
+void Sheet::CancelBatch() {
+    auto lock = LockSheet();
+    if (!in_batch_) {
+        throw std::logic_error("No batch to cancel");
+    }
+    in_batch_ = false;
+    batch_.clear();
+}
+
+void Sheet::ImportTexts(std::istream& input, char delimiter) {
+    auto lock = LockSheet();
+    if (in_batch_ || cells_.GetSize() != 0) {
+        throw std::logic_error("Texts are imported only into an empty sheet outside a batch");
+    }
+
+    // Все ячейки листа загружены, поэтому при ошибке удаляются все. Формулы
+    // formula_cells[0, bound) уже связаны и сначала отвязываются.
+    std::vector<Cell*> formula_cells;
+    size_t bound = 0;
+    auto remove_all_cells = [this, &formula_cells, &bound]() {
+        for (size_t i = 0; i < bound; ++i) {
+            formula_cells[i]->Detach();
+        }
+        std::vector<Position> positions;
+        positions.reserve(cells_.GetSize());
+        cells_.ForEach([&positions](Position pos, const Cell*) {
+            positions.push_back(pos);
+        });
+        for (const Position& pos : positions) {
+            RemoveCell(pos);
+        }
+    };
+
+    try {
+        std::string block;
+        std::vector<ImportedChunk> chunks;
+        std::vector<WorkStealingPool::Task> tasks;
+        int row_count = 0;
+        int col_count = 0;
+        // в начале блока - незаконченная строка предыдущего
+        size_t carried = 0;
+        while (input) {
+            block.resize(carried + IMPORT_BLOCK_SIZE);
+            input.read(block.data() + carried, IMPORT_BLOCK_SIZE);
+            block.resize(carried + static_cast<size_t>(input.gcount()));
+            // последняя строка без перевода строки заканчивается вместе с текстом
+            const size_t text_end = input ? block.rfind('\n') + 1 : block.size();
+            if (text_end == 0) {
+                carried = block.size();
+                continue;
+            }
+
+            chunks.clear();
+            const std::string_view text(block.data(), text_end);
+            for (size_t begin = 0; begin < text.size();) {
+                size_t end = text.find('\n', std::min(begin + IMPORT_CHUNK_SIZE, text.size()) - 1);
+                end = end == std::string_view::npos ? text.size() : end + 1;
+                ImportedChunk& chunk = chunks.emplace_back();
+                chunk.text = text.substr(begin, end - begin);
+                chunk.first_row = row_count;
+                row_count += static_cast<int>(std::count(chunk.text.begin(), chunk.text.end(), '\n'));
+                begin = end;
+            }
+            if (text.back() != '\n') {
+                ++row_count;
+            }
+
+            if (pool_ && chunks.size() > 1) {
+                tasks.resize(chunks.size());
+                for (size_t i = 0; i < tasks.size(); ++i) {
+                    tasks[i] = static_cast<WorkStealingPool::Task>(i);
+                }
+                pool_->Run(tasks, [&chunks, delimiter](WorkStealingPool::Task task, size_t) {
+                    ParseImportedChunk(chunks[task], delimiter);
+                });
+            }
+            else {
+                for (ImportedChunk& chunk : chunks) {
+                    ParseImportedChunk(chunk, delimiter);
+                }
+            }
+
+            // Общие формулы, арена и хранилище не потокобезопасны, поэтому
+            // ячейки вставляются в одном потоке.
+            for (ImportedChunk& chunk : chunks) {
+                if (chunk.error) {
+                    std::rethrow_exception(chunk.error);
+                }
+                col_count = std::max(col_count, chunk.max_fields);
+                for (ImportedCell& imported : chunk.cells) {
+                    CheckPosInPlace(imported.pos);
+                    Cell* cell = AddCell(imported.pos);
+                    if (imported.value.GetType() == cell_detail::CellValue::Type::Empty) {
+                        const std::string* key = imported.key ? &*imported.key : nullptr;
+                        cell->LoadValue(cell_detail::CellValue::MakeFormula(
+                            ParseFormula(std::move(imported.expression), imported.pos, key, formulas_)));
+                        formula_cells.push_back(cell);
+                    }
+                    else {
+                        cell->LoadValue(std::move(imported.value));
+                    }
+                }
+            }
+
+            carried = block.size() - text_end;
+            block.erase(0, text_end);
+        }
+
+        for (; bound < formula_cells.size(); ++bound) {
+            formula_cells[bound]->BindLoadedFormula();
+        }
+        if (!Cell::OrderLoadedCells(*this)) {
+            throw CircularDependencyException("Imported formulas have circular dependency exception");
+        }
+
+        // пустые поля в конце строк и пустые строки в конце текста
+        const Size size = GetPrintableSize();
+        if (row_count > size.rows || col_count > size.cols) {
+            const Position corner{ row_count - 1, col_count - 1 };
+            CheckPosInPlace(corner);
+            if (auto* slot = cells_.Find(corner); !slot || !*slot) {
+                AddCell(corner);
+            }
+        }
+    }
+    catch (...) {
+        remove_all_cells();
+        throw;
+    }
+
+    if (recalculation_mode_ == RecalculationMode::Eager) {
+        Recalculate();
+    }
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::GetSnapshot() {
+    using TileEntry = SheetSnapshot::TileEntry;
+
+    auto lock = LockSheet();
+    if (snapshot_ && changed_tiles_.empty()) {
+        return snapshot_;
+    }
+
+    std::vector<TileEntry> tiles;
+    if (!snapshot_) {
+        // блоки листа и снимка одного размера, поэтому ячейки приходят по
+        // блокам в порядке их номеров
+        static_assert(SheetSnapshot::TILE_SIZE == CellStorage::TILE_SIZE);
+        std::shared_ptr<SheetSnapshot::Tile> tile;
+        cells_.ForEach([&](Position pos, const Cell* cell) {
+            const uint32_t index = SheetSnapshot::GetTileIndex(pos);
+            if (tiles.empty() || tiles.back().first != index) {
+                tile = std::make_shared<SheetSnapshot::Tile>();
+                tiles.emplace_back(index, tile);
+            }
+            tile->Add(pos, SnapshotCell(cell->GetText(), cell->GetValue()));
+        });
+        tile_changes_.assign(SheetSnapshot::TILE_ROWS * SheetSnapshot::TILE_COLS, NO_TILE_CHANGES);
+    }
+    else {
+        std::sort(changed_tiles_.begin(), changed_tiles_.end(), [](const TileChanges& lhs, const TileChanges& rhs) {
+            return lhs.index < rhs.index;
+        });
+        const std::vector<TileEntry>& previous = snapshot_->GetTiles();
+        tiles.reserve(previous.size() + changed_tiles_.size());
+        auto it = previous.begin();
+        // формулы, вычисленные при сборке блоков, не отмечают новых
+        // изменений: всё, что от них зависит, уже отмечено устаревшим
+        [[maybe_unused]] const size_t changed_count = changed_tiles_.size();
+        for (const TileChanges& changes : changed_tiles_) {
+            for (; it != previous.end() && it->first < changes.index; ++it) {
+                tiles.push_back(*it);
+            }
+            const SheetSnapshot::Tile* previous_tile = nullptr;
+            if (it != previous.end() && it->first == changes.index) {
+                previous_tile = it->second.get();
+                ++it;
+            }
+            if (auto tile = MakeSnapshotTile(changes, previous_tile)) {
+                tiles.emplace_back(changes.index, std::move(tile));
+            }
+            tile_changes_[changes.index] = NO_TILE_CHANGES;
+        }
+        tiles.insert(tiles.end(), it, previous.end());
+        assert(changed_tiles_.size() == changed_count);
+        changed_tiles_.clear();
+    }
+
+    snapshot_ = std::make_shared<const SheetSnapshot>(GetPrintableSize(), std::move(tiles));
+    return snapshot_;
+}
+
+void Sheet::SetConcurrentWrites(bool enabled) {
+    if (enabled == HasConcurrentWrites()) {
+        return;
+    }
+    region_mutexes_ = enabled ? std::vector<std::mutex>(CellStorage::TILE_ROWS) : std::vector<std::mutex>();
+}
+
+void Sheet::SetThreadCount(size_t count) {
+    if (count == GetThreadCount()) {
+        return;
+    }
+    pool_ = count > 1 ? std::make_unique<WorkStealingPool>(count) : nullptr;
+}
+
+void Sheet::RecalculateDirtyCells() {
+    if (dirty_cells_.empty()) {
+        return;
+    }
+    if (pool_) {
+        // задачи параллельного пересчёта известны заранее, поэтому
+        // отмечаются все формулы, которые зависят от устаревших
+        if (recalculation_mode_ == RecalculationMode::Eager) {
+            for (size_t i = 0; i < dirty_cells_.size(); ++i) {
+                dirty_cells_[i]->MarkDependentsToCheck();
+            }
+        }
+        if (dirty_cells_.size() >= MIN_PARALLEL_CELLS) {
+            RecalculateInParallel();
+            dirty_cells_.clear();
+            return;
+        }
+    }
+    auto is_earlier = [this](const Cell* lhs, const Cell* rhs) {
+        return graph_.GetOrder(lhs->GetNode()) < graph_.GetOrder(rhs->GetNode());
+    };
+    auto is_later = [&is_earlier](const Cell* lhs, const Cell* rhs) {
+        return is_earlier(rhs, lhs);
+    };
+    std::vector<const Cell*> cells;
+    cells.swap(dirty_cells_);
+    std::sort(cells.begin(), cells.end(), is_earlier);
+    // Формулы, которые устарели во время пересчёта, приходят в конец
+    // dirty_cells_ и переносятся в кучу с первой в топологическом порядке
+    // формулой наверху. Следующей обновляется первая из кучи и массива.
+    std::vector<const Cell*> queue;
+    auto next = cells.begin();
+    std::lock_guard lock(evaluation_mutex_);
+    while (true) {
+        for (const Cell* cell : dirty_cells_) {
+            queue.push_back(cell);
+            std::push_heap(queue.begin(), queue.end(), is_later);
+        }
+        dirty_cells_.clear();
+        const Cell* cell;
+        if (!queue.empty() && (next == cells.end() || is_earlier(queue.front(), *next))) {
+            std::pop_heap(queue.begin(), queue.end(), is_later);
+            cell = queue.back();
+            queue.pop_back();
+        }
+        else if (next != cells.end()) {
+            cell = *next++;
+        }
+        else {
+            break;
+        }
+        // формула, которая уже обновлена, ничего не вычисляет
+        cell->UpdateIfStale();
+    }
+    // массив возвращается, чтобы не выделять память при следующем изменении
+    cells.clear();
+    dirty_cells_.swap(cells);
+}
+
+template <typename Func>
+void Sheet::ForEachDependentTask(const Cell* cell, Func func) const {
+    auto visit = [this, &func](DependencyGraph::NodeId node) {
+        if (const uint32_t task = node_tasks_[node]; task != NO_TASK) {
+            func(task);
+        }
+    };
+    graph_.ForEachDependent(cell->GetNode(), visit);
+    columns_.ForEachDependent(cell->GetPosition(), [&visit](const Cell* dependent) {
+        visit(dependent->GetNode());
+    });
+}
+
+void Sheet::RecalculateInParallel() {
+    // каждая устаревшая формула - одна задача
+    node_tasks_.resize(graph_.GetNodeLimit(), NO_TASK);
+    std::vector<const Cell*> cells;
+    for (const Cell* cell : dirty_cells_) {
+        if (cell->IsDirty() && node_tasks_[cell->GetNode()] == NO_TASK) {
+            node_tasks_[cell->GetNode()] = static_cast<uint32_t>(cells.size());
+            cells.push_back(cell);
+        }
+    }
+
+    // Сколько устаревших формул ждёт каждая. Остальные ячейки уже имеют
+    // значения, поэтому вычисление ни к чему не обращается рекурсивно.
+    // Задача не меняет состояние чужих ячеек, а отмечает, что значения, от
+    // которых зависит формула, изменились.
+    std::unique_ptr<std::atomic<uint32_t>[]> waiting(new std::atomic<uint32_t>[cells.size()]);
+    std::unique_ptr<std::atomic<bool>[]> inputs_changed(new std::atomic<bool>[cells.size()]);
+    for (size_t task = 0; task < cells.size(); ++task) {
+        waiting[task].store(0, std::memory_order_relaxed);
+        inputs_changed[task].store(false, std::memory_order_relaxed);
+    }
+    for (const Cell* cell : cells) {
+        ForEachDependentTask(cell, [&waiting](uint32_t task) {
+            waiting[task].fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    std::vector<WorkStealingPool::Task> ready;
+    for (size_t task = 0; task < cells.size(); ++task) {
+        if (waiting[task].load(std::memory_order_relaxed) == 0) {
+            ready.push_back(static_cast<WorkStealingPool::Task>(task));
+        }
+    }
+
+    pool_->Run(ready, [this, &cells, &waiting, &inputs_changed](WorkStealingPool::Task task, size_t worker) {
+        const bool changed = cells[task]->UpdateConcurrently(inputs_changed[task].load(std::memory_order_relaxed), columns_mutex_);
+        ForEachDependentTask(cells[task], [this, &waiting, &inputs_changed, changed, worker](uint32_t dependent) {
+            if (changed) {
+                // видна задаче dependent вместе с уменьшением счётчика
+                inputs_changed[dependent].store(true, std::memory_order_relaxed);
+            }
+            if (waiting[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                pool_->Push(worker, dependent);
+            }
+        });
+    });
+
+    for (const Cell* cell : cells) {
+        node_tasks_[cell->GetNode()] = NO_TASK;
+    }
+}
+
+void Sheet::BindRange(const Range& range, const Cell* cell) {
+    columns_.AddDependent(range, cell, [this](int col) {
+        ForEachCellInRange(Range{ { 0, col }, { Position::MAX_ROWS - 1, col } }, [](const Cell* cell) {
+            cell->PublishValue();
+        });
+    });
+}
+
+void Sheet::UnbindRange(const Range& range, const Cell* cell) {
+    columns_.RemoveDependent(range, cell);
+}
+
+Cell* Sheet::AddCell(Position pos) {
+    Cell* cell = arena_.Create<Cell>(*this, pos, arena_.GetResource());
+    cells_.Insert(pos, cell);
+    printable_area_.Add(pos);
+    MarkTextChanged(pos);
+    return cell;
+}
+
+void Sheet::RemoveCell(Position pos) {
+    Cell* cell = cells_.Extract(pos);
+    graph_.RemoveNode(cell->GetNode());
+    arena_.Destroy(cell);
+    printable_area_.Remove(pos);
+    MarkTextChanged(pos);
+}
+
+SheetSnapshot::TilePtr Sheet::MakeSnapshotTile(const TileChanges& changes, const SheetSnapshot::Tile* previous) const {
+    auto tile = std::make_shared<SheetSnapshot::Tile>();
+    cells_.ForEachInRange(SheetSnapshot::GetTileRange(changes.index), [&](Position pos, const Cell* cell) {
+        const SnapshotCell* previous_cell = previous && !changes.texts.Contains(pos) ? previous->Find(pos) : nullptr;
+        if (!previous_cell) {
+            tile->Add(pos, SnapshotCell(cell->GetText(), cell->GetValue()));
+        }
+        else if (changes.values.Contains(pos)) {
+            tile->Add(pos, SnapshotCell(previous_cell->GetText(), cell->GetValue()));
+        }
+        else {
+            tile->Add(pos, *previous_cell);
+        }
+    });
+    if (tile->GetCellCount() == 0) {
+        return nullptr;
+    }
+    return tile;
+}
+
+std::unique_lock<std::shared_mutex> Sheet::LockSheet() {
+    if (!HasConcurrentWrites()) {
+        return {};
+    }
+    return std::unique_lock(sheet_mutex_);
+}
+
+bool Sheet::TryChangeInRegion(Position pos, std::optional<std::string>& text) {
+    if (text && text->size() > 1 && text->front() == FORMULA_SIGN) {
+        return false;
+    }
+    // значения столбцов и пакет меняются только под блокировкой всего листа
+    std::shared_lock sheet_lock(sheet_mutex_);
+    if (in_batch_ || columns_.IsTracked(pos.col)) {
+        return false;
+    }
+    // ячейки области лежат в одной строке блоков хранилища, которую не
+    // трогают записи в другие области
+    std::lock_guard region_lock(region_mutexes_[pos.row >> CellStorage::TILE_BITS]);
+    auto* slot = cells_.Find(pos);
+    Cell* cell = slot ? *slot : nullptr;
+    if (cell && cell->IsFormula()) {
+        return false;
+    }
+    {
+        std::lock_guard lock(shared_structures_mutex_);
+        if (cell && cell->HasBindingCells()) {
+            return false;
+        }
+        if (!text) {
+            if (cell) {
+                RemoveCell(pos);
+            }
+            return true;
+        }
+        if (cell) {
+            MarkTextChanged(pos);
+        }
+        else {
+            cell = AddCell(pos);
+        }
+    }
+    cell->SetText(std::move(*text));
+    return true;
+}
+
+void Sheet::CheckPosInPlace(Position pos) const {
+    if (!pos.IsValid()) {
+        using namespace std;
+        std::stringstream ss;
+        ss << "Position is invalid "s << pos.ToString();
+        throw InvalidPositionException(ss.str());
+    }
 }
 
 // -----------------------------------------------------------------------------
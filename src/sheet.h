@@ -1,15 +1,48 @@
 #pragma once
 
+#include "arena.h"
 #include "cell.h"
+#include "column_values.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "export_buffer.h"
 #include "position.h"
+#include "printable_area.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include "tiled_storage.h"
 
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
 #include <vector>
 
+//           
+// ,    .     
+// ,       ,  
+// .          ,
+// . SetConcurrentWrites().
 class Sheet : public SheetInterface {
 public:
-    using SheetList = std::vector<std::vector<std::unique_ptr<CellInterface>>>;
+    using CellStorage = TiledStorage<Cell*>;
+
+    //   ,   .  
+    //  ,      , 
+    //  :    , 
+    //   .
+    enum class RecalculationMode {
+        //    ,    , 
+        //   
+        Lazy,
+        //     :  
+        //       ,  
+        //     ,    
+        //  .
+        Eager,
+    };
 
     Sheet();
 
@@ -24,35 +57,289 @@ public:
 
     Size GetPrintableSize() const override;
 
+    //   ExportValues()  ExportTexts(),   output 
+    //   ,  -    output.
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    //   ,  PrintValues()  PrintTexts(),  output   
+    //   .    , 
+    //   .      (.
+    // SetThreadCount()),         
+    //   output  .    , , 
+    //    ,     .
+    void ExportValues(ExportBuffer& output) const;
+    void ExportTexts(ExportBuffer& output) const;
+
+    //     .
+    AllocationStats GetAllocationStats() const;
+
+    //         .
+    size_t GetSharedFormulaCount() const;
+
+    //         .
+    void SetRecalculationMode(RecalculationMode mode);
+    RecalculationMode GetRecalculationMode() const {
+        return recalculation_mode_;
+    }
+
+    //    ,   , 
+    //       .
+    void Recalculate();
+
+    //   .  BeginBatch()  CommitBatch() SetCell()
+    //  ClearCell()    (  ),
+    //    . CommitBatch()   : 
+    // ,   ,  ,  
+    //    ,     
+    //   .       ,
+    //   ,    ,  
+    // (FormulaException  CircularDependencyException) .
+    // BeginBatch()   , CommitBatch()  CancelBatch() 
+    //   std::logic_error,    ,  .
+    void BeginBatch();
+    void CommitBatch();
+    //   ,   .
+    void CancelBatch();
+    bool IsInBatch() const {
+        return in_batch_;
+    }
+
+    //       , . SheetSnapshot.
+    //     .    ,
+    //      ,      
+    // ,     .
+    std::shared_ptr<const SheetSnapshot> GetSnapshot();
+
+    //        input   ,   
+    //  PrintTexts():     ,  
+    //  delimiter,   -  .   
+    //  '\r'.  ,    delimiter  
+    //   ,    .   , 
+    //       (. SetThreadCount()). 
+    //     ,   ,   
+    //      .      
+    //  ,     ,  
+    //  , ,       
+    //  ,        .
+    //      .  
+    // ,       , 
+    //  ,   (InvalidPositionException,
+    // FormulaException  CircularDependencyException) . 
+    //       std::logic_error, 
+    //     .
+    void ImportTexts(std::istream& input, char delimiter = '\t');
+
+    //   : SetCell()  ClearCell()   
+    //  .      CellStorage::TILE_SIZE
+    // ,    . ,    ,
+    //  ,          ,
+    //  ,      , 
+    // ,     ,     ( 
+    //        ). 
+    //         
+    // ,    ;      
+    // GetSnapshot().     : , , 
+    // .       , 
+    //  ; ,      , 
+    // .  ,   .
+    void SetConcurrentWrites(bool enabled);
+    bool HasConcurrentWrites() const {
+        return !region_mutexes_.empty();
+    }
+
+    //    ,    . 
+    //  .  ,    , 
+    //   ,    ,    .
+    void SetThreadCount(size_t count);
+    size_t GetThreadCount() const {
+        return pool_ ? pool_->GetThreadCount() : 1;
+    }
+
+    //   cell .    
+    //      .
+    void MarkDirty(const Cell* cell) {
+        if (recalculation_mode_ == RecalculationMode::Eager) {
+            dirty_cells_.push_back(cell);
+        }
+    }
+
+    //   pos ,    . 
+    //    .
+    void MarkTextChanged(Position pos) {
+        if (TileChanges* changes = FindTileChanges(pos)) {
+            changes->texts.Insert(pos);
+        }
+    }
+
+    //   pos ,   :   
+    //   .
+    void MarkValueChanged(Position pos) {
+        if (TileChanges* changes = FindTileChanges(pos)) {
+            changes->values.Insert(pos);
+        }
+    }
+
+    // ,      .
+    std::mutex& GetEvaluationMutex() const {
+        return evaluation_mutex_;
+    }
+
+    //     ,    .
+    DependencyGraph& GetDependencyGraph() {
+        return graph_;
+    }
+    const DependencyGraph& GetDependencyGraph() const {
+        return graph_;
+    }
+
+    //  ,    .
+    ColumnValues& GetColumnValues() {
+        return columns_;
+    }
+    const ColumnValues& GetColumnValues() const {
+        return columns_;
+    }
+
+    // ,   cell   range,    .
+    void BindRange(const Range& range, const Cell* cell);
+    void UnbindRange(const Range& range, const Cell* cell);
+
+    //    pos,   .
+    Cell* AddCell(Position pos);
+
+    //    . func(const Cell* cell).
+    template <typename Func>
+    void ForEachCellInRange(const Range& range, Func func) const {
+        cells_.ForEachInRange(range, [&func](Position, const Cell* cell) {
+            func(cell);
+        });
+    }
+
 private:
+    //   : text -   , nullopt - .
+    struct BatchChange {
+        Position pos;
+        std::optional<std::string> text;
+    };
+
+    //   index,    .
+    struct TileChanges {
+        uint32_t index = 0;
+        SheetSnapshot::CellSet texts;
+        SheetSnapshot::CellSet values;
+    };
+
+    static constexpr uint32_t NO_TILE_CHANGES = UINT32_MAX;
+
+    //    pos  nullptr,    .
+    TileChanges* FindTileChanges(Position pos) {
+        if (!snapshot_) {
+            return nullptr;
+        }
+        const uint32_t index = SheetSnapshot::GetTileIndex(pos);
+        if (tile_changes_[index] == NO_TILE_CHANGES) {
+            tile_changes_[index] = static_cast<uint32_t>(changed_tiles_.size());
+            changed_tiles_.push_back({ index, {}, {} });
+        }
+        return &changed_tiles_[tile_changes_[index]];
+    }
+
     void CheckPosInPlace(Position pos) const;
-    void ResizeSheetList(Position pos);
-    Size CreatePrintableSize() const;
+
+    //       ,   
+    // .
+    std::unique_lock<std::shared_mutex> LockSheet();
+
+    //        pos (text -
+    //  , nullopt - )     , 
+    //     .   false,  
+    //  ,  text.
+    bool TryChangeInRegion(Position pos, std::optional<std::string>& text);
+
+    //    pos,     .
+    void RemoveCell(Position pos);
+
+    //      ,   , 
+    // nullptr,     .    
+    // previous -      (  ).
+    SheetSnapshot::TilePtr MakeSnapshotTile(const TileChanges& changes, const SheetSnapshot::Tile* previous) const;
+
+    //      .  
+    //  ,   ,   
+    // ,     ,   
+    //     ,    .
+    void RecalculateDirtyCells();
+
+    //      .    , 
+    //    ,    .
+    void RecalculateInParallel();
+
+    // func(uint32_t task)    ,    cell
+    //    .     .
+    template <typename Func>
+    void ForEachDependentTask(const Cell* cell, Func func) const;
+
+    //   [first_row, last_row)   cols  output.
+    // print(const Cell* cell, ExportBuffer& output)  .
+    template <typename Print>
+    void ExportRows(int first_row, int last_row, int cols, ExportBuffer& output, Print print) const;
+
+    template <typename Print>
+    void Export(ExportBuffer& output, Print print) const;
 
 private:
     template <typename Func>
     void Printer(std::ostream& output, Func func) const {
         Size sz = GetPrintableSize();
         for (int r = 0; r < sz.rows; ++r) {
-            bool is_first = true;
-            for (int c = 0; c < sz.cols; ++c) {
-                if (!is_first) {
+            int printed_tabs = 0;
+            cells_.ForEachInRow(r, sz.cols, [&](int c, const Cell* cell) {
+                for (; printed_tabs < c; ++printed_tabs) {
                     output << '\t';
                 }
-                is_first = false;
-                if (const auto* ptr_value = GetCell({ r, c })) {
-                    func(ptr_value);
-                }
+                func(cell);
+            });
+            for (; printed_tabs + 1 < sz.cols; ++printed_tabs) {
+                output << '\t';
             }
             output << '\n';
         }
     }
 
 private:
-    SheetList sheet_list_;
+    //   :      
+    Arena arena_;
+    //        
+    FormulaTable formulas_;
+    DependencyGraph graph_;
+    CellStorage cells_;
+    PrintableArea printable_area_;
+    ColumnValues columns_;
+    RecalculationMode recalculation_mode_ = RecalculationMode::Lazy;
+    std::vector<const Cell*> dirty_cells_;
+    bool in_batch_ = false;
+    //   ;     BeginBatch()
+    std::vector<BatchChange> batch_;
+    //   :  (,   ),  
+    //       .
+    std::unique_ptr<WorkStealingPool> pool_;
+    std::vector<uint32_t> node_tasks_;
+    std::mutex columns_mutex_;
+    mutable std::mutex evaluation_mutex_;
+    //   
+    mutable std::mutex export_mutex_;
+    //   :  ,   (,
+    //   )   ,   : ,
+    //  ,       .
+    std::shared_mutex sheet_mutex_;
+    std::vector<std::mutex> region_mutexes_;
+    std::mutex shared_structures_mutex_;
+    //  ,        
+    //   changed_tiles_ (NO_TILE_CHANGES,    ).
+    std::shared_ptr<const SheetSnapshot> snapshot_;
+    std::vector<TileChanges> changed_tiles_;
+    std::vector<uint32_t> tile_changes_;
 };
 
 // -----------------------------------------------------------------------------
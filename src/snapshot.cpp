@@ -0,0 +1,122 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+#include <variant>
+
+using namespace std::literals;
+
+SnapshotCell::SnapshotCell(std::string text, const CellInterface::Value& value)
+    : text_(std::move(text)) {
+    if (const double* number = std::get_if<double>(&value)) {
+        value_ = *number;
+    }
+    else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+        value_ = *error;
+    }
+}
+
+CellInterface::Value SnapshotCell::GetValue() const {
+    if (value_) {
+        return std::visit([](auto value) -> CellInterface::Value { return value; }, *value_);
+    }
+    if (text_.front() == ESCAPE_SIGN) {
+        return text_.substr(1);
+    }
+    return text_;
+}
+
+// -----------------------------------------------------------------------------
+
+void SheetSnapshot::Tile::Add(Position pos, SnapshotCell cell) {
+    const int row_in_tile = pos.row & TILE_MASK;
+    const uint64_t bit = uint64_t{ 1 } << (pos.col & TILE_MASK);
+    assert(row_in_tile + 1 >= next_row_ && (row_masks_[row_in_tile] & ~(bit - 1)) == 0);
+    for (; next_row_ <= row_in_tile; ++next_row_) {
+        row_offsets_[next_row_] = static_cast<uint32_t>(cells_.size());
+    }
+    row_masks_[row_in_tile] |= bit;
+    cells_.push_back(std::move(cell));
+}
+
+const SnapshotCell* SheetSnapshot::Tile::Find(Position pos) const {
+    const int row_in_tile = pos.row & TILE_MASK;
+    const uint64_t mask = row_masks_[row_in_tile];
+    const uint64_t bit = uint64_t{ 1 } << (pos.col & TILE_MASK);
+    if ((mask & bit) == 0) {
+        return nullptr;
+    }
+    return &cells_[row_offsets_[row_in_tile] + storage_detail::CountBits(mask & (bit - 1))];
+}
+
+// -----------------------------------------------------------------------------
+
+SheetSnapshot::SheetSnapshot(Size printable_size, std::vector<TileEntry> tiles)
+    : printable_size_(printable_size)
+    , tiles_(std::move(tiles)) {
+    assert(std::is_sorted(tiles_.begin(), tiles_.end(), [](const TileEntry& lhs, const TileEntry& rhs) {
+        return lhs.first < rhs.first;
+    }));
+}
+
+Range SheetSnapshot::GetTileRange(uint32_t index) {
+    const int row_base = static_cast<int>(index / TILE_COLS) << TILE_BITS;
+    const int col_base = static_cast<int>(index % TILE_COLS) << TILE_BITS;
+    return Range{ Position{ row_base, col_base },
+        Position{ std::min(row_base + TILE_SIZE, int{ Position::MAX_ROWS }) - 1, std::min(col_base + TILE_SIZE, int{ Position::MAX_COLS }) - 1 } };
+}
+
+const SnapshotCell* SheetSnapshot::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        std::stringstream ss;
+        ss << "Position is invalid "s << pos.ToString();
+        throw InvalidPositionException(ss.str());
+    }
+    const uint32_t index = GetTileIndex(pos);
+    auto it = std::lower_bound(tiles_.begin(), tiles_.end(), index, [](const TileEntry& entry, uint32_t index) {
+        return entry.first < index;
+    });
+    if (it == tiles_.end() || it->first != index) {
+        return nullptr;
+    }
+    return it->second->Find(pos);
+}
+
+template <typename Func>
+void SheetSnapshot::Printer(std::ostream& output, Func func) const {
+    auto tile_row_begin = tiles_.begin();
+    for (int r = 0; r < printable_size_.rows; ++r) {
+        // блоки строки r идут в tiles_ подряд, по столбцам
+        const uint32_t first_index = static_cast<uint32_t>(r >> TILE_BITS) * TILE_COLS;
+        while (tile_row_begin != tiles_.end() && tile_row_begin->first < first_index) {
+            ++tile_row_begin;
+        }
+        int printed_tabs = 0;
+        for (auto it = tile_row_begin; it != tiles_.end() && it->first < first_index + TILE_COLS; ++it) {
+            const int col_base = static_cast<int>(it->first - first_index) << TILE_BITS;
+            it->second->ForEachInRow(r, [&](int col_in_tile, const SnapshotCell& cell) {
+                for (; printed_tabs < col_base + col_in_tile; ++printed_tabs) {
+                    output << '\t';
+                }
+                func(cell);
+            });
+        }
+        for (; printed_tabs + 1 < printable_size_.cols; ++printed_tabs) {
+            output << '\t';
+        }
+        output << '\n';
+    }
+}
+
+void SheetSnapshot::PrintValues(std::ostream& output) const {
+    Printer(output, [&output](const SnapshotCell& cell) {
+        std::visit([&](const auto& x) { output << x; }, cell.GetValue());
+    });
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& output) const {
+    Printer(output, [&output](const SnapshotCell& cell) {
+        output << cell.GetText();
+    });
+}
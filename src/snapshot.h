@@ -0,0 +1,139 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "position.h"
+#include "tiled_storage.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Ячейка снимка листа: текст и значение ячейки на момент снимка.
+class SnapshotCell {
+public:
+    // Ячейка с текстом text и значением value, которое лист вернул для неё.
+    SnapshotCell(std::string text, const CellInterface::Value& value);
+
+    CellInterface::Value GetValue() const;
+
+    const std::string& GetText() const {
+        return text_;
+    }
+
+private:
+    std::string text_;
+    // значение формулы или пустой ячейки; значение текста - сам текст
+    std::optional<FormulaInterface::Value> value_;
+};
+
+// Неизменяемый снимок листа: тексты и значения ячеек на момент снимка.
+// Снимок не меняется вместе с листом, и его можно читать из любых потоков,
+// пока лист меняется. Ячейки снимка лежат в блоках TILE_SIZE x TILE_SIZE.
+// Блоки не меняются после создания, поэтому снимки делят между собой блоки,
+// в которых лист не менялся, а блок удаляется вместе с последним снимком,
+// который его содержит.
+class SheetSnapshot {
+public:
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+    static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Ячейки одного блока по строкам, внутри строки - по столбцам.
+    class Tile {
+    public:
+        // Добавляет ячейку pos, которая стоит после всех добавленных ранее.
+        void Add(Position pos, SnapshotCell cell);
+
+        const SnapshotCell* Find(Position pos) const;
+
+        // Обходит ячейки строки row блока по столбцам.
+        // func(int col_in_tile, const SnapshotCell& cell).
+        template <typename Func>
+        void ForEachInRow(int row, Func func) const;
+
+        size_t GetCellCount() const {
+            return cells_.size();
+        }
+
+    private:
+        static constexpr int TILE_MASK = TILE_SIZE - 1;
+
+        std::vector<SnapshotCell> cells_;
+        // занятые столбцы каждой строки и номер первой ячейки строки в cells_
+        std::array<uint64_t, TILE_SIZE> row_masks_{};
+        std::array<uint32_t, TILE_SIZE> row_offsets_{};
+        // строки до next_row_ уже получили номер первой ячейки
+        int next_row_ = 0;
+    };
+
+    // Множество ячеек одного блока.
+    class CellSet {
+    public:
+        void Insert(Position pos) {
+            rows_[pos.row & (TILE_SIZE - 1)] |= uint64_t{ 1 } << (pos.col & (TILE_SIZE - 1));
+        }
+
+        bool Contains(Position pos) const {
+            return (rows_[pos.row & (TILE_SIZE - 1)] >> (pos.col & (TILE_SIZE - 1))) & 1;
+        }
+
+    private:
+        std::array<uint64_t, TILE_SIZE> rows_{};
+    };
+
+    using TilePtr = std::shared_ptr<const Tile>;
+    // Номер блока: строка блока * TILE_COLS + столбец блока.
+    using TileEntry = std::pair<uint32_t, TilePtr>;
+
+    // Снимок из непустых блоков tiles, упорядоченных по номеру.
+    SheetSnapshot(Size printable_size, std::vector<TileEntry> tiles);
+
+    static uint32_t GetTileIndex(Position pos) {
+        return static_cast<uint32_t>((pos.row >> TILE_BITS) * TILE_COLS + (pos.col >> TILE_BITS));
+    }
+
+    // Позиции блока с номером index.
+    static Range GetTileRange(uint32_t index);
+
+    // Ячейка pos или nullptr, если её не было. Для невалидной позиции
+    // бросает InvalidPositionException, как лист.
+    const SnapshotCell* GetCell(Position pos) const;
+
+    Size GetPrintableSize() const {
+        return printable_size_;
+    }
+
+    // Печатают снимок так же, как лист.
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+    const std::vector<TileEntry>& GetTiles() const {
+        return tiles_;
+    }
+
+private:
+    template <typename Func>
+    void Printer(std::ostream& output, Func func) const;
+
+private:
+    Size printable_size_;
+    std::vector<TileEntry> tiles_;
+};
+
+template <typename Func>
+void SheetSnapshot::Tile::ForEachInRow(int row, Func func) const {
+    const int row_in_tile = row & TILE_MASK;
+    uint64_t mask = row_masks_[row_in_tile];
+    for (uint32_t i = row_offsets_[row_in_tile]; mask != 0; ++i) {
+        const int col_in_tile = storage_detail::CountTrailingZeros(mask);
+        mask &= mask - 1;
+        func(col_in_tile, cells_[i]);
+    }
+}
@@ -1,17 +1,35 @@
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "export_buffer.h"
 #include "formula.h"
 #include "FormulaAST.h"
 #include "position.h"
 #include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
 
 using namespace std::literals;
 
-namespace {
-
-// -----------------------------------------------------------------------------
-
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
@@ -20,6 +38,8 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
 
+namespace {
+
 // -----------------------------------------------------------------------------
 
 void TestPositionAndStringConversion() {
@@ -67,6 +87,7 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("XFD16385").IsValid());
     ASSERT(!Position::FromString("XFE16384").IsValid());
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+    ASSERT(!Position::FromString("A12345678901").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
@@ -509,6 +530,1917 @@ void TestCircularDependeciesOneMoreTime() {
     }
 }
 
+void TestSparseStorage() {
+    Sheet sheet;
+
+    Position corner{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 };
+    sheet.SetCell(corner, "far away"s);
+    ASSERT_EQUAL(sheet.GetCell(corner)->GetText(), "far away"s);
+    ASSERT(sheet.GetCell(Position{ 0, 0 }) == nullptr);
+    ASSERT(sheet.GetCell(Position{ Position::MAX_ROWS - 1, 0 }) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+    sheet.ClearCell(corner);
+    ASSERT(sheet.GetCell(corner) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+
+    // cells on both sides of a tile boundary
+    sheet.SetCell(Position{ 0, 1 }, "a"s);
+    sheet.SetCell(Position{ 0, 64 }, "b"s);
+    sheet.SetCell(Position{ 2, 63 }, "=1+1"s);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 65 }));
+
+    std::string expected = "\ta" + std::string(63, '\t') + "b\n"
+        + std::string(64, '\t') + "\n"
+        + std::string(63, '\t') + "2\t\n";
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), expected);
+}
+
+void TestPrintableSizeShrink() {
+    Sheet sheet;
+
+    sheet.SetCell(Position{ 0, 0 }, "a"s);
+    sheet.SetCell(Position{ 4, 1 }, "b"s);
+    sheet.SetCell(Position{ 1, 7 }, "c"s);
+    sheet.SetCell(Position{ 4, 7 }, "d"s);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 8 }));
+
+    // the edge is still occupied by another cell
+    sheet.ClearCell(Position{ 4, 7 });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 8 }));
+
+    sheet.ClearCell(Position{ 1, 7 });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 2 }));
+
+    sheet.ClearCell(Position{ 4, 1 });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+
+    // clearing an empty position does not change the size
+    sheet.ClearCell(Position{ 10, 10 });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+
+    sheet.SetCell(Position{ 2, 2 }, "e"s);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 3 }));
+
+    sheet.ClearCell(Position{ 0, 0 });
+    sheet.ClearCell(Position{ 2, 2 });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+}
+
+void TestArenaAllocationStats() {
+    Sheet sheet;
+
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+        sheet.SetCell(Position{ row, 1 }, "=A" + std::to_string(row + 1) + "*2+1");
+    }
+
+    AllocationStats stats = sheet.GetAllocationStats();
+    ASSERT(stats.allocations > 0);
+    ASSERT(stats.upstream_allocations < stats.allocations);
+    std::visit(CellValueChecker{ 199.0 }, sheet.GetCell(Position{ 99, 1 })->GetValue());
+
+    for (int row = 0; row < 100; ++row) {
+        sheet.ClearCell(Position{ row, 1 });
+        sheet.ClearCell(Position{ row, 0 });
+    }
+    stats = sheet.GetAllocationStats();
+    ASSERT_EQUAL(stats.allocations, stats.deallocations);
+}
+
+void TestBoundReferences() {
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "=C3*2"s);
+    std::visit(CellValueChecker{ 0.0 }, sheet.GetCell(Position{ 0, 0 })->GetValue());
+
+    // ячейка, созданная по ссылке, заполняется позже
+    sheet.SetCell(Position{ 2, 2 }, "5"s);
+    std::visit(CellValueChecker{ 10.0 }, sheet.GetCell(Position{ 0, 0 })->GetValue());
+
+    // цепочка формул, включая общие
+    for (int row = 1; row < 10; ++row) {
+        sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+    }
+    std::visit(CellValueChecker{ 19.0 }, sheet.GetCell(Position{ 9, 0 })->GetValue());
+
+    // очищенная ячейка, на которую ссылаются, остаётся пустой
+    sheet.ClearCell(Position{ 2, 2 });
+    ASSERT(sheet.GetCell(Position{ 2, 2 }) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell(Position{ 2, 2 })->GetText(), ""s);
+    std::visit(CellValueChecker{ 9.0 }, sheet.GetCell(Position{ 9, 0 })->GetValue());
+    sheet.SetCell(Position{ 2, 2 }, "=1/0"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Div0) }, sheet.GetCell(Position{ 9, 0 })->GetValue());
+
+    // формула в середине цепочки удаляется и создаётся заново
+    sheet.ClearCell(Position{ 5, 0 });
+    std::visit(CellValueChecker{ 4.0 }, sheet.GetCell(Position{ 9, 0 })->GetValue());
+    sheet.SetCell(Position{ 5, 0 }, "=A5+100"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Div0) }, sheet.GetCell(Position{ 9, 0 })->GetValue());
+    sheet.SetCell(Position{ 2, 2 }, "1"s);
+    std::visit(CellValueChecker{ 110.0 }, sheet.GetCell(Position{ 9, 0 })->GetValue());
+
+    // ссылок больше, чем связывается в формуле
+    sheet.SetCell(Position{ 0, 5 }, "=A1+A2+A3+A4+A5+A6"s);
+    std::visit(CellValueChecker{ 2.0 + 3.0 + 4.0 + 5.0 + 6.0 + 106.0 }, sheet.GetCell(Position{ 0, 5 })->GetValue());
+    sheet.SetCell(Position{ 2, 2 }, "2"s);
+    std::visit(CellValueChecker{ 4.0 + 5.0 + 6.0 + 7.0 + 8.0 + 108.0 }, sheet.GetCell(Position{ 0, 5 })->GetValue());
+    sheet.ClearCell(Position{ 0, 5 });
+    sheet.SetCell(Position{ 2, 2 }, "1"s);
+
+    // без ссылок ячейки удаляются
+    for (int row = 9; row >= 0; --row) {
+        sheet.ClearCell(Position{ row, 0 });
+        ASSERT(sheet.GetCell(Position{ row, 0 }) == nullptr);
+    }
+    sheet.ClearCell(Position{ 2, 2 });
+    ASSERT(sheet.GetCell(Position{ 2, 2 }) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    const AllocationStats stats = sheet.GetAllocationStats();
+    ASSERT_EQUAL(stats.allocations, stats.deallocations);
+}
+
+void TestTextNumericValues() {
+    Sheet sheet;
+
+    auto evaluate = [&sheet](const std::string& text) {
+        sheet.SetCell(Position{ 0, 0 }, text);
+        sheet.SetCell(Position{ 0, 1 }, "=A1*2"s);
+        return sheet.GetCell(Position{ 0, 1 })->GetValue();
+    };
+
+    std::visit(CellValueChecker{ 25.0 }, evaluate("  12.5"s));
+    std::visit(CellValueChecker{ 6.0 }, evaluate("3abc"s));
+    std::visit(CellValueChecker{ -2000.0 }, evaluate("-1e3"s));
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Value) }, evaluate("abc"s));
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Value) }, evaluate("1e999"s));
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Value) }, evaluate("'7"s));
+    std::visit(CellValueChecker{ 0.0 }, evaluate(""s));
+
+    // the text of a numeric cell is kept as is
+    sheet.SetCell(Position{ 0, 0 }, "007"s);
+    std::visit(CellValueChecker{ "007"s }, sheet.GetCell(Position{ 0, 0 })->GetValue());
+    ASSERT_EQUAL(sheet.GetCell(Position{ 0, 0 })->GetText(), "007"s);
+}
+
+void TestCompactCellValue() {
+    using cell_detail::CellValue;
+
+    const std::string inline_text(CellValue::INLINE_TEXT_CAPACITY, 'x');
+    const std::string heap_text = inline_text + "y"s;
+    for (const std::string& text : { inline_text, heap_text, "'=1"s }) {
+        CellValue value = CellValue::MakeText(text);
+        CellValue moved(std::move(value));
+        ASSERT(value.GetType() == CellValue::Type::Empty);
+        ASSERT(moved.GetType() == CellValue::Type::Text);
+        ASSERT_EQUAL(moved.GetText(), text);
+        value = std::move(moved);
+        ASSERT_EQUAL(value.GetText(), text);
+    }
+
+    CellValue formula = CellValue::MakeFormula(ParseFormula("1/0"s, std::pmr::get_default_resource()));
+    ASSERT(!formula.HasNumericValue());
+    formula.SetNumericValue(formula.GetFormula().Evaluate(Sheet()));
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Div0) }, formula.GetNumericValue());
+    formula.SetState(CellValue::State::Dirty);
+    ASSERT(!formula.HasNumericValue());
+    ASSERT_EQUAL(formula.GetFormula().GetExpression(), "1/0"s);
+
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, heap_text);
+    sheet.SetCell(Position{ 0, 1 }, "'"s + inline_text);
+    std::visit(CellValueChecker{ heap_text }, sheet.GetCell(Position{ 0, 0 })->GetValue());
+    std::visit(CellValueChecker{ inline_text }, sheet.GetCell(Position{ 0, 1 })->GetValue());
+    ASSERT_EQUAL(sheet.GetCell(Position{ 0, 1 })->GetText(), "'"s + inline_text);
+}
+
+void TestFormulaProgram() {
+    auto execute = [](const std::string& expression) {
+        return ParseFormulaAST(expression).Execute([](Position pos) {
+            return static_cast<double>(pos.row + 1);
+        });
+    };
+
+    ASSERT_EQUAL(execute("1+2*3"s), 7.0);
+    ASSERT_EQUAL(execute("(A1+A2)*A3-A4/2"s), 7.0);
+    ASSERT_EQUAL(execute("-(+A3)--2"s), -1.0);
+    ASSERT_EQUAL(execute("A2/A1/A2"s), 1.0);
+
+    // deeper than the inline evaluation stack
+    std::string nested = "1"s;
+    for (int i = 0; i < 100; ++i) {
+        nested = "A1+("s + nested + ")"s;
+    }
+    ASSERT_EQUAL(execute(nested), 101.0);
+
+    ASSERT(GetErrorCategory(execute("A1/(A2-2)"s)) == FormulaError::Category::Div0);
+    ASSERT(!GetErrorCategory(execute("A1/A2"s)));
+
+    // the tree is still there for printing
+    std::ostringstream out;
+    ParseFormulaAST("+(A1+B2)*-3"s).PrintFormula(out);
+    ASSERT_EQUAL(out.str(), "+(A1+B2)*-3"s);
+}
+
+void TestErrorValues() {
+    using Category = FormulaError::Category;
+    for (Category category : { Category::Ref, Category::Value, Category::Div0 }) {
+        const double error = MakeErrorValue(category);
+        ASSERT(GetErrorCategory(error) == category);
+        ASSERT(GetErrorCategory(-error) == category);
+        ASSERT(GetErrorCategory(error * 2 + 1) == category);
+        ASSERT(GetErrorCategory(1 / error) == category);
+    }
+    // NaN из арифметики ошибкой не считается
+    const double infinity = 1e308 * 10;
+    ASSERT(!GetErrorCategory(infinity - infinity));
+    ASSERT(!GetErrorCategory(std::nan("")));
+    ASSERT(!GetErrorCategory(infinity));
+
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "x"s);
+    sheet.SetCell(Position{ 0, 1 }, "=A1/0"s);
+    sheet.SetCell(Position{ 0, 2 }, "=-B1*2"s);
+    sheet.SetCell(Position{ 0, 3 }, "=0/0"s);
+    sheet.SetCell(Position{ 0, 4 }, "=D1+1"s);
+    std::visit(CellValueChecker{ FormulaError(Category::Value) }, sheet.GetCell(Position{ 0, 1 })->GetValue());
+    std::visit(CellValueChecker{ FormulaError(Category::Value) }, sheet.GetCell(Position{ 0, 2 })->GetValue());
+    std::visit(CellValueChecker{ FormulaError(Category::Div0) }, sheet.GetCell(Position{ 0, 4 })->GetValue());
+    sheet.SetCell(Position{ 0, 0 }, "3"s);
+    std::visit(CellValueChecker{ FormulaError(Category::Div0) }, sheet.GetCell(Position{ 0, 2 })->GetValue());
+}
+
+void TestFormulaFolding() {
+    auto program_size = [](const std::string& expression) {
+        return ParseFormulaAST(expression).GetProgramSize();
+    };
+    auto execute = [](const std::string& expression) {
+        return ParseFormulaAST(expression).Execute([](Position pos) {
+            return pos.row == 0 ? -0.0 : static_cast<double>(pos.row + 1);
+        });
+    };
+
+    // константы сворачиваются, тождества выбрасываются
+    ASSERT_EQUAL(program_size("2*3*A2+0"s), 2u);
+    ASSERT_EQUAL(execute("2*3*A2+0"s), 12.0);
+    ASSERT_EQUAL(program_size("-(2-3)/4"s), 1u);
+    ASSERT_EQUAL(execute("-(2-3)/4"s), 0.25);
+    for (const std::string& expression : { "A2*1"s, "1*+A2"s, "A2-0"s, "--A2"s, "-(-(+A2))"s, "(A2+-0)*(3-2)"s }) {
+        ASSERT_EQUAL(program_size(expression), 1u);
+        ASSERT_EQUAL(execute(expression), 2.0);
+    }
+    ASSERT_EQUAL(program_size("1*(A2+A3)"s), 1u);
+    ASSERT_EQUAL(program_size("-(-(A2+A3))"s), 1u);
+    ASSERT_EQUAL(program_size("A1+(2*A2-0)"s), 3u);
+    ASSERT_EQUAL(execute("A1+(2*A2-0)"s), 4.0);
+
+    // x+0 для x = -0 даёт +0, поэтому не выбрасывается
+    ASSERT_EQUAL(program_size("A1+0"s), 1u);
+    ASSERT(!std::signbit(execute("A1+0"s)));
+    ASSERT(std::signbit(execute("A1*1"s)));
+    ASSERT(std::signbit(execute("-0"s)));
+
+    // деление, дающее ошибку, остаётся до вычисления
+    for (const std::string& expression : { "1/0"s, "1/(2-2)"s, "A3/(1-1)"s, "1e308*10/1"s }) {
+        ASSERT(GetErrorCategory(execute(expression)) == FormulaError::Category::Div0);
+    }
+
+    // текст формулы не меняется
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "=2*3*B1+0"s);
+    sheet.SetCell(Position{ 0, 1 }, "=+(--1)*(2)"s);
+    ASSERT_EQUAL(sheet.GetCell(Position{ 0, 0 })->GetText(), "=2*3*B1+0"s);
+    ASSERT_EQUAL(sheet.GetCell(Position{ 0, 1 })->GetText(), "=+--1*2"s);
+    std::visit(CellValueChecker{ 12.0 }, sheet.GetCell(Position{ 0, 0 })->GetValue());
+}
+
+// Результат разбора формулы: дерево и список ячеек либо вид ошибки.
+template <typename Parser>
+std::string DescribeParse(Parser parse, std::string_view expression) {
+    try {
+        const FormulaAST ast = parse(expression);
+        std::ostringstream out;
+        ast.Print(out);
+        out << " | "s;
+        ast.PrintCells(out);
+        return out.str();
+    }
+    catch (const ParsingError&) {
+        return "ParsingError"s;
+    }
+    catch (const FormulaError& error) {
+        return std::string(error.ToString());
+    }
+}
+
+std::string DescribeParse(std::string_view expression) {
+    return DescribeParse([](std::string_view text) {
+        return ParseFormulaAST(text);
+    }, expression);
+}
+
+void TestFormulaParser() {
+    ASSERT_EQUAL(DescribeParse("1+2*3"sv), "(+ 1 (* 2 3)) | "s);
+    ASSERT_EQUAL(DescribeParse("-2*3"sv), "(* (- 2) 3) | "s);
+    ASSERT_EQUAL(DescribeParse("1-2-3/4/5"sv), "(- (- 1 2) (/ (/ 3 4) 5)) | "s);
+    ASSERT_EQUAL(DescribeParse("+-(A1)"sv), "(+ (- A1)) | A1 "s);
+    ASSERT_EQUAL(DescribeParse(" \t(B2 +A1)\r\n"sv), "(+ B2 A1) | A1 B2 "s);
+    ASSERT_EQUAL(DescribeParse(".5E+2*1e-2"sv), "(* 50 0.01) | "s);
+    ASSERT_EQUAL(DescribeParse("1e-400"sv), "0 | "s);
+    ASSERT_EQUAL(DescribeParse("XFD16384"sv), "XFD16384 | XFD16384 "s);
+
+    ASSERT_EQUAL(DescribeParse("XFE1"sv), "#REF!"s);
+    ASSERT_EQUAL(DescribeParse("A1+ZZZZ1"sv), "#REF!"s);
+    // a syntax error wins over a reference error
+    ASSERT_EQUAL(DescribeParse("ZZZZ1+"sv), "ParsingError"s);
+
+    for (std::string_view invalid : { ""sv, " "sv, "1+"sv, "(1"sv, "1)"sv, "()"sv, "1 2"sv, "A"sv, "a1"sv,
+        "1."sv, "."sv, "1..2"sv, "A1B"sv, "1e"sv, "1e400"sv, "#"sv, "1**2"sv, "A1:B2"sv }) {
+        ASSERT_EQUAL(DescribeParse(invalid), "ParsingError"s);
+    }
+}
+
+void TestSharedFormulas() {
+    Sheet sheet;
+
+    // формулы, заполненные вниз по столбцу, разбираются один раз
+    for (int row = 0; row < 10; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+        sheet.SetCell(Position{ row, 1 }, "=A" + std::to_string(row + 1) + "*2+(A" + std::to_string(row + 1) + ")");
+    }
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 1u);
+    for (int row = 0; row < 10; ++row) {
+        const CellInterface* cell = sheet.GetCell(Position{ row, 1 });
+        std::visit(CellValueChecker{ 3.0 * row }, cell->GetValue());
+        ASSERT_EQUAL(cell->GetText(), "=A" + std::to_string(row + 1) + "*2+A" + std::to_string(row + 1));
+        ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector<Position>{ Position{ row, 0 } }));
+    }
+
+    // пробелы не влияют на ключ, а та же ссылка из другого столбца - влияет
+    sheet.SetCell(Position{ 9, 1 }, "= A10 * 2 + (A10)"s);
+    sheet.SetCell(Position{ 0, 2 }, "=A1*2+(A1)"s);
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 2u);
+    std::visit(CellValueChecker{ 27.0 }, sheet.GetCell(Position{ 9, 1 })->GetValue());
+    std::visit(CellValueChecker{ 0.0 }, sheet.GetCell(Position{ 0, 2 })->GetValue());
+
+    // замена формулы в одной ячейке не затрагивает остальные
+    sheet.SetCell(Position{ 5, 1 }, "=A6/0"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Div0) }, sheet.GetCell(Position{ 5, 1 })->GetValue());
+    std::visit(CellValueChecker{ 18.0 }, sheet.GetCell(Position{ 6, 1 })->GetValue());
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 3u);
+
+    // некорректные формулы не попадают в таблицу
+    ASSERT_THROWS(sheet.SetCell(Position{ 0, 3 }, "=A1+"s), FormulaException);
+    sheet.SetCell(Position{ 0, 3 }, "=A1+ZZZZ1"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Ref) }, sheet.GetCell(Position{ 0, 3 })->GetValue());
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 3u);
+
+    // формула удаляется вместе с последней ячейкой
+    sheet.ClearCell(Position{ 5, 1 });
+    sheet.ClearCell(Position{ 0, 2 });
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 1u);
+    for (int row = 0; row < 10; ++row) {
+        sheet.ClearCell(Position{ row, 1 });
+    }
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 0u);
+}
+
+void TestRangeFunctions() {
+    ASSERT_EQUAL(DescribeParse("SUM(A1:B2,3)"sv), "(SUM A1:B2 3) | "s);
+    ASSERT_EQUAL(DescribeParse("MAX(B2:A1)*-COUNT(C1)"sv), "(* (MAX A1:B2) (- (COUNT C1))) | C1 "s);
+    ASSERT_EQUAL(DescribeParse("AVERAGE( A1 : A3 , MIN(1+A2) )"sv), "(AVERAGE A1:A3 (MIN (+ 1 A2))) | A2 "s);
+    ASSERT_EQUAL(DescribeParse("SUM(A1:XFE1)"sv), "#REF!"s);
+    for (std::string_view invalid : { "SUM()"sv, "SUM(1"sv, "SUM 1"sv, "SUM(1,)"sv, "SUM(A1:B2+1)"sv,
+        "SUM(-A1:B2)"sv, "SUM(A1:)"sv, "SUM(:A1)"sv, "SUM((A1:B2))"sv, "FOO(1)"sv, "Sum(1)"sv, "A1:B2"sv }) {
+        ASSERT_EQUAL(DescribeParse(invalid), "ParsingError"s);
+    }
+
+    // константные аргументы сворачиваются
+    ASSERT_EQUAL(ParseFormulaAST("SUM(1,2)+MAX(3,-4)"sv).GetProgramSize(), 1u);
+    ASSERT_EQUAL(ParseFormula("MAX(A1:B2,C3)*2"s)->GetExpression(), "MAX(A1:B2,C3)*2"s);
+
+    Sheet sheet;
+    sheet.SetCell(Position{ 0, 0 }, "1"s);
+    sheet.SetCell(Position{ 1, 0 }, "2"s);
+    sheet.SetCell(Position{ 2, 0 }, "abc"s);
+    sheet.SetCell(Position{ 4, 0 }, "=A1*10"s);
+
+    const std::vector<std::string> functions = { "SUM"s, "AVERAGE"s, "MIN"s, "MAX"s, "COUNT"s };
+    for (int col = 0; col < 5; ++col) {
+        sheet.SetCell(Position{ 0, col + 2 }, "=" + functions[col] + "(A1:A5)");
+    }
+    auto check = [&sheet](std::vector<CellInterface::Value> expected) {
+        for (int col = 0; col < 5; ++col) {
+            std::visit(CellValueChecker{ expected[col] }, sheet.GetCell(Position{ 0, col + 2 })->GetValue());
+        }
+    };
+    // пустые ячейки и текст пропускаются
+    check({ 13.0, 13.0 / 3, 1.0, 10.0, 3.0 });
+    ASSERT_EQUAL(sheet.GetCell(Position{ 0, 2 })->GetText(), "=SUM(A1:A5)"s);
+    ASSERT(sheet.GetCell(Position{ 0, 2 })->GetReferencedCells().empty());
+
+    // новая ячейка диапазона, формула в нём и ошибка
+    sheet.SetCell(Position{ 3, 0 }, "=1/0"s);
+    const FormulaError div0(FormulaError::Category::Div0);
+    check({ div0, div0, div0, div0, 3.0 });
+    sheet.SetCell(Position{ 3, 0 }, "-5"s);
+    check({ 8.0, 2.0, -5.0, 10.0, 4.0 });
+    sheet.SetCell(Position{ 0, 0 }, "3"s);
+    check({ 30.0, 7.5, -5.0, 30.0, 4.0 });
+    sheet.ClearCell(Position{ 1, 0 });
+    ASSERT(sheet.GetCell(Position{ 1, 0 }) == nullptr);
+    check({ 28.0, 28.0 / 3, -5.0, 30.0, 3.0 });
+
+    // отдельная ячейка читается как диапазон из неё одной, остальные
+    // аргументы вычисляются как обычно
+    sheet.SetCell(Position{ 1, 2 }, "=COUNT(A2,A3:A4,7)+SUM(A1:A1,A5:A5)*MIN(B1:B9)"s);
+    std::visit(CellValueChecker{ 2.0 }, sheet.GetCell(Position{ 1, 2 })->GetValue());
+    sheet.SetCell(Position{ 1, 2 }, "=COUNT(A2+0,A3:A4,7)"s);
+    std::visit(CellValueChecker{ 3.0 }, sheet.GetCell(Position{ 1, 2 })->GetValue());
+    sheet.SetCell(Position{ 1, 2 }, "=AVERAGE(B1:B9)"s);
+    std::visit(CellValueChecker{ div0 }, sheet.GetCell(Position{ 1, 2 })->GetValue());
+
+    // диапазон, который содержит ячейку формулы, и циклы через диапазоны
+    ASSERT_THROWS(sheet.SetCell(Position{ 2, 2 }, "=SUM(A1:C3)"s), CircularDependencyException);
+    ASSERT_THROWS(sheet.SetCell(Position{ 1, 0 }, "=C1"s), CircularDependencyException);
+    sheet.SetCell(Position{ 5, 1 }, "=C1"s);
+    ASSERT_THROWS(sheet.SetCell(Position{ 2, 0 }, "=B6+1"s), CircularDependencyException);
+    check({ 28.0, 28.0 / 3, -5.0, 30.0, 3.0 });
+
+    // скользящие суммы заполнены вниз и разделяют одну формулу
+    for (int row = 0; row < 10; ++row) {
+        sheet.SetCell(Position{ row, 8 }, std::to_string(row));
+        sheet.SetCell(Position{ row, 9 }, "=SUM(I" + std::to_string(row + 1) + ":I" + std::to_string(row + 3) + ")");
+    }
+    const size_t shared_formulas = sheet.GetSharedFormulaCount();
+    sheet.SetCell(Position{ 10, 9 }, "=SUM(I11:I13)"s);
+    ASSERT_EQUAL(sheet.GetSharedFormulaCount(), shared_formulas);
+    for (int row = 0; row < 10; ++row) {
+        const double expected = row + (row + 1 < 10 ? row + 1 : 0) + (row + 2 < 10 ? row + 2 : 0);
+        std::visit(CellValueChecker{ expected }, sheet.GetCell(Position{ row, 9 })->GetValue());
+    }
+    ASSERT_EQUAL(sheet.GetCell(Position{ 4, 9 })->GetText(), "=SUM(I5:I7)"s);
+
+    sheet.SetCell(Position{ 0, 5 }, "=SUM(A1:XFE1)"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Ref) }, sheet.GetCell(Position{ 0, 5 })->GetValue());
+
+    // столбцы перестают отслеживаться вместе с последним диапазоном
+    ASSERT_EQUAL(sheet.GetColumnValues().GetTrackedColumnCount(), 3u);
+    for (int row = 0; row <= 10; ++row) {
+        sheet.ClearCell(Position{ row, 9 });
+    }
+    for (int col = 2; col < 7; ++col) {
+        sheet.ClearCell(Position{ 0, col });
+        sheet.ClearCell(Position{ 1, col });
+    }
+    ASSERT_EQUAL(sheet.GetColumnValues().GetTrackedColumnCount(), 0u);
+
+    // отдельная ячейка и диапазон из неё одной дают одно и то же
+    Sheet cells;
+    cells.SetCell(Position{ 0, 3 }, "abc"s);
+    cells.SetCell(Position{ 6, 2 }, "4"s);
+    cells.ClearCell(Position{ 6, 2 });
+    const std::vector<std::pair<std::string, CellInterface::Value>> pairs = {
+        { "COUNT(C5"s, 0.0 },
+        { "AVERAGE(C7"s, div0 },
+        { "SUM(D1"s, 0.0 },
+    };
+    for (const auto& [call, expected] : pairs) {
+        const std::string cell = call.substr(call.find('(') + 1);
+        cells.SetCell(Position{ 0, 0 }, "="s + call + ")"s);
+        cells.SetCell(Position{ 1, 0 }, "="s + call + ":"s + cell + ")"s);
+        std::visit(CellValueChecker{ expected }, cells.GetCell(Position{ 0, 0 })->GetValue());
+        std::visit(CellValueChecker{ expected }, cells.GetCell(Position{ 1, 0 })->GetValue());
+    }
+}
+
+// Длинные диапазоны читаются из индекса столбца, который строится при первом
+// чтении и обновляется после изменения ячеек.
+void TestColumnIndex() {
+    Sheet sheet;
+    constexpr int ROWS = 3000;
+    for (int r = 0; r < ROWS; ++r) {
+        sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+    }
+    sheet.SetCell(Position{ 0, 1 }, "=SUM(A1:A100)"s);
+    std::visit(CellValueChecker{ 4950.0 }, sheet.GetCell(Position{ 0, 1 })->GetValue());
+    ASSERT_EQUAL(sheet.GetColumnValues().GetIndexedColumnCount(), 0u);
+
+    sheet.SetCell(Position{ 1, 1 }, "=SUM(A1:A3000)"s);
+    sheet.SetCell(Position{ 2, 1 }, "=MIN(A2:A2999)"s);
+    sheet.SetCell(Position{ 3, 1 }, "=MAX(A2:A2999)"s);
+    sheet.SetCell(Position{ 4, 1 }, "=COUNT(A1:A3000)"s);
+    auto check = [&sheet](std::vector<CellInterface::Value> expected) {
+        for (int row = 1; row <= 4; ++row) {
+            std::visit(CellValueChecker{ expected[row - 1] }, sheet.GetCell(Position{ row, 1 })->GetValue());
+        }
+    };
+    check({ 4498500.0, 1.0, 2998.0, 3000.0 });
+    ASSERT_EQUAL(sheet.GetColumnValues().GetIndexedColumnCount(), 1u);
+
+    sheet.SetCell(Position{ 1000, 0 }, "-5"s);
+    check({ 4497495.0, -5.0, 2998.0, 3000.0 });
+    sheet.SetCell(Position{ 1500, 0 }, "=A1001*1000"s);
+    check({ 4490995.0, -5000.0, 2998.0, 3000.0 });
+    sheet.SetCell(Position{ 2000, 0 }, "text"s);
+    sheet.SetCell(Position{ 2500, 0 }, "=1/0"s);
+    const FormulaError div0(FormulaError::Category::Div0);
+    check({ div0, div0, div0, 2998.0 });
+    sheet.ClearCell(Position{ 2500, 0 });
+    check({ 4486495.0, -5000.0, 2998.0, 2998.0 });
+    // формула в диапазоне пересчитывается вслед за своей ячейкой
+    sheet.SetCell(Position{ 1000, 0 }, "5"s);
+    check({ 4496505.0, 1.0, 5000.0, 2998.0 });
+}
+
+// Связи графа снимаются в произвольном порядке, списки переносятся и
+// сжимаются, а остальные связи остаются на месте.
+void TestDependencyGraph() {
+    DependencyGraph graph;
+    constexpr int FORMULAS = 3000;
+    const DependencyGraph::NodeId a = graph.AddNode(nullptr);
+    const DependencyGraph::NodeId b = graph.AddNode(nullptr);
+    std::vector<DependencyGraph::NodeId> formulas;
+    for (int i = 0; i < FORMULAS; ++i) {
+        formulas.push_back(graph.AddNode(nullptr));
+        // формула ссылается на предыдущую, у каждой второй первой идёт b
+        std::vector<DependencyGraph::NodeId> precedents = { a };
+        if (i % 2 == 1) {
+            precedents.insert(precedents.begin(), b);
+        }
+        if (i > 0) {
+            precedents.push_back(formulas[i - 1]);
+        }
+        graph.SetPrecedents(formulas.back(), precedents.begin(), precedents.end());
+    }
+    ASSERT_EQUAL(graph.GetNodeCount(), FORMULAS + 2u);
+    ASSERT_EQUAL(graph.GetEdgeCount(), FORMULAS + FORMULAS / 2 + FORMULAS - 1u);
+    ASSERT_EQUAL(graph.GetDependentCount(a), static_cast<size_t>(FORMULAS));
+    ASSERT_EQUAL(graph.GetDependentCount(b), FORMULAS / 2u);
+
+    std::vector<DependencyGraph::NodeId> precedents;
+    graph.ForEachPrecedent(formulas[5], [&precedents](DependencyGraph::NodeId node) {
+        precedents.push_back(node);
+    });
+    ASSERT_EQUAL(precedents, (std::vector<DependencyGraph::NodeId>{ b, a, formulas[4] }));
+
+    auto dependents_of = [&graph](DependencyGraph::NodeId node) {
+        std::vector<DependencyGraph::NodeId> dependents;
+        graph.ForEachDependent(node, [&dependents](DependencyGraph::NodeId dependent) {
+            dependents.push_back(dependent);
+        });
+        std::sort(dependents.begin(), dependents.end());
+        return dependents;
+    };
+
+    // снимаются связи двух третей формул вперемешку
+    std::mt19937 generator(14);
+    std::vector<int> order(FORMULAS);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), generator);
+    std::vector<bool> is_bound(FORMULAS, true);
+    for (int i = 0; i < FORMULAS * 2 / 3; ++i) {
+        graph.ClearPrecedents(formulas[order[i]]);
+        is_bound[order[i]] = false;
+    }
+    std::vector<DependencyGraph::NodeId> expected_a;
+    std::vector<DependencyGraph::NodeId> expected_b;
+    size_t edges = 0;
+    for (int i = 0; i < FORMULAS; ++i) {
+        if (is_bound[i]) {
+            expected_a.push_back(formulas[i]);
+            if (i % 2 == 1) {
+                expected_b.push_back(formulas[i]);
+            }
+            edges += 1 + (i % 2) + (i > 0);
+        }
+    }
+    ASSERT_EQUAL(dependents_of(a), expected_a);
+    ASSERT_EQUAL(dependents_of(b), expected_b);
+    ASSERT_EQUAL(graph.GetEdgeCount(), edges);
+    for (int i = 0; i + 1 < FORMULAS; ++i) {
+        ASSERT_EQUAL(graph.GetDependentCount(formulas[i]), is_bound[i + 1] ? 1u : 0u);
+    }
+
+    // номера удалённых узлов достаются новым
+    for (int i = 0; i < FORMULAS; ++i) {
+        if (!is_bound[i] && graph.GetDependentCount(formulas[i]) == 0) {
+            graph.RemoveNode(formulas[i]);
+            const DependencyGraph::NodeId node = graph.AddNode(nullptr);
+            ASSERT_EQUAL(node, formulas[i]);
+            graph.SetPrecedents(node, &b, &b + 1);
+        }
+    }
+    for (DependencyGraph::NodeId node : formulas) {
+        graph.ClearPrecedents(node);
+    }
+    ASSERT_EQUAL(graph.GetEdgeCount(), 0u);
+    ASSERT_EQUAL(graph.GetDependentCount(a), 0u);
+    ASSERT_EQUAL(graph.GetDependentCount(b), 0u);
+
+    graph.StartVisit();
+    ASSERT(graph.Visit(a));
+    ASSERT(!graph.Visit(a));
+    graph.StartVisit();
+    ASSERT(graph.Visit(a));
+}
+
+// Ячейка, на которую ссылается много формул, и формула, которая ссылается на
+// много ячеек.
+void TestSheetDependencyGraph() {
+    Sheet sheet;
+    constexpr int ROWS = 2000;
+    for (int r = 0; r < ROWS; ++r) {
+        sheet.SetCell(Position{ r, 1 }, "=A1+"s + std::to_string(r));
+    }
+    std::string sum = "=B1"s;
+    for (int r = 1; r < ROWS; ++r) {
+        sum += "+B"s + std::to_string(r + 1);
+    }
+    sheet.SetCell(Position{ 0, 2 }, sum);
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    ASSERT_EQUAL(graph.GetNodeCount(), ROWS + 2u);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 2u * ROWS);
+    std::visit(CellValueChecker{ ROWS * (ROWS - 1) / 2.0 }, sheet.GetCell(Position{ 0, 2 })->GetValue());
+
+    sheet.SetCell(Position{ 0, 0 }, "1"s);
+    std::visit(CellValueChecker{ ROWS * (ROWS + 1) / 2.0 }, sheet.GetCell(Position{ 0, 2 })->GetValue());
+    // ячейки, от которых формула зависит, в том числе через другие формулы
+    const std::vector<Position> referenced = sheet.GetCell(Position{ 0, 2 })->GetReferencedCells();
+    ASSERT_EQUAL(referenced.size(), ROWS + 1u);
+    ASSERT_EQUAL(referenced[0], (Position{ 0, 1 }));
+    ASSERT_EQUAL(referenced[1], (Position{ 0, 0 }));
+
+    ASSERT_THROWS(sheet.SetCell(Position{ 0, 0 }, "=C1"s), CircularDependencyException);
+    ASSERT_THROWS(sheet.SetCell(Position{ 0, 0 }, "=B"s + std::to_string(ROWS)), CircularDependencyException);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 2u * ROWS);
+
+    for (int r = 0; r < ROWS; r += 2) {
+        sheet.ClearCell(Position{ r, 1 });
+    }
+    ASSERT_EQUAL(graph.GetEdgeCount(), ROWS + ROWS / 2u);
+    sheet.SetCell(Position{ 0, 0 }, "2"s);
+    std::visit(CellValueChecker{ (ROWS / 2.0) * (ROWS / 2.0) + ROWS }, sheet.GetCell(Position{ 0, 2 })->GetValue());
+
+    sheet.ClearCell(Position{ 0, 2 });
+    for (int r = 0; r < ROWS; ++r) {
+        sheet.ClearCell(Position{ r, 1 });
+    }
+    sheet.ClearCell(Position{ 0, 0 });
+    ASSERT_EQUAL(graph.GetNodeCount(), 0u);
+    ASSERT_EQUAL(graph.GetEdgeCount(), 0u);
+}
+
+// Случайные изменения листа: цикл находится тогда же, когда его находит
+// обход всех ссылок, а ячейки, от которых зависит формула, всегда идут в
+// порядке графа раньше неё.
+void TestTopologicalOrder() {
+    constexpr int SIZE = 6;
+    Sheet sheet;
+    std::mt19937 generator(15);
+    auto random_index = [&generator](int size) {
+        return std::uniform_int_distribution<int>(0, size - 1)(generator);
+    };
+    auto random_pos = [&random_index]() {
+        return Position{ random_index(SIZE), random_index(SIZE) };
+    };
+    auto formula_of = [&sheet](Position pos) -> std::unique_ptr<FormulaInterface> {
+        const CellInterface* cell = sheet.GetCell(pos);
+        if (!cell || cell->GetText().size() < 2 || cell->GetText()[0] != FORMULA_SIGN) {
+            return nullptr;
+        }
+        return ParseFormula(cell->GetText().substr(1));
+    };
+    auto for_each_cell = [](const Range& range, auto func) {
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                func(Position{ row, col });
+            }
+        }
+    };
+    // достижима ли pos из ячеек, на которые ссылается formula
+    auto reaches = [&](const FormulaInterface& formula, Position pos) {
+        std::vector<Position> stack;
+        std::set<Position> visited;
+        auto push_references = [&](const FormulaInterface& formula) {
+            for (Position cell : formula.GetReferencedCells()) {
+                stack.push_back(cell);
+            }
+            for (const Range& range : formula.GetReferencedRanges()) {
+                for_each_cell(range, [&stack](Position cell) {
+                    stack.push_back(cell);
+                });
+            }
+        };
+        push_references(formula);
+        while (!stack.empty()) {
+            const Position current = stack.back();
+            stack.pop_back();
+            if (current == pos) {
+                return true;
+            }
+            if (visited.insert(current).second) {
+                if (auto next = formula_of(current)) {
+                    push_references(*next);
+                }
+            }
+        }
+        return false;
+    };
+    const DependencyGraph& graph = sheet.GetDependencyGraph();
+    auto order_of = [&sheet, &graph](Position pos) {
+        return graph.GetOrder(static_cast<const Cell*>(sheet.GetCell(pos))->GetNode());
+    };
+
+    size_t cycles = 0;
+    for (int step = 0; step < 3000; ++step) {
+        const Position pos = random_pos();
+        std::string text;
+        switch (random_index(8)) {
+        case 0:
+            sheet.ClearCell(pos);
+            break;
+        case 1:
+        case 2:
+            text = std::to_string(random_index(10));
+            break;
+        case 3:
+            text = "=SUM("s + Range{ random_pos(), random_pos() }.ToString() + ")+"s + random_pos().ToString();
+            break;
+        default:
+            text = "="s + random_pos().ToString();
+            for (int i = random_index(3); i > 0; --i) {
+                text += "+"s + random_pos().ToString();
+            }
+        }
+        if (text.empty()) {
+            continue;
+        }
+        if (text[0] == FORMULA_SIGN) {
+            // диапазон задаётся углами в любом порядке
+            const auto formula = ParseFormula(text.substr(1));
+            text = "="s + formula->GetExpression();
+            if (reaches(*formula, pos)) {
+                const std::string old_text = sheet.GetCell(pos) ? sheet.GetCell(pos)->GetText() : ""s;
+                ASSERT_THROWS(sheet.SetCell(pos, text), CircularDependencyException);
+                ASSERT_EQUAL(sheet.GetCell(pos)->GetText(), old_text);
+                ++cycles;
+                continue;
+            }
+        }
+        sheet.SetCell(pos, text);
+
+        for (int row = 0; row < SIZE; ++row) {
+            for (int col = 0; col < SIZE; ++col) {
+                const auto formula = formula_of(Position{ row, col });
+                if (!formula) {
+                    continue;
+                }
+                const uint32_t order = order_of(Position{ row, col });
+                for (Position cell : formula->GetReferencedCells()) {
+                    ASSERT(order_of(cell) < order);
+                }
+                for (const Range& range : formula->GetReferencedRanges()) {
+                    for_each_cell(range, [&](Position cell) {
+                        if (formula_of(cell)) {
+                            ASSERT(order_of(cell) < order);
+                        }
+                    });
+                }
+            }
+        }
+    }
+    ASSERT(cycles > 100);
+}
+
+// Лист с немедленным пересчётом после каждого изменения не содержит
+// невычисленных формул, и его значения совпадают со значениями листа с
+// ленивым пересчётом.
+void TestEagerRecalculation() {
+    constexpr int SIZE = 6;
+    Sheet lazy;
+    Sheet eager;
+    eager.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    std::mt19937 generator(16);
+    auto random_index = [&generator](int size) {
+        return std::uniform_int_distribution<int>(0, size - 1)(generator);
+    };
+    auto random_pos = [&random_index]() {
+        return Position{ random_index(SIZE), random_index(SIZE) };
+    };
+    auto has_dirty_cells = [](const Sheet& sheet) {
+        for (int row = 0; row < SIZE; ++row) {
+            for (int col = 0; col < SIZE; ++col) {
+                const auto* cell = static_cast<const Cell*>(sheet.GetCell(Position{ row, col }));
+                if (cell && cell->IsDirty()) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 2000; ++step) {
+        const Position pos = random_pos();
+        std::string text;
+        switch (random_index(8)) {
+        case 0:
+            lazy.ClearCell(pos);
+            eager.ClearCell(pos);
+            break;
+        case 1:
+            text = std::to_string(random_index(10));
+            break;
+        case 2:
+            text = "=1/"s + std::to_string(random_index(2));
+            break;
+        case 3:
+            text = "=SUM("s + Range{ random_pos(), random_pos() }.ToString() + ")+"s + random_pos().ToString();
+            break;
+        default:
+            text = "="s + random_pos().ToString() + "+"s + random_pos().ToString();
+        }
+        if (!text.empty()) {
+            bool is_cycle = false;
+            try {
+                lazy.SetCell(pos, text);
+            }
+            catch (const CircularDependencyException&) {
+                is_cycle = true;
+            }
+            if (is_cycle) {
+                ASSERT_THROWS(eager.SetCell(pos, text), CircularDependencyException);
+            }
+            else {
+                eager.SetCell(pos, text);
+            }
+        }
+
+        ASSERT(!has_dirty_cells(eager));
+        for (int row = 0; row < SIZE; ++row) {
+            for (int col = 0; col < SIZE; ++col) {
+                const CellInterface* lazy_cell = lazy.GetCell(Position{ row, col });
+                const CellInterface* eager_cell = eager.GetCell(Position{ row, col });
+                ASSERT_EQUAL(lazy_cell == nullptr, eager_cell == nullptr);
+                if (lazy_cell) {
+                    ASSERT(lazy_cell->GetValue() == eager_cell->GetValue());
+                }
+            }
+        }
+    }
+
+    // при переходе к немедленному пересчёту вычисляются все формулы
+    lazy.SetCell(Position{ 0, 0 }, "=1+2"s);
+    ASSERT(has_dirty_cells(lazy));
+    lazy.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    ASSERT(!has_dirty_cells(lazy));
+
+    // изменение начала длинной цепочки пересчитывает её один раз
+    Sheet chain;
+    chain.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    constexpr int ROWS = 10000;
+    chain.SetCell(Position{ 0, 0 }, "1"s);
+    for (int r = 1; r < ROWS; ++r) {
+        chain.SetCell(Position{ r, 0 }, "=A"s + std::to_string(r) + "+1"s);
+    }
+    chain.SetCell(Position{ ROWS - 1, 1 }, "=A"s + std::to_string(ROWS) + "*2"s);
+    chain.SetCell(Position{ 0, 0 }, "2"s);
+    ASSERT(static_cast<const Cell*>(chain.GetCell(Position{ ROWS - 1, 1 }))->IsCacheValie());
+    ASSERT(chain.GetCell(Position{ ROWS - 1, 1 })->GetValue() == CellInterface::Value(2.0 * (ROWS + 1)));
+}
+
+// Формулы, все ячейки которых сохранили прежние значения, не пересчитываются.
+void TestEarlyCutoff() {
+    Sheet sheet;
+    const Position a1 = Position::FromString("A1"sv);
+    const Position a2 = Position::FromString("A2"sv);
+    const Position a3 = Position::FromString("A3"sv);
+    const Position b1 = Position::FromString("B1"sv);
+    const Position c1 = Position::FromString("C1"sv);
+    const Position c2 = Position::FromString("C2"sv);
+    const Position c3 = Position::FromString("C3"sv);
+    sheet.SetCell(a1, "1"s);
+    sheet.SetCell(a2, "100"s);
+    sheet.SetCell(a3, "x"s);
+    sheet.SetCell(b1, "=MAX(A1:A2)"s);
+    sheet.SetCell(c1, "=B1+1"s);
+    sheet.SetCell(c2, "=C1*2"s);
+    sheet.SetCell(c3, "=C2+A3"s);
+    std::visit(CellValueChecker{ 202.0 }, sheet.GetCell(c2)->GetValue());
+
+    // то же число и текст, который не является числом, ничего не сбрасывают
+    sheet.SetCell(a1, "1.0"s);
+    sheet.SetCell(a3, "y"s);
+    CheckCache(true, b1, sheet);
+    CheckCache(true, c2, sheet);
+    CheckCache(false, c3, sheet);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Value) }, sheet.GetCell(c3)->GetValue());
+    sheet.SetCell(a3, "z"s);
+    CheckCache(true, c3, sheet);
+
+    // MAX поглощает изменение
+    sheet.SetCell(a1, "2"s);
+    CheckCache(false, b1, sheet);
+    CheckCache(false, c1, sheet);
+    CheckCache(false, c2, sheet);
+    std::visit(CellValueChecker{ 100.0 }, sheet.GetCell(b1)->GetValue());
+    CheckCache(false, c2, sheet);
+    std::visit(CellValueChecker{ 202.0 }, sheet.GetCell(c2)->GetValue());
+    CheckCache(true, c1, sheet);
+
+    // другая формула с тем же значением
+    sheet.SetCell(b1, "=A2"s);
+    CheckCache(false, c2, sheet);
+    std::visit(CellValueChecker{ 202.0 }, sheet.GetCell(c2)->GetValue());
+
+    // изменение, которое дошло до конца цепочки
+    sheet.SetCell(a2, "50"s);
+    std::visit(CellValueChecker{ 102.0 }, sheet.GetCell(c2)->GetValue());
+    sheet.SetCell(b1, "=1/0"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Div0) }, sheet.GetCell(c2)->GetValue());
+    sheet.SetCell(b1, "=A3"s);
+    std::visit(CellValueChecker{ FormulaError(FormulaError::Category::Value) }, sheet.GetCell(c2)->GetValue());
+
+    // пустая ячейка и текст "0" одинаковы для ссылки, но не для диапазона
+    sheet.SetCell(b1, "=A4+COUNT(A4:A4)"s);
+    std::visit(CellValueChecker{ 2.0 }, sheet.GetCell(c2)->GetValue());
+    sheet.SetCell(Position::FromString("A4"sv), "0"s);
+    std::visit(CellValueChecker{ 4.0 }, sheet.GetCell(c2)->GetValue());
+    sheet.ClearCell(Position::FromString("A4"sv));
+    std::visit(CellValueChecker{ 2.0 }, sheet.GetCell(c2)->GetValue());
+
+    // при немедленном и параллельном пересчёте значения те же
+    for (size_t threads : { 1u, 4u }) {
+        Sheet eager;
+        eager.SetThreadCount(threads);
+        eager.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+        constexpr int ROWS = 1000;
+        eager.SetCell(a1, "1"s);
+        eager.SetCell(a2, "100"s);
+        for (int row = 0; row < ROWS; ++row) {
+            eager.SetCell(Position{ row, 1 }, "=MAX(A1:A2)+"s + std::to_string(row));
+            eager.SetCell(Position{ row, 2 }, "=B"s + std::to_string(row + 1) + "*2"s);
+        }
+        for (const std::string& text : { "2"s, "100"s, "300"s, "=A2"s, "=A2+0"s, "-5"s }) {
+            eager.SetCell(a1, text);
+            const double max = text == "300"s ? 300.0 : 100.0;
+            for (int row = 0; row < ROWS; ++row) {
+                const auto* cell = static_cast<const Cell*>(eager.GetCell(Position{ row, 2 }));
+                ASSERT(cell->IsCacheValie());
+                std::visit(CellValueChecker{ (max + row) * 2 }, cell->GetValue());
+            }
+        }
+    }
+}
+
+// Изменения пакета применяются разом, а при ошибке лист остаётся прежним.
+void TestBatchUpdate() {
+    const auto pos = [](std::string_view str) {
+        return Position::FromString(str);
+    };
+    Sheet sheet;
+    sheet.SetCell(pos("A1"sv), "1"s);
+    sheet.SetCell(pos("B1"sv), "=A1+1"s);
+    sheet.SetCell(pos("C1"sv), "=B1*2"s);
+    std::visit(CellValueChecker{ 4.0 }, sheet.GetCell(pos("C1"sv))->GetValue());
+    const auto print = [&sheet]() {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    // изменения видны только после применения, последнее изменение ячейки
+    // отменяет предыдущие
+    sheet.BeginBatch();
+    ASSERT(sheet.IsInBatch());
+    sheet.SetCell(pos("A1"sv), "5"s);
+    sheet.SetCell(pos("A1"sv), "2"s);
+    sheet.SetCell(pos("D1"sv), "=C1+A2"s);
+    sheet.SetCell(pos("F1"sv), "x"s);
+    sheet.ClearCell(pos("F1"sv));
+    sheet.ClearCell(pos("E1"sv));
+    ASSERT_THROWS(sheet.SetCell(Position{ -1, 0 }, "1"s), InvalidPositionException);
+    ASSERT(sheet.GetCell(pos("D1"sv)) == nullptr);
+    std::visit(CellValueChecker{ 4.0 }, sheet.GetCell(pos("C1"sv))->GetValue());
+    sheet.CommitBatch();
+    ASSERT(!sheet.IsInBatch());
+    std::visit(CellValueChecker{ 6.0 }, sheet.GetCell(pos("D1"sv))->GetValue());
+    ASSERT(sheet.GetCell(pos("A2"sv)) != nullptr);
+    ASSERT(sheet.GetCell(pos("F1"sv)) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 4 }));
+
+    // цикл ищется только в итоговом листе
+    sheet.BeginBatch();
+    sheet.SetCell(pos("A1"sv), "=B1"s);
+    sheet.SetCell(pos("B1"sv), "7"s);
+    sheet.SetCell(pos("A3"sv), "=A1"s);
+    sheet.SetCell(pos("E1"sv), "=SUM(A1:A3)"s);
+    sheet.CommitBatch();
+    std::visit(CellValueChecker{ 14.0 }, sheet.GetCell(pos("D1"sv))->GetValue());
+    std::visit(CellValueChecker{ 14.0 }, sheet.GetCell(pos("E1"sv))->GetValue());
+
+    // при ошибке лист не меняется, а созданные пакетом ячейки удаляются
+    const std::string before = print();
+    CheckCache(true, pos("D1"sv), sheet);
+    for (const std::string& failing : { "=B2"s, "=SUM(B2:B3)"s, "=1+"s }) {
+        sheet.BeginBatch();
+        sheet.SetCell(pos("A1"sv), "=3"s);
+        sheet.SetCell(pos("G1"sv), "=Z9+1"s);
+        sheet.ClearCell(pos("D1"sv));
+        sheet.SetCell(pos("B2"sv), "=B1"s);
+        sheet.SetCell(pos("B1"sv), failing);
+        if (failing == "=1+"s) {
+            ASSERT_THROWS(sheet.CommitBatch(), FormulaException);
+        }
+        else {
+            ASSERT_THROWS(sheet.CommitBatch(), CircularDependencyException);
+        }
+        ASSERT(!sheet.IsInBatch());
+        ASSERT(sheet.GetCell(pos("G1"sv)) == nullptr);
+        ASSERT(sheet.GetCell(pos("Z9"sv)) == nullptr);
+        ASSERT(sheet.GetCell(pos("B2"sv)) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 5 }));
+        CheckCache(true, pos("D1"sv), sheet);
+        ASSERT_EQUAL(print(), before);
+    }
+
+    // отменённый пакет ничего не меняет
+    sheet.BeginBatch();
+    sheet.SetCell(pos("A1"sv), "100"s);
+    sheet.CancelBatch();
+    ASSERT(!sheet.IsInBatch());
+    ASSERT_EQUAL(print(), before);
+
+    // пакет без формул применяется так же, в том числе не по порядку ячеек
+    sheet.BeginBatch();
+    sheet.SetCell(pos("H2"sv), "b"s);
+    sheet.SetCell(pos("H1"sv), "a"s);
+    sheet.SetCell(pos("H2"sv), "c"s);
+    sheet.CommitBatch();
+    ASSERT_EQUAL(sheet.GetCell(pos("H1"sv))->GetText(), "a"s);
+    ASSERT_EQUAL(sheet.GetCell(pos("H2"sv))->GetText(), "c"s);
+    sheet.BeginBatch();
+    sheet.ClearCell(pos("H2"sv));
+    sheet.ClearCell(pos("H1"sv));
+    sheet.ClearCell(pos("A2"sv));
+    sheet.CommitBatch();
+    ASSERT(sheet.GetCell(pos("H1"sv)) == nullptr);
+    ASSERT(sheet.GetCell(pos("A2"sv)) != nullptr);
+    ASSERT_EQUAL(print(), before);
+
+    // при немедленном пересчёте формулы пересчитываются при применении
+    sheet.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    sheet.BeginBatch();
+    for (int row = 10; row < 1000; ++row) {
+        sheet.SetCell(Position{ row, 0 }, "="s + Position{ row - 1, 0 }.ToString() + "+1"s);
+    }
+    sheet.SetCell(Position{ 9, 0 }, "1"s);
+    sheet.SetCell(pos("B1"sv), "8"s);
+    sheet.CommitBatch();
+    const auto* last = static_cast<const Cell*>(sheet.GetCell(Position{ 999, 0 }));
+    ASSERT(!last->IsDirty());
+    std::visit(CellValueChecker{ 991.0 }, last->GetValue());
+    std::visit(CellValueChecker{ 16.0 }, sheet.GetCell(pos("D1"sv))->GetValue());
+
+    // пакет, который не открыт или уже открыт, - ошибка, а не повтор
+    // прежнего пакета и не потеря изменений
+    sheet.BeginBatch();
+    sheet.SetCell(pos("H1"sv), "1"s);
+    sheet.CommitBatch();
+    sheet.SetCell(pos("H1"sv), "2"s);
+    ASSERT_THROWS(sheet.CommitBatch(), std::logic_error);
+    ASSERT_THROWS(sheet.CancelBatch(), std::logic_error);
+    ASSERT_EQUAL(sheet.GetCell(pos("H1"sv))->GetText(), "2"s);
+    sheet.BeginBatch();
+    sheet.SetCell(pos("H1"sv), "3"s);
+    ASSERT_THROWS(sheet.BeginBatch(), std::logic_error);
+    ASSERT(sheet.IsInBatch());
+    sheet.CommitBatch();
+    ASSERT_EQUAL(sheet.GetCell(pos("H1"sv))->GetText(), "3"s);
+}
+
+// Цепочки глубже стека потока: вычисление, сброс кэша, список ячеек и
+// поиск цикла обходят их без рекурсии.
+void TestDeepChains() {
+    constexpr int LENGTH = 100000;
+    constexpr int ROWS = 10000;
+    constexpr int LAST_RANGE_LINK = LENGTH / 2;
+    // звено i цепочки; цепочка переходит из столбца в столбец
+    auto link = [](int i) {
+        return Position{ i % ROWS, i / ROWS };
+    };
+    Sheet sheet;
+    sheet.SetCell(link(0), "1"s);
+    for (int i = 1; i < LENGTH; ++i) {
+        const std::string prev = link(i - 1).ToString();
+        // каждое сотое звено первой половины читает предыдущее через диапазон
+        const bool is_range_link = i < LAST_RANGE_LINK + 1 && i % 100 == 0;
+        sheet.SetCell(link(i), is_range_link ? "=SUM("s + prev + ":"s + prev + ")+1"s : "="s + prev + "+1"s);
+    }
+    const Position last = link(LENGTH - 1);
+    ASSERT(sheet.GetCell(last)->GetValue() == CellInterface::Value(double(LENGTH)));
+
+    sheet.SetCell(link(0), "2"s);
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell(last))->IsCacheValie());
+    ASSERT(sheet.GetCell(last)->GetValue() == CellInterface::Value(double(LENGTH + 1)));
+
+    const std::vector<Position> referenced = sheet.GetCell(last)->GetReferencedCells();
+    // ячейки диапазонов в список не входят
+    ASSERT_EQUAL(referenced.size(), static_cast<size_t>(LENGTH - 1 - LAST_RANGE_LINK));
+    ASSERT(referenced.front() == link(LENGTH - 2));
+
+    ASSERT_THROWS(sheet.SetCell(link(0), "="s + last.ToString()), CircularDependencyException);
+
+    sheet.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    sheet.SetCell(link(0), "3"s);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell(last))->IsCacheValie());
+    ASSERT(sheet.GetCell(last)->GetValue() == CellInterface::Value(double(LENGTH + 2)));
+}
+
+void TestWorkStealingPool() {
+    // задачи образуют двоичное дерево: задача t порождает 2t+1 и 2t+2
+    constexpr uint32_t TASKS = 100000;
+    WorkStealingPool pool(4);
+    ASSERT_EQUAL(pool.GetThreadCount(), 4u);
+    std::vector<std::atomic<int>> runs(TASKS);
+    for (int repeat = 0; repeat < 3; ++repeat) {
+        for (std::atomic<int>& count : runs) {
+            count.store(0);
+        }
+        pool.Run({ 0 }, [&pool, &runs](WorkStealingPool::Task task, size_t worker) {
+            runs[task].fetch_add(1);
+            for (uint32_t child : { 2 * task + 1, 2 * task + 2 }) {
+                if (child < TASKS) {
+                    pool.Push(worker, child);
+                }
+            }
+        });
+        ASSERT(std::all_of(runs.begin(), runs.end(), [](const std::atomic<int>& count) {
+            return count.load() == 1;
+        }));
+    }
+    bool is_run = false;
+    pool.Run({}, [&is_run](WorkStealingPool::Task, size_t) {
+        is_run = true;
+    });
+    ASSERT(!is_run);
+}
+
+// Параллельный пересчёт даёт те же значения, что и последовательный.
+void TestParallelRecalculation() {
+    constexpr int ROWS = 40;
+    constexpr int COLS = 40;
+    Sheet serial;
+    Sheet parallel;
+    parallel.SetThreadCount(4);
+    ASSERT_EQUAL(parallel.GetThreadCount(), 4u);
+    std::mt19937 generator(17);
+    auto random_index = [&generator](int size) {
+        return std::uniform_int_distribution<int>(0, size - 1)(generator);
+    };
+    // формула строки row ссылается только на строки выше
+    auto random_formula = [&random_index](int row) {
+        auto random_pos = [&random_index, row]() {
+            return Position{ random_index(row), random_index(COLS) };
+        };
+        switch (random_index(6)) {
+        case 0: {
+            const Position first = random_pos();
+            const Position last{ first.row + random_index(row - first.row), std::min(COLS - 1, first.col + random_index(3)) };
+            return "=SUM("s + Range{ first, last }.ToString() + ")/100+"s + random_pos().ToString();
+        }
+        case 1:
+            return "="s + random_pos().ToString() + "/("s + random_pos().ToString() + "-"s + random_pos().ToString() + ")"s;
+        default:
+            return "="s + random_pos().ToString() + "*0.5+"s + random_pos().ToString() + "*0.25"s;
+        }
+    };
+    auto set_cell = [&serial, &parallel](Position pos, const std::string& text) {
+        serial.SetCell(pos, text);
+        parallel.SetCell(pos, text);
+    };
+    auto check_values = [&serial, &parallel]() {
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                const auto* parallel_cell = static_cast<const Cell*>(parallel.GetCell(Position{ row, col }));
+                ASSERT(!parallel_cell->IsDirty());
+                ASSERT(serial.GetCell(Position{ row, col })->GetValue() == parallel_cell->GetValue());
+            }
+        }
+    };
+
+    for (int col = 0; col < COLS; ++col) {
+        set_cell(Position{ 0, col }, std::to_string(random_index(10)));
+    }
+    for (int row = 1; row < ROWS; ++row) {
+        for (int col = 0; col < COLS; ++col) {
+            set_cell(Position{ row, col }, random_formula(row));
+        }
+    }
+
+    // при ленивом пересчёте формулы вычисляются по запросу
+    parallel.Recalculate();
+    check_values();
+
+    serial.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    parallel.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    for (int step = 0; step < 200; ++step) {
+        const int row = random_index(ROWS);
+        const Position pos{ row, random_index(COLS) };
+        set_cell(pos, row == 0 ? std::to_string(random_index(10)) : random_formula(row));
+        check_values();
+    }
+
+    parallel.SetThreadCount(1);
+    ASSERT_EQUAL(parallel.GetThreadCount(), 1u);
+}
+
+// Потоки читают один лист одновременно и вычисляют устаревшие формулы,
+// в том числе одни и те же, с теми же значениями, что и один поток.
+void TestConcurrentReads() {
+    constexpr int ROWS = 2000;
+    constexpr int THREADS = 4;
+    Sheet sheet;
+    Sheet expected;
+    auto set_cell = [&sheet, &expected](Position pos, const std::string& text) {
+        sheet.SetCell(pos, text);
+        expected.SetCell(pos, text);
+    };
+    for (int row = 0; row < ROWS; ++row) {
+        set_cell(Position{ row, 0 }, std::to_string(row % 7));
+        set_cell(Position{ row, 1 }, row == 0 ? "=A1"s : "="s + Position{ row - 1, 1 }.ToString() + "/2+"s + Position{ row, 0 }.ToString());
+        set_cell(Position{ row, 2 }, "=SUM(B1:"s + Position{ row, 1 }.ToString() + ")"s);
+    }
+
+    for (int step = 0; step < 3; ++step) {
+        set_cell(Position{ 0, 0 }, std::to_string(step + 10));
+        std::ostringstream expected_output;
+        expected.PrintValues(expected_output);
+        std::vector<std::vector<Position>> expected_referenced(ROWS);
+        for (int row = 0; row < ROWS; ++row) {
+            expected_referenced[row] = expected.GetCell(Position{ row, 2 })->GetReferencedCells();
+        }
+
+        // половина потоков читает лист сверху, половина - снизу, и вместе со
+        // значениями читает ячейки, от которых они зависят
+        std::vector<std::string> outputs(THREADS);
+        std::vector<int> referenced_mismatches(THREADS, 0);
+        std::vector<std::thread> threads;
+        for (int thread = 0; thread < THREADS; ++thread) {
+            threads.emplace_back([&sheet, &outputs, &expected_referenced, &referenced_mismatches, thread]() {
+                for (int i = 0; i < ROWS; ++i) {
+                    const int row = thread % 2 == 0 ? i : ROWS - 1 - i;
+                    const CellInterface* cell = sheet.GetCell(Position{ row, 2 });
+                    cell->GetValue();
+                    if (i % 50 == 0 && cell->GetReferencedCells() != expected_referenced[row]) {
+                        ++referenced_mismatches[thread];
+                    }
+                }
+                std::ostringstream output;
+                sheet.PrintValues(output);
+                outputs[thread] = output.str();
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (const std::string& output : outputs) {
+            ASSERT_EQUAL(output, expected_output.str());
+        }
+        for (int mismatches : referenced_mismatches) {
+            ASSERT_EQUAL(mismatches, 0);
+        }
+        for (int row = 0; row < ROWS; ++row) {
+            ASSERT(!static_cast<const Cell*>(sheet.GetCell(Position{ row, 2 }))->IsDirty());
+        }
+    }
+}
+
+// Снимок не меняется вместе с листом, даже когда его читают из другого потока,
+// новый снимок берёт у прежнего блоки, в которых лист не менялся, а блок
+// удаляется вместе с последним снимком, который его содержит.
+void TestSnapshots() {
+    auto values = [](const auto& table) {
+        std::ostringstream output;
+        table.PrintValues(output);
+        return output.str();
+    };
+    auto texts = [](const auto& table) {
+        std::ostringstream output;
+        table.PrintTexts(output);
+        return output.str();
+    };
+
+    Sheet sheet;
+    sheet.SetCell(Position::FromString("A1"), "1");
+    sheet.SetCell(Position::FromString("B1"), "=A1+1");
+    sheet.SetCell(Position::FromString("A2"), "'=text");
+    sheet.SetCell(Position::FromString("C2"), "=A2");
+    sheet.SetCell(Position::FromString("D3"), "=CA100*10");
+    sheet.SetCell(Position::FromString("CA100"), "=B1*10");
+
+    auto first = sheet.GetSnapshot();
+    ASSERT(sheet.GetSnapshot() == first);
+    const std::string first_values = values(*first);
+    const std::string first_texts = texts(*first);
+    ASSERT_EQUAL(first_values, values(sheet));
+    ASSERT_EQUAL(first_texts, texts(sheet));
+    ASSERT_EQUAL(first->GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT_EQUAL(first->GetTiles().size(), 2u);
+    ASSERT_EQUAL(std::get<std::string>(first->GetCell(Position::FromString("A2"))->GetValue()), "=text");
+    ASSERT_EQUAL(std::get<double>(first->GetCell(Position::FromString("CA100"))->GetValue()), 20.0);
+    ASSERT_EQUAL(std::get<double>(first->GetCell(Position::FromString("D3"))->GetValue()), 200.0);
+    ASSERT_EQUAL(std::get<FormulaError>(first->GetCell(Position::FromString("C2"))->GetValue()), FormulaError(FormulaError::Category::Value));
+    ASSERT(first->GetCell(Position::FromString("E5")) == nullptr);
+    try {
+        first->GetCell(Position::NONE);
+        ASSERT(false);
+    }
+    catch (const InvalidPositionException&) {
+    }
+
+    // A1 меняет формулы обоих блоков
+    sheet.SetCell(Position::FromString("A1"), "2");
+    auto second = sheet.GetSnapshot();
+    ASSERT_EQUAL(values(*first), first_values);
+    ASSERT_EQUAL(values(*second), values(sheet));
+    ASSERT_EQUAL(std::get<double>(second->GetCell(Position::FromString("D3"))->GetValue()), 300.0);
+
+    sheet.SetCell(Position::FromString("B1"), "=A1*5");
+    auto formula_changed = sheet.GetSnapshot();
+    ASSERT_EQUAL(texts(*formula_changed), texts(sheet));
+    ASSERT_EQUAL(values(*formula_changed), values(sheet));
+    ASSERT_EQUAL(std::get<double>(second->GetCell(Position::FromString("D3"))->GetValue()), 300.0);
+
+    // текст в дальнем блоке не трогает первый блок
+    sheet.SetCell(Position::FromString("CB100"), "text");
+    auto third = sheet.GetSnapshot();
+    ASSERT(third->GetTiles()[0].second == formula_changed->GetTiles()[0].second);
+    ASSERT(third->GetTiles()[1].second != formula_changed->GetTiles()[1].second);
+    ASSERT_EQUAL(texts(*third), texts(sheet));
+
+    // блок, из которого удалены все ячейки, пропадает из снимка
+    std::weak_ptr<const SheetSnapshot::Tile> replaced_tile = second->GetTiles()[1].second;
+    std::weak_ptr<const SheetSnapshot::Tile> removed_tile = third->GetTiles()[1].second;
+    sheet.ClearCell(Position::FromString("D3"));
+    sheet.ClearCell(Position::FromString("CA100"));
+    sheet.ClearCell(Position::FromString("CB100"));
+    auto fourth = sheet.GetSnapshot();
+    ASSERT_EQUAL(fourth->GetTiles().size(), 1u);
+    ASSERT_EQUAL(fourth->GetPrintableSize(), (Size{ 2, 3 }));
+    ASSERT_EQUAL(values(*fourth), values(sheet));
+
+    // старые блоки удаляются с последним снимком, который их содержит
+    ASSERT(!replaced_tile.expired());
+    second.reset();
+    ASSERT(replaced_tile.expired());
+    ASSERT(!removed_tile.expired());
+    third.reset();
+    ASSERT(removed_tile.expired());
+    ASSERT_EQUAL(values(*first), first_values);
+    ASSERT_EQUAL(texts(*first), first_texts);
+
+    // поток печатает снимок, пока лист меняется
+    constexpr int ROWS = 500;
+    Sheet large;
+    for (int row = 0; row < ROWS; ++row) {
+        large.SetCell(Position{ row, 0 }, std::to_string(row));
+        large.SetCell(Position{ row, 1 }, "=SUM(A1:"s + Position{ row, 0 }.ToString() + ")"s);
+    }
+    for (auto mode : { Sheet::RecalculationMode::Lazy, Sheet::RecalculationMode::Eager }) {
+        large.SetRecalculationMode(mode);
+        auto snapshot = large.GetSnapshot();
+        const std::string expected = values(*snapshot);
+        ASSERT_EQUAL(expected, values(large));
+        std::vector<std::string> outputs;
+        std::thread reader([&snapshot, &outputs, &values]() {
+            for (int i = 0; i < 5; ++i) {
+                outputs.push_back(values(*snapshot));
+            }
+        });
+        for (int row = 0; row < ROWS; row += 7) {
+            large.SetCell(Position{ row, 0 }, std::to_string(row * 2));
+            large.GetCell(Position{ ROWS - 1, 1 })->GetValue();
+        }
+        reader.join();
+        for (const std::string& output : outputs) {
+            ASSERT_EQUAL(output, expected);
+        }
+        ASSERT_EQUAL(values(*large.GetSnapshot()), values(large));
+    }
+}
+
+// Потоки пишут каждый в свои строки, а формулы и очистки затрагивают строки
+// других потоков. Лист получается тем же, что при записи в одном потоке.
+void TestConcurrentWriters() {
+    constexpr int THREADS = 6;
+    constexpr int ROWS = 150;
+    constexpr int COLS = 4;
+    // поток thread пишет в строки [thread * ROWS, (thread + 1) * ROWS)
+    auto changes = [](int thread) {
+        std::vector<std::pair<Position, std::optional<std::string>>> result;
+        const int first_row = thread * ROWS;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int row = first_row; row < first_row + ROWS; ++row) {
+                for (int col = 0; col < COLS; ++col) {
+                    const int value = row * COLS + col + pass;
+                    if (value % 11 == 0) {
+                        result.push_back({ Position{ row, col }, std::nullopt });
+                    }
+                    else if (value % 5 == 0) {
+                        result.push_back({ Position{ row, col }, "text"s + std::to_string(value) });
+                    }
+                    else {
+                        result.push_back({ Position{ row, col }, std::to_string(value) });
+                    }
+                }
+            }
+        }
+        // формулы читают ячейки соседнего потока и весь столбец A
+        const int other_row = ((thread + 1) % THREADS) * ROWS;
+        for (int row = first_row; row < first_row + ROWS; row += 10) {
+            result.push_back({ Position{ row, COLS }, "="s + Position{ other_row + row % ROWS, 1 }.ToString() + "+1"s });
+            result.push_back({ Position{ row, COLS + 1 }, "=SUM(A1:A"s + std::to_string(THREADS * ROWS) + ")"s });
+        }
+        // и потоки снова меняют ячейки, которые читают формулы
+        for (int row = first_row; row < first_row + ROWS; row += 3) {
+            result.push_back({ Position{ row, 0 }, std::to_string(row) });
+            result.push_back({ Position{ row, 1 }, std::to_string(-row) });
+        }
+        return result;
+    };
+    auto apply = [](Sheet& sheet, const std::pair<Position, std::optional<std::string>>& change) {
+        if (change.second) {
+            sheet.SetCell(change.first, *change.second);
+        }
+        else {
+            sheet.ClearCell(change.first);
+        }
+    };
+    auto print = [](const auto& table) {
+        std::ostringstream output;
+        table.PrintTexts(output);
+        table.PrintValues(output);
+        return output.str();
+    };
+
+    Sheet expected;
+    for (int thread = 0; thread < THREADS; ++thread) {
+        for (const auto& change : changes(thread)) {
+            apply(expected, change);
+        }
+    }
+
+    for (auto mode : { Sheet::RecalculationMode::Lazy, Sheet::RecalculationMode::Eager }) {
+        Sheet sheet;
+        sheet.SetRecalculationMode(mode);
+        sheet.SetConcurrentWrites(true);
+        ASSERT(sheet.HasConcurrentWrites());
+        std::atomic<bool> done = false;
+        // читатель берёт снимки, пока потоки пишут
+        bool is_snapshot_consistent = true;
+        std::thread reader([&sheet, &done, &print, &is_snapshot_consistent]() {
+            while (!done) {
+                const auto snapshot = sheet.GetSnapshot();
+                const std::string output = print(*snapshot);
+                is_snapshot_consistent = is_snapshot_consistent
+                    && std::count(output.begin(), output.end(), '\n') == 2 * snapshot->GetPrintableSize().rows;
+            }
+        });
+        std::vector<std::thread> writers;
+        for (int thread = 0; thread < THREADS; ++thread) {
+            writers.emplace_back([&sheet, &changes, &apply, thread]() {
+                for (const auto& change : changes(thread)) {
+                    apply(sheet, change);
+                }
+            });
+        }
+        for (std::thread& writer : writers) {
+            writer.join();
+        }
+        done = true;
+        reader.join();
+        ASSERT(is_snapshot_consistent);
+
+        sheet.SetConcurrentWrites(false);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), expected.GetPrintableSize());
+        ASSERT_EQUAL(print(sheet), print(expected));
+        ASSERT_EQUAL(print(*sheet.GetSnapshot()), print(expected));
+    }
+}
+
+// Лист, загруженный из напечатанных текстов, печатается так же и
+// пересчитывается, как исходный.
+void TestImportTexts() {
+    const auto pos = [](std::string_view str) {
+        return Position::FromString(str);
+    };
+    const auto print = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        out << '|';
+        sheet.PrintValues(out);
+        return out.str();
+    };
+    const auto texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+
+    Sheet source;
+    source.SetCell(pos("A1"sv), "1"s);
+    source.SetCell(pos("B1"sv), "=A1+A2*2"s);
+    source.SetCell(pos("C1"sv), "=SUM(A1:B3)/COUNT(A1:A3)"s);
+    source.SetCell(pos("A2"sv), "2.5"s);
+    source.SetCell(pos("B2"sv), "'=escaped"s);
+    source.SetCell(pos("C2"sv), "text"s);
+    source.SetCell(pos("A3"sv), "=B1+1/0"s);
+    source.SetCell(pos("B3"sv), "=Z9"s);
+    // пустая ячейка в углу листа определяет его печатный размер
+    source.SetCell(pos("AB21"sv), ""s);
+    for (int row = 5; row < 20; ++row) {
+        source.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1"s);
+    }
+
+    for (const auto mode : { Sheet::RecalculationMode::Lazy, Sheet::RecalculationMode::Eager }) {
+        for (size_t threads : { 1, 4 }) {
+            Sheet sheet;
+            sheet.SetRecalculationMode(mode);
+            sheet.SetThreadCount(threads);
+            std::istringstream input(texts(source));
+            sheet.ImportTexts(input);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), source.GetPrintableSize());
+            ASSERT_EQUAL(print(sheet), print(source));
+            ASSERT(sheet.GetCell(pos("Z9"sv)) != nullptr);
+            ASSERT_EQUAL(sheet.GetSharedFormulaCount(), source.GetSharedFormulaCount());
+
+            // связи и порядок формул построены
+            Sheet expected;
+            std::istringstream copy(texts(source));
+            expected.ImportTexts(copy);
+            for (Sheet* changed : { &sheet, &expected }) {
+                changed->SetCell(pos("A1"sv), "=Z9+4"s);
+                changed->SetCell(pos("Z9"sv), "3"s);
+            }
+            ASSERT_THROWS(sheet.SetCell(pos("Z9"sv), "=A3"s), CircularDependencyException);
+            std::visit(CellValueChecker{ 7.0 }, sheet.GetCell(pos("A1"sv))->GetValue());
+            ASSERT_EQUAL(print(sheet), print(expected));
+        }
+    }
+
+    // \r перед переводом строки, последняя строка без перевода строки и
+    // другой разделитель
+    {
+        Sheet sheet;
+        std::istringstream input("1,=A1*2\r\n,,\r\n\t3"s);
+        sheet.ImportTexts(input, ',');
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 3 }));
+        std::visit(CellValueChecker{ 2.0 }, sheet.GetCell(pos("B1"sv))->GetValue());
+        ASSERT_EQUAL(sheet.GetCell(pos("A3"sv))->GetText(), "\t3"s);
+        ASSERT_EQUAL(texts(sheet), "1\t=A1*2\t\n\t\t\n\t3\t\t\n"s);
+    }
+
+    // строки, которые не помещаются в один блок чтения и кусок разбора
+    {
+        Sheet source;
+        const std::string long_text(5000, 'x');
+        for (int row = 0; row < 1000; ++row) {
+            source.SetCell(Position{ row, 0 }, long_text + std::to_string(row));
+            source.SetCell(Position{ row, 1 }, std::to_string(row));
+            source.SetCell(Position{ row, 2 }, row == 0 ? "=B1"s : "=C" + std::to_string(row) + "+B"s + std::to_string(row + 1));
+        }
+        for (size_t threads : { 1, 3 }) {
+            Sheet sheet;
+            sheet.SetThreadCount(threads);
+            std::istringstream input(texts(source));
+            sheet.ImportTexts(input);
+            ASSERT_EQUAL(print(sheet), print(source));
+            std::visit(CellValueChecker{ 999.0 * 1000 / 2 }, sheet.GetCell(Position{ 999, 2 })->GetValue());
+        }
+    }
+
+    // при ошибке лист остаётся пустым, и в него можно загрузить снова
+    Sheet sheet;
+    sheet.SetRecalculationMode(Sheet::RecalculationMode::Eager);
+    const std::string too_wide(Position::MAX_COLS, '\t');
+    const std::vector<std::pair<std::string, int>> failing = {
+        { "1\t=B2\n=SUM(A1:B1)\t=A2+1\n"s, 0 },
+        { "=A1\n"s, 0 },
+        { "1\t=A1+\n"s, 1 },
+        { "=C1\t=1\n"s + too_wide + "x\n"s, 2 },
+    };
+    for (const auto& [text, error] : failing) {
+        std::istringstream input(text);
+        switch (error) {
+        case 0:
+            ASSERT_THROWS(sheet.ImportTexts(input), CircularDependencyException);
+            break;
+        case 1:
+            ASSERT_THROWS(sheet.ImportTexts(input), FormulaException);
+            break;
+        default:
+            ASSERT_THROWS(sheet.ImportTexts(input), InvalidPositionException);
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+        ASSERT(sheet.GetCell(pos("A1"sv)) == nullptr);
+        ASSERT(sheet.GetCell(pos("C1"sv)) == nullptr);
+        ASSERT_EQUAL(sheet.GetSharedFormulaCount(), 0u);
+        ASSERT_EQUAL(sheet.GetDependencyGraph().GetNodeCount(), 0u);
+    }
+    std::istringstream input("2\t=A1*3\n"s);
+    sheet.ImportTexts(input);
+    std::visit(CellValueChecker{ 6.0 }, sheet.GetCell(pos("B1"sv))->GetValue());
+
+    // в непустой лист и в пакет не загружается, лист не меняется
+    sheet.SetCell(pos("D4"sv), "keep"s);
+    const std::string before = print(sheet);
+    for (const std::string& text : { "=1+\n"s, "7\n"s }) {
+        std::istringstream more(text);
+        ASSERT_THROWS(sheet.ImportTexts(more), std::logic_error);
+        ASSERT_EQUAL(more.tellg(), std::streampos(0));
+        ASSERT_EQUAL(print(sheet), before);
+    }
+    Sheet empty;
+    empty.BeginBatch();
+    std::istringstream in_batch("7\n"s);
+    ASSERT_THROWS(empty.ImportTexts(in_batch), std::logic_error);
+    empty.CancelBatch();
+    ASSERT(empty.GetCell(pos("A1"sv)) == nullptr);
+}
+
+// Экспорт печатает то же, что операторы вывода, через буфер любого размера.
+void TestExport() {
+    std::mt19937 generator(25);
+
+    // числа - как у std::ostream по умолчанию
+    std::vector<double> numbers = { 0.0, -0.0, 1.0, -2.5, 0.1 + 0.2, 1.0 / 3, 123456.0, 1234567.0, 1e21, 1e-5, 1.5e-7,
+        1e300, -1e-300, std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+        std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::denorm_min() };
+    for (int i = 0; i < 1000; ++i) {
+        numbers.push_back(std::uniform_real_distribution<double>(-1e7, 1e7)(generator));
+        const uint64_t bits = std::uniform_int_distribution<uint64_t>()(generator);
+        double number;
+        std::memcpy(&number, &bits, sizeof(number));
+        numbers.push_back(number);
+    }
+    {
+        std::string exported;
+        std::ostringstream expected;
+        char buffer[ExportBuffer::MIN_SIZE];
+        ExportBuffer output(buffer, sizeof(buffer), MakeStringSink(exported));
+        for (double number : numbers) {
+            output.Write(number);
+            output.Write(' ');
+            expected << number << ' ';
+        }
+        // текст длиннее буфера, символы подряд и печать через поток
+        const std::string long_text(1000, 'x');
+        output.Write(long_text);
+        expected << long_text;
+        output.Write('\t', 150);
+        expected << std::string(150, '\t');
+        output.Write(FormulaError(FormulaError::Category::Div0));
+        expected << FormulaError(FormulaError::Category::Div0);
+        output.GetStream() << 42 << "abc"sv;
+        expected << 42 << "abc"sv;
+        ASSERT(exported.size() < expected.str().size());
+        output.Flush();
+        ASSERT_EQUAL(exported, expected.str());
+    }
+
+    // лист печатается так же, как через GetCell() и операторы вывода
+    auto random_index = [&generator](int size) {
+        return std::uniform_int_distribution<int>(0, size - 1)(generator);
+    };
+    constexpr int ROWS = 1500;
+    constexpr int COLS = 6;
+    auto random_cell = [&]() {
+        return Position{ random_index(ROWS), random_index(COLS) };
+    };
+    auto random_text = [&]() {
+        switch (random_index(10)) {
+        case 0:
+            return ""s;
+        case 1:
+            return "text"s;
+        case 2:
+            return "'=escaped"s;
+        case 3:
+            return "=1/0"s;
+        case 4:
+            return "=" + random_cell().ToString() + "/3"s;
+        case 5:
+            return "=SUM(" + random_cell().ToString() + ":"s + random_cell().ToString() + ")"s;
+        case 6:
+            return std::to_string(random_index(2001) - 1000) + ".125"s;
+        default:
+            return std::to_string(random_index(2001) - 1000);
+        }
+    };
+    auto reference = [](const Sheet& sheet, bool values, int precision) {
+        std::ostringstream output;
+        output.precision(precision);
+        const Size size = sheet.GetPrintableSize();
+        for (int r = 0; r < size.rows; ++r) {
+            for (int c = 0; c < size.cols; ++c) {
+                if (c > 0) {
+                    output << '\t';
+                }
+                if (const CellInterface* cell = sheet.GetCell(Position{ r, c })) {
+                    if (values) {
+                        std::visit([&output](const auto& value) {
+                            output << value;
+                        }, cell->GetValue());
+                    }
+                    else {
+                        output << cell->GetText();
+                    }
+                }
+            }
+            output << '\n';
+        }
+        return output.str();
+    };
+
+    for (size_t threads : { 1, 3 }) {
+        Sheet sheet;
+        sheet.SetThreadCount(threads);
+        for (int i = 0; i < ROWS * COLS / 2; ++i) {
+            try {
+                sheet.SetCell(random_cell(), random_text());
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+        sheet.SetCell(Position{ ROWS + 10, COLS + 2 }, ""s);
+
+        // устаревшие формулы вычисляются во время печати
+        std::string values;
+        {
+            char buffer[ExportBuffer::MIN_SIZE];
+            ExportBuffer output(buffer, sizeof(buffer), MakeStringSink(values));
+            sheet.ExportValues(output);
+        }
+        ASSERT_EQUAL(values, reference(sheet, true, 6));
+        std::string texts;
+        {
+            std::vector<char> buffer(1 << 20);
+            ExportBuffer output(buffer.data(), buffer.size(), MakeStringSink(texts));
+            sheet.ExportTexts(output);
+        }
+        ASSERT_EQUAL(texts, reference(sheet, false, 6));
+
+        std::ostringstream printed;
+        sheet.PrintValues(printed);
+        sheet.PrintTexts(printed);
+        ASSERT_EQUAL(printed.str(), values + texts);
+        // нестандартные настройки вывода соблюдаются
+        std::ostringstream precise;
+        precise.precision(10);
+        sheet.PrintValues(precise);
+        ASSERT_EQUAL(precise.str(), reference(sheet, true, 10));
+
+        std::FILE* file = std::tmpfile();
+        ASSERT(file != nullptr);
+        {
+            char buffer[4096];
+            ExportBuffer output(buffer, sizeof(buffer), MakeFileSink(fileno(file)));
+            sheet.ExportTexts(output);
+        }
+        std::rewind(file);
+        std::string written(texts.size() + 1, '\0');
+        written.resize(std::fread(written.data(), 1, written.size(), file));
+        std::fclose(file);
+        ASSERT_EQUAL(written, texts);
+    }
+    ASSERT_THROWS(MakeFileSink(-1)("x"sv), std::system_error);
+}
+
+// Значения столбцов дают те же результаты, что и чтение каждой ячейки.
+void TestRangeFunctionsMatchCells() {
+    Sheet sheet;
+    std::mt19937 generator(2024);
+    auto random_index = [&generator](int size) {
+        return std::uniform_int_distribution<int>(0, size - 1)(generator);
+    };
+
+    constexpr int ROWS = 2000;
+    constexpr int COLS = 4;
+    auto random_cell = [&]() {
+        return Position{ random_index(ROWS), random_index(COLS) };
+    };
+    auto random_text = [&]() {
+        switch (random_index(8)) {
+        case 0:
+            return ""s;
+        case 1:
+            return "text"s;
+        case 2:
+            return "=1/0"s;
+        case 3:
+            return "=" + random_cell().ToString() + "*2"s;
+        default:
+            return std::to_string(random_index(2001) - 1000);
+        }
+    };
+    auto random_range = [&]() {
+        const Position first = random_cell();
+        const Position last = random_cell();
+        return first.ToString() + ":"s + last.ToString();
+    };
+
+    const std::vector<std::string> functions = { "SUM"s, "AVERAGE"s, "MIN"s, "MAX"s, "COUNT"s };
+    std::vector<std::string> formulas;
+    for (int i = 0; i < 50; ++i) {
+        formulas.push_back(functions[random_index(5)] + "("s + random_range() + ","s + random_range() + ")"s);
+        sheet.SetCell(Position{ i, COLS }, "=" + formulas.back());
+    }
+
+    for (int step = 0; step < 30; ++step) {
+        for (int i = 0; i < 200; ++i) {
+            try {
+                sheet.SetCell(random_cell(), random_text());
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+        for (int i = 0; i < 20; ++i) {
+            sheet.ClearCell(random_cell());
+        }
+        // из нескольких ошибок диапазона может быть выбрана любая
+        for (size_t i = 0; i < formulas.size(); ++i) {
+            const FormulaInterface::Value expected = ParseFormula(formulas[i])->Evaluate(sheet);
+            const CellInterface::Value value = sheet.GetCell(Position{ static_cast<int>(i), COLS })->GetValue();
+            ASSERT_EQUAL(std::holds_alternative<double>(value), std::holds_alternative<double>(expected));
+            if (std::holds_alternative<double>(value)) {
+                ASSERT_EQUAL(std::get<double>(value), std::get<double>(expected));
+            }
+        }
+    }
+}
+
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
+// Рукописный разбор и разбор ANTLR дают одинаковые деревья и ошибки.
+void TestFormulaParserMatchesAntlr() {
+    auto compare = [](std::string_view expression) {
+        const std::string antlr = DescribeParse([](std::string_view text) {
+            return ParseFormulaASTWithAntlr(text);
+        }, expression);
+        ASSERT_EQUAL(DescribeParse(expression), antlr);
+    };
+
+    std::mt19937 generator(2021);
+    auto random_index = [&generator](size_t size) {
+        return std::uniform_int_distribution<size_t>(0, size - 1)(generator);
+    };
+
+    // случайные цепочки токенов, в основном некорректные
+    const std::vector<std::string_view> pieces = { "1"sv, "2.5"sv, ".5"sv, "1e3"sv, "E"sv, "e"sv, "-"sv,
+        "A1"sv, "ZZ9"sv, "XFD16384"sv, "XFE1"sv, "+"sv, "*"sv, "/"sv, "("sv, ")"sv, " "sv, "."sv,
+        "SUM"sv, "MAX"sv, "FOO"sv, ":"sv, ","sv };
+    for (int i = 0; i < 20000; ++i) {
+        std::string expression;
+        const size_t length = 1 + random_index(10);
+        for (size_t j = 0; j < length; ++j) {
+            expression += pieces[random_index(pieces.size())];
+        }
+        compare(expression);
+    }
+
+    // случайные корректные выражения
+    auto make_cell = [&]() {
+        return Position{ static_cast<int>(random_index(100)), static_cast<int>(random_index(100)) }.ToString();
+    };
+    std::function<std::string(int)> make_expression = [&](int depth) -> std::string {
+        switch (depth > 0 ? random_index(6) : random_index(2)) {
+        case 0:
+            return std::to_string(random_index(1000)) + (random_index(2) ? ".25e-1"s : ""s);
+        case 1:
+            return make_cell();
+        case 2:
+            return "("s + make_expression(depth - 1) + ")"s;
+        case 3:
+            return (random_index(2) ? "-"s : "+"s) + make_expression(depth - 1);
+        case 4: {
+            std::string call = random_index(2) ? "SUM("s : "COUNT("s;
+            for (size_t arg = 0, args = 1 + random_index(3); arg < args; ++arg) {
+                call += (arg > 0 ? ","s : ""s)
+                    + (random_index(2) ? make_cell() + ":"s + make_cell() : make_expression(depth - 1));
+            }
+            return call + ")"s;
+        }
+        default:
+            return make_expression(depth - 1) + "+-*/"s[random_index(4)] + make_expression(depth - 1);
+        }
+    };
+    for (int i = 0; i < 5000; ++i) {
+        compare(make_expression(6));
+    }
+}
+#endif
+
 // -----------------------------------------------------------------------------
 
 }  // namespace
@@ -526,4 +2458,35 @@ void Tests() {
     RUN_TEST(tr, TestCircularDependecies);
     RUN_TEST(tr, TestCircularDependeciesPlatform);
     RUN_TEST(tr, TestCircularDependeciesOneMoreTime);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestPrintableSizeShrink);
+    RUN_TEST(tr, TestArenaAllocationStats);
+    RUN_TEST(tr, TestBoundReferences);
+    RUN_TEST(tr, TestTextNumericValues);
+    RUN_TEST(tr, TestCompactCellValue);
+    RUN_TEST(tr, TestFormulaProgram);
+    RUN_TEST(tr, TestFormulaFolding);
+    RUN_TEST(tr, TestErrorValues);
+    RUN_TEST(tr, TestFormulaParser);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestColumnIndex);
+    RUN_TEST(tr, TestRangeFunctionsMatchCells);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestSheetDependencyGraph);
+    RUN_TEST(tr, TestTopologicalOrder);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestBatchUpdate);
+    RUN_TEST(tr, TestDeepChains);
+    RUN_TEST(tr, TestWorkStealingPool);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestConcurrentReads);
+    RUN_TEST(tr, TestSnapshots);
+    RUN_TEST(tr, TestConcurrentWriters);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestExport);
+#ifdef SIMPLE_EXCEL_WITH_ANTLR
+    RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+#endif
 }
@@ -0,0 +1,123 @@
+#include "thread_pool.h"
+
+#include <cassert>
+
+WorkStealingPool::WorkStealingPool(size_t thread_count) {
+    assert(thread_count > 0);
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    // поток 0 - тот, который вызывает Run()
+    for (size_t worker = 1; worker < thread_count; ++worker) {
+        threads_.emplace_back([this, worker] {
+            WorkerLoop(worker);
+        });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    job_started_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::Run(const std::vector<Task>& tasks, const Job& run) {
+    if (tasks.empty()) {
+        return;
+    }
+    // начальные задачи раздаются по очередям всех потоков
+    pending_.store(tasks.size(), std::memory_order_relaxed);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        queues_[i % queues_.size()]->tasks.push_back(tasks[i]);
+    }
+    {
+        std::lock_guard lock(mutex_);
+        job_ = &run;
+        ++job_number_;
+        busy_workers_ = threads_.size();
+    }
+    job_started_.notify_all();
+
+    Work(0);
+
+    // run должна жить, пока её вызывают другие потоки
+    std::unique_lock lock(mutex_);
+    job_finished_.wait(lock, [this] {
+        return busy_workers_ == 0;
+    });
+    job_ = nullptr;
+}
+
+void WorkStealingPool::Push(size_t worker, Task task) {
+    // задача учитывается раньше, чем завершится та, что её породила
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    Queue& queue = *queues_[worker];
+    std::lock_guard lock(queue.mutex);
+    queue.tasks.push_back(task);
+}
+
+void WorkStealingPool::WorkerLoop(size_t worker) {
+    uint64_t done_job = 0;
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            job_started_.wait(lock, [this, done_job] {
+                return stopping_ || job_number_ != done_job;
+            });
+            if (stopping_) {
+                return;
+            }
+            done_job = job_number_;
+        }
+        Work(worker);
+        {
+            std::lock_guard lock(mutex_);
+            --busy_workers_;
+        }
+        job_finished_.notify_one();
+    }
+}
+
+void WorkStealingPool::Work(size_t worker) {
+    const Job& run = *job_;
+    Task task;
+    while (pending_.load(std::memory_order_acquire) != 0) {
+        if (Pop(worker, task) || Steal(worker, task)) {
+            run(task, worker);
+            pending_.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        else {
+            // задачи есть, но их выполняют другие потоки и могут породить новые
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool WorkStealingPool::Pop(size_t worker, Task& task) {
+    Queue& queue = *queues_[worker];
+    std::lock_guard lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool WorkStealingPool::Steal(size_t worker, Task& task) {
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        Queue& queue = *queues_[(worker + i) % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
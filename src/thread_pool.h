@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков для задач, которые порождают новые задачи. Задача - число,
+// которое понимает функция задания, например номер ячейки. У каждого потока
+// своя очередь: он кладёт в её конец порождённые задачи и берёт первую, а
+// поток с пустой очередью крадёт последнюю задачу из чужой. Так потоки почти
+// не мешают друг другу, а работа расходится по ним сама. Поток выполняет
+// свои задачи в порядке появления: задачи, порождённые вместе, обычно лежат
+// в памяти рядом.
+class WorkStealingPool {
+public:
+    using Task = uint32_t;
+    // run(Task task, size_t worker): worker - номер потока, который выполняет
+    // задачу, для Push().
+    using Job = std::function<void(Task, size_t)>;
+
+    // thread_count потоков, включая тот, который вызывает Run().
+    explicit WorkStealingPool(size_t thread_count);
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool();
+
+    size_t GetThreadCount() const {
+        return queues_.size();
+    }
+
+    // Выполняет run для каждой задачи tasks и каждой задачи, добавленной
+    // через Push() во время выполнения. Возвращает управление, когда
+    // выполнены все. Вызывающий поток тоже выполняет задачи. run не должна
+    // бросать исключения.
+    void Run(const std::vector<Task>& tasks, const Job& run);
+
+    // Добавляет задачу в очередь потока worker. Вызывается только из run в
+    // потоке worker.
+    void Push(size_t worker, Task task);
+
+private:
+    // Очереди разных потоков лежат в разных кэш-линиях.
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void WorkerLoop(size_t worker);
+
+    // Выполняет задачи текущего задания, пока они не кончатся.
+    void Work(size_t worker);
+
+    bool Pop(size_t worker, Task& task);
+    bool Steal(size_t worker, Task& task);
+
+private:
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable job_started_;
+    std::condition_variable job_finished_;
+    const Job* job_ = nullptr;
+    // номер задания, чтобы поток не выполнял одно задание дважды
+    uint64_t job_number_ = 0;
+    // потоки, которые ещё работают над текущим заданием
+    size_t busy_workers_ = 0;
+    bool stopping_ = false;
+
+    // задачи текущего задания, которые добавлены, но ещё не выполнены
+    std::atomic<size_t> pending_{ 0 };
+};
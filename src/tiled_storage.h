@@ -0,0 +1,280 @@
+#pragma once
+
+#include "position.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace storage_detail {
+
+inline int CountTrailingZeros(uint64_t mask) {
+    assert(mask != 0);
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward64(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+inline int CountBits(uint64_t mask) {
+#ifdef _MSC_VER
+    return static_cast<int>(__popcnt64(mask));
+#else
+    return __builtin_popcountll(mask);
+#endif
+}
+
+// Биты с first по last включительно.
+inline uint64_t BitRange(int first, int last) {
+    assert(0 <= first && first <= last && last < 64);
+    return (~uint64_t{ 0 } >> (63 - last)) & (~uint64_t{ 0 } << first);
+}
+
+} // namespace storage_detail
+
+// Разреженное хранилище ячеек таблицы.
+// Таблица разбита на блоки TILE_SIZE x TILE_SIZE, внутри блока слоты лежат
+// плотно по строкам. Блок создаётся при первой записи в него и удаляется, когда
+// в нём не остаётся заполненных слотов, поэтому расход памяти пропорционален
+// числу заполненных блоков, а не максимальному индексу строки или столбца.
+// Slot - указателеподобный тип (например, std::unique_ptr<Cell>), пустой слот
+// приводится к false.
+template <typename Slot>
+class TiledStorage {
+public:
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS;
+    static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+    TiledStorage()
+        : tile_rows_(TILE_ROWS) {
+    }
+
+    TiledStorage(TiledStorage&&) = default;
+    TiledStorage& operator=(TiledStorage&&) = default;
+
+    // Возвращает слот по позиции или nullptr, если блок с этой позицией ещё не
+    // создан. Позиция должна быть валидной.
+    const Slot* Find(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        return tile ? &tile->slots[SlotIndex(pos)] : nullptr;
+    }
+    Slot* Find(Position pos) {
+        Tile* tile = FindTile(pos);
+        return tile ? &tile->slots[SlotIndex(pos)] : nullptr;
+    }
+
+    // Записывает значение в пустой слот, создавая блок при необходимости.
+    Slot& Insert(Position pos, Slot value) {
+        assert(value);
+        Tile& tile = GetOrCreateTile(pos);
+        Slot& slot = tile.slots[SlotIndex(pos)];
+        assert(!slot);
+        slot = std::move(value);
+        tile.row_masks[pos.row & TILE_MASK] |= ColumnBit(pos.col);
+        ++tile.size;
+        ++size_;
+        return slot;
+    }
+
+    // Извлекает значение из слота. Опустевший блок освобождается.
+    Slot Extract(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (!tile || !tile->slots[SlotIndex(pos)]) {
+            return Slot{};
+        }
+        Slot value = std::move(tile->slots[SlotIndex(pos)]);
+        tile->slots[SlotIndex(pos)] = Slot{};
+        tile->row_masks[pos.row & TILE_MASK] &= ~ColumnBit(pos.col);
+        --tile->size;
+        --size_;
+        if (tile->size == 0) {
+            RemoveTile(pos);
+        }
+        return value;
+    }
+
+    // Количество заполненных слотов.
+    size_t GetSize() const {
+        return size_;
+    }
+
+    // Количество выделенных блоков.
+    size_t GetTileCount() const {
+        return tile_count_;
+    }
+
+    // Память, занимаемая каталогом и блоками (без объектов, на которые
+    // ссылаются слоты).
+    size_t GetMemoryUsage() const {
+        return tile_rows_.capacity() * sizeof(std::unique_ptr<TileRow>)
+            + tile_row_count_ * sizeof(TileRow)
+            + tile_count_ * sizeof(Tile);
+    }
+
+    // Обходит заполненные слоты строки row со столбцами меньше col_end в порядке
+    // возрастания столбца. func(int col, const Slot& slot).
+    template <typename Func>
+    void ForEachInRow(int row, int col_end, Func func) const {
+        const auto& tile_row = tile_rows_[row >> TILE_BITS];
+        if (!tile_row) {
+            return;
+        }
+        const int row_in_tile = row & TILE_MASK;
+        const int tile_col_end = (col_end + TILE_SIZE - 1) >> TILE_BITS;
+        for (int tile_col = 0; tile_col < tile_col_end; ++tile_col) {
+            const Tile* tile = tile_row->tiles[tile_col].get();
+            if (!tile) {
+                continue;
+            }
+            const int col_base = tile_col << TILE_BITS;
+            const Slot* row_slots = &tile->slots[row_in_tile << TILE_BITS];
+            for (uint64_t mask = tile->row_masks[row_in_tile]; mask != 0; mask &= mask - 1) {
+                const int col_in_tile = storage_detail::CountTrailingZeros(mask);
+                if (col_base + col_in_tile >= col_end) {
+                    return;
+                }
+                func(col_base + col_in_tile, row_slots[col_in_tile]);
+            }
+        }
+    }
+
+    // Обходит все заполненные слоты в порядке хранения: блок за блоком, внутри
+    // блока - по строкам. func(Position pos, const Slot& slot).
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (int tile_row_index = 0; tile_row_index < TILE_ROWS; ++tile_row_index) {
+            const auto& tile_row = tile_rows_[tile_row_index];
+            if (!tile_row) {
+                continue;
+            }
+            for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col) {
+                const Tile* tile = tile_row->tiles[tile_col].get();
+                if (!tile) {
+                    continue;
+                }
+                for (int row_in_tile = 0; row_in_tile < TILE_SIZE; ++row_in_tile) {
+                    const Slot* row_slots = &tile->slots[row_in_tile << TILE_BITS];
+                    for (uint64_t mask = tile->row_masks[row_in_tile]; mask != 0; mask &= mask - 1) {
+                        const int col_in_tile = storage_detail::CountTrailingZeros(mask);
+                        Position pos{ (tile_row_index << TILE_BITS) + row_in_tile, (tile_col << TILE_BITS) + col_in_tile };
+                        func(pos, row_slots[col_in_tile]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Обходит заполненные слоты диапазона range блок за блоком, внутри блока -
+    // по строкам. func(Position pos, const Slot& slot).
+    template <typename Func>
+    void ForEachInRange(const Range& range, Func func) const {
+        for (int tile_row_index = range.first.row >> TILE_BITS; tile_row_index <= range.last.row >> TILE_BITS; ++tile_row_index) {
+            const auto& tile_row = tile_rows_[tile_row_index];
+            if (!tile_row) {
+                continue;
+            }
+            const int row_base = tile_row_index << TILE_BITS;
+            const int row_begin = std::max(range.first.row, row_base) - row_base;
+            const int row_last = std::min(range.last.row, row_base + TILE_MASK) - row_base;
+            for (int tile_col = range.first.col >> TILE_BITS; tile_col <= range.last.col >> TILE_BITS; ++tile_col) {
+                const Tile* tile = tile_row->tiles[tile_col].get();
+                if (!tile) {
+                    continue;
+                }
+                const int col_base = tile_col << TILE_BITS;
+                const uint64_t col_mask = storage_detail::BitRange(std::max(range.first.col, col_base) - col_base,
+                    std::min(range.last.col, col_base + TILE_MASK) - col_base);
+                for (int row_in_tile = row_begin; row_in_tile <= row_last; ++row_in_tile) {
+                    const Slot* row_slots = &tile->slots[row_in_tile << TILE_BITS];
+                    for (uint64_t mask = tile->row_masks[row_in_tile] & col_mask; mask != 0; mask &= mask - 1) {
+                        const int col_in_tile = storage_detail::CountTrailingZeros(mask);
+                        func(Position{ row_base + row_in_tile, col_base + col_in_tile }, row_slots[col_in_tile]);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr int TILE_MASK = TILE_SIZE - 1;
+
+    static_assert(TILE_SIZE <= 64, "row mask of a tile must fit into uint64_t");
+
+    struct Tile {
+        std::array<Slot, TILE_SIZE * TILE_SIZE> slots{};
+        std::array<uint64_t, TILE_SIZE> row_masks{};
+        int size = 0;
+    };
+
+    struct TileRow {
+        std::array<std::unique_ptr<Tile>, TILE_COLS> tiles{};
+        int size = 0;
+    };
+
+    static size_t SlotIndex(Position pos) {
+        return (static_cast<size_t>(pos.row & TILE_MASK) << TILE_BITS) | static_cast<size_t>(pos.col & TILE_MASK);
+    }
+
+    static uint64_t ColumnBit(int col) {
+        return uint64_t{ 1 } << (col & TILE_MASK);
+    }
+
+    static bool IsInside(Position pos) {
+        return pos.row >= 0 && pos.col >= 0 && pos.row < Position::MAX_ROWS && pos.col < Position::MAX_COLS;
+    }
+
+    const Tile* FindTile(Position pos) const {
+        assert(IsInside(pos));
+        const auto& tile_row = tile_rows_[pos.row >> TILE_BITS];
+        return tile_row ? tile_row->tiles[pos.col >> TILE_BITS].get() : nullptr;
+    }
+    Tile* FindTile(Position pos) {
+        return const_cast<Tile*>(static_cast<const TiledStorage*>(this)->FindTile(pos));
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        assert(IsInside(pos));
+        auto& tile_row = tile_rows_[pos.row >> TILE_BITS];
+        if (!tile_row) {
+            tile_row = std::make_unique<TileRow>();
+            ++tile_row_count_;
+        }
+        auto& tile = tile_row->tiles[pos.col >> TILE_BITS];
+        if (!tile) {
+            tile = std::make_unique<Tile>();
+            ++tile_row->size;
+            ++tile_count_;
+        }
+        return *tile;
+    }
+
+    void RemoveTile(Position pos) {
+        auto& tile_row = tile_rows_[pos.row >> TILE_BITS];
+        tile_row->tiles[pos.col >> TILE_BITS].reset();
+        --tile_count_;
+        if (--tile_row->size == 0) {
+            tile_row.reset();
+            --tile_row_count_;
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<TileRow>> tile_rows_;
+    size_t size_ = 0;
+    size_t tile_count_ = 0;
+    size_t tile_row_count_ = 0;
+};